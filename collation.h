@@ -0,0 +1,84 @@
+/** 一覧・ライブラリの並べ替え順 (UTF-8の文字単位で比べる) */
+#ifndef COLLATION_H
+#define COLLATION_H
+
+#include <Arduino.h>
+
+/** UTF-8を1文字読みコードポイントを返す */
+inline uint32_t decodeUTF8(const char **str)
+{
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(*str);
+  uint32_t c = *(p++);
+
+  if (c >= 0xF0 && p[0] && p[1] && p[2]) {
+    c = ((c & 0x07) << 18) | ((p[0] & 0x3F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+    p += 3;
+  } else if (c >= 0xE0 && p[0] && p[1]) {
+    c = ((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+    p += 2;
+  } else if (c >= 0xC0 && p[0]) {
+    c = ((c & 0x1F) << 6) | (p[0] & 0x3F);
+    p += 1;
+  }
+  *str = reinterpret_cast<const char*>(p);
+  return c;
+}
+
+/**
+ * UTF-8を1文字読み、並べ替え用に正規化したコードポイントを返す
+ * 英字の大小・全角半角・ひらがなカタカナの違いを無視する
+ */
+inline uint32_t nextCollationChar(const char **str)
+{
+  uint32_t c = decodeUTF8(str);
+
+  if (c >= 0xFF01 && c <= 0xFF5E) {   // 全角英数記号 -> 半角
+    c -= 0xFEE0;
+  }
+  if (c >= 0x30A1 && c <= 0x30F6) {   // カタカナ -> ひらがな
+    c -= 0x60;
+  }
+  if (c >= 'A' && c <= 'Z') {
+    c += 'a' - 'A';
+  }
+  return c;
+}
+
+/** ファイル名を比較する (数字部分は数値として比較) */
+inline int compareFilename(const char *a, const char *b)
+{
+  const char *p = a;
+  const char *q = b;
+
+  while (*p && *q) {
+    if (isdigit((uint8_t)*p) && isdigit((uint8_t)*q)) {
+      while (*p == '0') p++;
+      while (*q == '0') q++;
+      const char *ep = p;
+      const char *eq = q;
+      while (isdigit((uint8_t)*ep)) ep++;
+      while (isdigit((uint8_t)*eq)) eq++;
+      if (ep - p != eq - q) {
+        return (ep - p) - (eq - q);
+      }
+      int cmp = strncmp(p, q, ep - p);
+      if (cmp != 0) {
+        return cmp;
+      }
+      p = ep;
+      q = eq;
+      continue;
+    }
+    uint32_t cp = nextCollationChar(&p);
+    uint32_t cq = nextCollationChar(&q);
+    if (cp != cq) {
+      return (cp < cq) ? -1 : 1;
+    }
+  }
+  if (*p || *q) {
+    return *p ? 1 : -1;
+  }
+  return strcmp(a, b);
+}
+
+#endif
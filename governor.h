@@ -0,0 +1,37 @@
+/** CPU周波数の決定方法 (測定区間の負荷から段階を選ぶ。host/ のテストが模擬負荷で確かめる) */
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <Arduino.h>
+
+#define GOV_LEVELS 3                    // CPU周波数の段階数
+#define GOV_UP_LOAD 75                  // この負荷[%]を超えない最低の周波数を選ぶ
+#define GOV_DOWN_LOAD 50                // 下げた後の負荷[%]がこれ以下になる時だけ周波数を下げる
+
+/** CPU周波数の段階[MHz] (APBクロックが80MHzのまま変わらない周波数だけを使う) */
+constexpr uint16_t GOV_MHZ[GOV_LEVELS] = {80, 160, 240};
+
+/**
+ * 測定区間のデコード時間から次の周波数の段階を決める
+ * 負荷の推定値がGOV_UP_LOAD以下になる最低の段階を選ぶ (現在より下げる場合はGOV_DOWN_LOAD以下)
+ * @param level 現在の段階
+ * @param busyUs 区間内のデコード時間の合計[us]
+ * @param windowUs 区間の長さ[us]
+ * @param underrun 区間内にアンダーランがあったか (あれば最高周波数)
+ */
+inline uint8_t governorPolicy(uint8_t level, uint32_t busyUs, uint32_t windowUs, bool underrun)
+{
+  if (underrun || windowUs == 0) {
+    return GOV_LEVELS - 1;
+  }
+  uint64_t work = (uint64_t)busyUs * GOV_MHZ[level] * 100;
+  for (uint8_t i = 0; i < GOV_LEVELS; i++) {
+    uint64_t capacity = (uint64_t)windowUs * GOV_MHZ[i];
+    if (work <= capacity * ((i < level) ? GOV_DOWN_LOAD : GOV_UP_LOAD)) {
+      return i;
+    }
+  }
+  return GOV_LEVELS - 1;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * host/のテストの判定 (失敗を数えて表示し、mainの戻り値にする)
+ */
+#ifndef HOST_CHECK_H
+#define HOST_CHECK_H
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      checkFailures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long va = (long long)(a); \
+    long long vb = (long long)(b); \
+    if (va != vb) { \
+      printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, va, vb); \
+      checkFailures++; \
+    } \
+  } while (0)
+
+/** 結果を表示してmainの戻り値を返す */
+inline int checkResult(const char *name)
+{
+  printf("%s: %s\n", name, checkFailures ? "FAIL" : "OK");
+  return checkFailures ? 1 : 0;
+}
+
+#endif
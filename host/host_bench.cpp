@@ -0,0 +1,106 @@
+/**
+ * ホストで計測するベンチマーク (実機のBENCHMARKと同じ形式のJSONを1行ずつ出力する)
+ * フレームヘッダの表引き・ファイル名の整列 (10〜10000件)・プレイリストの索引作成
+ */
+#include "collation.h"
+#include "mpeg_frame.h"
+#include "playlist_index.h"
+#include <SD.h>
+#include <vector>
+
+#define BENCH_ITERATION 20
+#define BENCH_JSON "{\"version\":\"" __DATE__ " " __TIME__ "\",\"target\":\"host\","
+
+void benchResult(const char *bench, const char *item, uint32_t iteration, uint64_t elapsed_us)
+{
+  printf(BENCH_JSON "\"bench\":\"%s\",\"case\":\"%s\",\"iter\":%lu,\"total_us\":%llu,\"us_per_iter\":%.3f}\n",
+         bench, item, (unsigned long)iteration, (unsigned long long)elapsed_us, (double)elapsed_us / iteration);
+}
+
+/** 同期ワードに続く13ビットの組合せ8192通り */
+void benchFrameHeader()
+{
+  struct MPEGFrameHeader frame;
+  uint32_t valid = 0;
+  uint64_t start = hostClockUs();
+  for (uint16_t i = 0; i < BENCH_ITERATION * 10; i++) {
+    for (uint32_t bits = 0; bits < (1 << 13); bits++) {
+      valid += decodeFrameHeader(0xFFE00000 | (bits << 8), &frame);
+    }
+  }
+  benchResult("decodeFrameHeader", "all_headers", BENCH_ITERATION * 10 * (1 << 13), hostClockUs() - start);
+  if (valid == 0) {
+    printf("no valid header\n");
+  }
+}
+
+bool lessName(const String &a, const String &b)
+{
+  return compareFilename(a.c_str(), b.c_str()) < 0;
+}
+
+/** 一覧の整列 (initDirBuffer()・外部ソートのランと同じ比較) */
+void benchSortNames()
+{
+  const uint16_t sizes[] = {10, 100, 1000, 10000};
+  for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    std::vector<String> names;
+    for (uint16_t j = 0; j < sizes[i]; j++) {
+      char name[48];
+      snprintf(name, sizeof(name), (j % 2) ? "Track %u.mp3" : "トラック%05u.mp3", (j * 7919u) % sizes[i]);
+      names.push_back(String(name));
+    }
+    char item[8];
+    snprintf(item, sizeof(item), "%u", sizes[i]);
+    uint64_t start = hostClockUs();
+    for (uint16_t j = 0; j < BENCH_ITERATION; j++) {
+      std::vector<String> work(names);
+      std::sort(work.begin(), work.end(), lessName);
+    }
+    benchResult("sortNames", item, BENCH_ITERATION, hostClockUs() - start);
+  }
+}
+
+/** 20000行のプレイリストの索引作成 */
+void benchPlaylistIndex()
+{
+  char root[] = "/tmp/host_benchXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    return;
+  }
+  SD.root = root;
+  File file = SD.open("/list.m3u", FILE_WRITE);
+  for (uint32_t i = 0; i < 20000; i++) {
+    char line[48];
+    int len = snprintf(line, sizeof(line), "music/album%03u/track%02u.mp3\n", i / 20, i % 20);
+    file.write(reinterpret_cast<const uint8_t *>(line), len);
+  }
+  file.close();
+
+  uint64_t start = hostClockUs();
+  uint32_t steps = 0;
+  for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+    struct Playlist list;
+    list.file = SD.open("/list.m3u");
+    list.index = SD.open("/list.idx", "w+");
+    struct PlaylistHeader header = {0, 0};
+    list.index.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+    while (!list.complete) {
+      playlistIndexStep(&list);
+      steps++;
+    }
+  }
+  benchResult("playlistIndexStep", "20000_lines", steps, hostClockUs() - start);
+  SD.remove("/list.idx");
+  SD.remove("/list.m3u");
+  SD.rmdir("");
+}
+
+int main()
+{
+  benchFrameHeader();
+  benchSortNames();
+  benchPlaylistIndex();
+  printf(BENCH_JSON "\"bench\":\"done\"}\n");
+  return 0;
+}
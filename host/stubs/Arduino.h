@@ -0,0 +1,107 @@
+/**
+ * ホストビルド用のArduino API
+ * main.cppから切り出したヘッダとhost/のテストが使う分だけを標準ライブラリで実装する
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <esp_heap_caps.h>
+
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+#define LOW 0x0
+#define HIGH 0x1
+
+/** FreeRTOSの排他 (ホストのテストは1スレッドで動かすため何もしない) */
+typedef struct {
+  int owner;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+inline void portENTER_CRITICAL(portMUX_TYPE *mux) { (void)mux; }
+inline void portEXIT_CRITICAL(portMUX_TYPE *mux) { (void)mux; }
+
+/** 起動からの経過時間 (ホストでは最初の呼出しから) */
+inline uint64_t hostClockUs()
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline uint32_t micros() { return (uint32_t)hostClockUs(); }
+inline uint32_t millis() { return (uint32_t)(hostClockUs() / 1000); }
+
+inline std::mt19937 &hostRandom()
+{
+  static std::mt19937 rng(0);
+  return rng;
+}
+
+inline void randomSeed(unsigned long seed) { hostRandom().seed(seed); }
+inline long random(long howbig) { return howbig <= 0 ? 0 : (long)(hostRandom()() % (unsigned long)howbig); }
+inline long random(long howsmall, long howbig) { return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall); }
+
+/** Arduino Stringの一部 */
+class String {
+  public:
+    String() {}
+    String(const char *str) : s(str ? str : "") {}
+    String(const std::string &str) : s(str) {}
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.length(); }
+    bool isEmpty() const { return s.empty(); }
+    void clear() { s.clear(); }
+    bool concat(const String &str) { s += str.s; return true; }
+    bool startsWith(const String &str) const { return s.compare(0, str.s.size(), str.s) == 0; }
+    bool endsWith(const String &str) const
+    {
+      return s.size() >= str.s.size() && s.compare(s.size() - str.s.size(), str.s.size(), str.s) == 0;
+    }
+    int lastIndexOf(char ch) const { size_t pos = s.rfind(ch); return pos == std::string::npos ? -1 : (int)pos; }
+    String substring(unsigned int left, unsigned int right) const { return String(s.substr(left, right - left)); }
+    String substring(unsigned int left) const { return String(s.substr(min((size_t)left, s.size()))); }
+
+    String &operator+=(const String &rhs) { s += rhs.s; return *this; }
+    friend String operator+(const String &lhs, const String &rhs) { return String(lhs.s + rhs.s); }
+    bool operator==(const String &rhs) const { return s == rhs.s; }
+    bool operator!=(const String &rhs) const { return s != rhs.s; }
+
+  private:
+    std::string s;
+};
+
+/** シリアル出力 (標準出力に書く) */
+class HostSerial {
+  public:
+    void begin(unsigned long baud) { (void)baud; }
+    int availableForWrite() { return 4096; }
+    size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, stdout); }
+    size_t print(const char *str) { return fputs(str, stdout) < 0 ? 0 : strlen(str); }
+    size_t println(const char *str = "") { return print(str) + print("\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+      va_list args;
+      va_start(args, format);
+      int len = vprintf(format, args);
+      va_end(args);
+      return len < 0 ? 0 : len;
+    }
+};
+
+static HostSerial Serial __attribute__((unused));
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * ホストビルド用のFile (ホストのファイルをstdioで読み書きする)
+ * 複製したFileは同じファイルを指し、最後の1つが閉じるか破棄されると閉じる
+ */
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+class File {
+  public:
+    File() {}
+    File(FILE *fp, const char *path) : fp(fp, fclose), filePath(path) {}
+
+    explicit operator bool() const { return fp != nullptr; }
+
+    size_t read(uint8_t *buf, size_t size) { return fp ? fread(buf, 1, size, fp.get()) : 0; }
+    int read()
+    {
+      uint8_t c;
+      return read(&c, 1) == 1 ? c : -1;
+    }
+    size_t write(const uint8_t *buf, size_t size) { return fp ? fwrite(buf, 1, size, fp.get()) : 0; }
+    bool seek(uint32_t pos) { return fp && fseek(fp.get(), pos, SEEK_SET) == 0; }
+    size_t position() const { return fp ? ftell(fp.get()) : 0; }
+    size_t size() const
+    {
+      if (!fp) {
+        return 0;
+      }
+      long pos = ftell(fp.get());
+      fseek(fp.get(), 0, SEEK_END);
+      long end = ftell(fp.get());
+      fseek(fp.get(), pos, SEEK_SET);
+      return end;
+    }
+    int available() const { return size() - position(); }
+    void flush() { if (fp) fflush(fp.get()); }
+    void close() { fp.reset(); }
+    const char *path() const { return filePath.c_str(); }
+
+  private:
+    std::shared_ptr<FILE> fp;
+    String filePath;
+};
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * ホストビルド用のSD (カードのパスをホストのディレクトリroot以下に置き換える)
+ */
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class SDFS {
+  public:
+    String root = ".";          //!< カードのルートに当たるホストのディレクトリ
+
+    File open(const String &path, const char *mode = FILE_READ)
+    {
+      std::string m(mode);
+      m += 'b';
+      String host = hostPath(path);
+      FILE *fp = fopen(host.c_str(), m.c_str());
+      return fp ? File(fp, path.c_str()) : File();
+    }
+    bool exists(const String &path)
+    {
+      struct stat st;
+      return stat(hostPath(path).c_str(), &st) == 0;
+    }
+    bool mkdir(const String &path) { return ::mkdir(hostPath(path).c_str(), 0755) == 0; }
+    bool remove(const String &path) { return ::remove(hostPath(path).c_str()) == 0; }
+    bool rmdir(const String &path) { return ::rmdir(hostPath(path).c_str()) == 0; }
+
+  private:
+    String hostPath(const String &path) const { return root + path; }
+};
+
+static SDFS SD;
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * ホストビルド用のheap_caps (内部RAMとPSRAMを容量の決まった2つの領域として模擬する)
+ * 容量を超える確保はNULLを返す。断片化は模擬しない
+ */
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <map>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+/** 模擬するヒープ (容量は各テストが設定する) */
+struct HostHeap {
+  size_t capacity[2] = {0, 0};  //!< 内部RAM・PSRAMの容量[byte]
+  size_t used[2] = {0, 0};      //!< 使用中[byte]
+  std::map<void *, std::pair<int, size_t>> blocks;   //!< 確保した領域の置き場所と大きさ
+};
+
+inline HostHeap &hostHeap()
+{
+  static HostHeap heap;
+  return heap;
+}
+
+inline int hostHeapRegion(uint32_t caps)
+{
+  return (caps & MALLOC_CAP_SPIRAM) ? 1 : 0;
+}
+
+inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  HostHeap &heap = hostHeap();
+  int region = hostHeapRegion(caps);
+  if (heap.used[region] + size > heap.capacity[region]) {
+    return NULL;
+  }
+  void *ptr = malloc(size);
+  if (ptr != NULL) {
+    heap.used[region] += size;
+    heap.blocks[ptr] = std::make_pair(region, size);
+  }
+  return ptr;
+}
+
+inline void heap_caps_free(void *ptr)
+{
+  HostHeap &heap = hostHeap();
+  auto it = heap.blocks.find(ptr);
+  if (it == heap.blocks.end()) {
+    return;
+  }
+  heap.used[it->second.first] -= it->second.second;
+  heap.blocks.erase(it);
+  free(ptr);
+}
+
+inline size_t heap_caps_get_free_size(uint32_t caps)
+{
+  int region = hostHeapRegion(caps);
+  return hostHeap().capacity[region] - hostHeap().used[region];
+}
+
+#endif
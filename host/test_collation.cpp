@@ -0,0 +1,58 @@
+/**
+ * compareFilename()の並び順 (数字は数値順、大小・全角半角・かなの違いは同じ文字とみなす)
+ */
+#include "check.h"
+#include "collation.h"
+#include <vector>
+
+bool lessName(const char *a, const char *b)
+{
+  return compareFilename(a, b) < 0;
+}
+
+int main()
+{
+  const char *utf8 = "aé漢🎵";
+  const char *p = utf8;
+  CHECK_EQ(decodeUTF8(&p), 'a');
+  CHECK_EQ(decodeUTF8(&p), 0xE9);
+  CHECK_EQ(decodeUTF8(&p), 0x6F22);
+  CHECK_EQ(decodeUTF8(&p), 0x1F3B5);
+  CHECK(*p == '\0');
+
+  CHECK(compareFilename("track2.mp3", "track10.mp3") < 0);
+  CHECK(compareFilename("track10.mp3", "track2.mp3") > 0);
+  CHECK(compareFilename("track002.mp3", "track10.mp3") < 0);
+  CHECK(compareFilename("abc", "ABD") < 0);
+  CHECK(compareFilename("ＡＢＣ", "abd") < 0);               // 全角英字
+  CHECK(compareFilename("カ", "き") < 0);                     // カタカナとひらがな
+  CHECK(compareFilename("abc", "abcd") < 0);
+  CHECK(compareFilename("same", "same") == 0);
+  // 同じとみなす文字だけが違えば元のバイト列で順を決める (全順序になる)
+  CHECK(compareFilename("ABC", "abc") != 0);
+  CHECK((compareFilename("ABC", "abc") < 0) == (compareFilename("abc", "ABC") > 0));
+  CHECK(compareFilename("01.mp3", "1.mp3") != 0);
+
+  const char *expected[] = {
+    "01 Intro.mp3", "1 intro.mp3", "2 Song.mp3", "10 Song.mp3", "100 Song.mp3",
+    "album", "Album 2", "Album 10", "あいう", "カキク", "きく", "漢字"
+  };
+  const size_t count = sizeof(expected) / sizeof(expected[0]);
+  std::vector<const char *> names(expected, expected + count);
+  std::reverse(names.begin(), names.end());
+  std::sort(names.begin(), names.end(), lessName);
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(names[i], expected[i]) != 0) {
+      printf("position %zu: %s (expected %s)\n", i, names[i], expected[i]);
+      checkFailures++;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < count; j++) {
+      int ab = compareFilename(expected[i], expected[j]);
+      int ba = compareFilename(expected[j], expected[i]);
+      CHECK((ab < 0) == (ba > 0) && (ab == 0) == (i == j));
+    }
+  }
+  return checkResult("collation");
+}
@@ -0,0 +1,47 @@
+/**
+ * decodeFrameHeader()の既知のヘッダと不正値
+ * (全ビットの組合せは tools/framecheck.py が規格の式と比べる)
+ */
+#include "check.h"
+#include "mpeg_frame.h"
+
+/** ヘッダを解釈し、各項目を期待値と比べる */
+void checkHeader(uint32_t header, uint8_t version, uint8_t layer, uint16_t bitrate, uint16_t rate,
+                 uint16_t samples, uint16_t frameSize)
+{
+  struct MPEGFrameHeader frame = {0};
+  CHECK(decodeFrameHeader(header, &frame));
+  CHECK_EQ(frame.version, version);
+  CHECK_EQ(frame.layer, layer);
+  CHECK_EQ(frame.bitrate, bitrate);
+  CHECK_EQ(frame.sampling_rate, rate);
+  CHECK_EQ(frame.samples, samples);
+  CHECK_EQ(frame.frame_size, frameSize);
+}
+
+int main()
+{
+  checkHeader(0xFFFB9064, 3, 3, 128, 44100, 1152, 417);   // MPEG-1 Layer III 128kbps
+  checkHeader(0xFFFB9264, 3, 3, 128, 44100, 1152, 418);   // パディングあり
+  checkHeader(0xFFFBE444, 3, 3, 320, 48000, 1152, 960);
+  checkHeader(0xFFF39064, 2, 3, 80, 22050, 576, 261);     // MPEG-2 Layer III
+  checkHeader(0xFFE39064, 0, 3, 80, 11025, 576, 522);     // MPEG-2.5 Layer III
+  checkHeader(0xFFFDA000, 3, 2, 192, 44100, 1152, 626);   // MPEG-1 Layer II
+  checkHeader(0xFFFFC200, 3, 1, 384, 44100, 384, 420);    // MPEG-1 Layer I パディングあり
+
+  struct MPEGFrameHeader frame = {0};
+  struct MPEGFrameHeader crc = {0};
+  CHECK(decodeFrameHeader(0xFFFA9064, &crc));
+  CHECK_EQ(crc.crc, 1);
+  CHECK(decodeFrameHeader(0xFFFB9064, &frame));
+  CHECK_EQ(frame.crc, 0);
+  CHECK_EQ(frame.channel, 1);                               // ジョイントステレオ
+
+  CHECK(!decodeFrameHeader(0x7FFB9064, &frame));            // 同期ワードなし
+  CHECK(!decodeFrameHeader(0xFFEB9064, &frame));            // バージョン予約値
+  CHECK(!decodeFrameHeader(0xFFF99064, &frame));            // レイヤ予約値
+  CHECK(!decodeFrameHeader(0xFFFB0064, &frame));            // フリーフォーマット
+  CHECK(!decodeFrameHeader(0xFFFBF064, &frame));            // ビットレート不正値
+  CHECK(!decodeFrameHeader(0xFFFB9C64, &frame));            // サンプリングレート予約値
+  return checkResult("frame_header");
+}
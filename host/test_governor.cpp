@@ -0,0 +1,102 @@
+/**
+ * governorPolicy()を模擬負荷で動かし、デコードが間に合わない区間と周波数の行き来を調べる
+ * 負荷は240MHzでの区間内のデコード時間の割合[%]で与え、選んだ周波数での負荷に換算して渡す
+ * デコード時間の一部 (メモリ待ち) は周波数によらないため、換算は周波数に比例しない
+ * 区間内で間に合わなければアンダーランとして次の区間の周波数を決める
+ */
+#include "check.h"
+#include "governor.h"
+
+#define WINDOW_US 500000
+#define WINDOWS 32
+#define SCALED_PERCENT 70               // デコード時間のうち周波数に反比例する部分[%]
+
+/** 模擬の結果 */
+struct GovernorRun {
+  uint32_t overload;            //!< 間に合わなかった区間の数
+  uint32_t overloadRun;         //!< 間に合わない区間が続いた最長の数
+  uint32_t switches;            //!< 周波数を変えた回数
+  uint32_t lastSwitch;          //!< 最後に周波数を変えた区間 (0: なし)
+};
+
+/** 区間毎の負荷loadを順に与える (最高周波数から始める) */
+struct GovernorRun simulate(const uint8_t *load, uint32_t windows)
+{
+  struct GovernorRun run = {0, 0, 0, 0};
+  uint8_t level = GOV_LEVELS - 1;
+  uint32_t overloadRun = 0;
+
+  for (uint32_t i = 0; i < windows; i++) {
+    uint64_t scaled = (uint64_t)SCALED_PERCENT * GOV_MHZ[GOV_LEVELS - 1] / GOV_MHZ[level] + (100 - SCALED_PERCENT);
+    uint32_t busy = (uint64_t)WINDOW_US * load[i] * scaled / 100 / 100;
+    bool underrun = busy > WINDOW_US;
+    if (underrun) {
+      run.overload++;
+      overloadRun++;
+      busy = WINDOW_US;
+    } else {
+      overloadRun = 0;
+    }
+    run.overloadRun = overloadRun > run.overloadRun ? overloadRun : run.overloadRun;
+    uint8_t next = governorPolicy(level, busy, WINDOW_US, underrun);
+    if (next != level) {
+      run.switches++;
+      run.lastSwitch = i + 1;
+    }
+    level = next;
+  }
+  return run;
+}
+
+int main()
+{
+  uint8_t load[WINDOWS];
+
+  // 一定の負荷: 最高周波数で間に合う限り一度も遅れず、最初の2区間で落ち着く
+  for (uint8_t percent = 1; percent <= 100; percent++) {
+    for (uint32_t i = 0; i < WINDOWS; i++) {
+      load[i] = percent;
+    }
+    struct GovernorRun run = simulate(load, WINDOWS);
+    if (run.overload != 0 || run.switches > 2 || run.lastSwitch > 2) {
+      printf("constant %u%%: overload %u, switches %u\n", percent, run.overload, run.switches);
+      checkFailures++;
+    }
+  }
+
+  // 負荷が変わる曲 (VBR・クロスフェード): 遅れても次の区間で取り戻し、変化の後は行き来しない
+  const uint8_t vbr[WINDOWS] = {
+    15, 20, 45, 60, 30, 15, 15, 50, 70, 40, 20, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+  };
+  struct GovernorRun run = simulate(vbr, WINDOWS);
+  CHECK(run.overloadRun <= 1);
+  CHECK(run.lastSwitch <= 16);
+
+  uint8_t crossfade[WINDOWS];
+  for (uint32_t i = 0; i < WINDOWS; i++) {
+    crossfade[i] = (i >= 4 && i < 12) ? 26 : 12;
+  }
+  run = simulate(crossfade, WINDOWS);
+  CHECK_EQ(run.overloadRun, 0);
+  CHECK(run.switches <= 3);
+
+  // 区間毎に揺れる負荷: 周波数の境目のどこでも揺れの上側で間に合い、落ち着いた後は行き来しない
+  for (uint8_t percent = 5; percent <= 70; percent++) {
+    for (uint32_t i = 0; i < WINDOWS; i++) {
+      load[i] = (i % 2) ? percent - percent / 8 : percent + percent / 8;   // VBRの区間毎の揺れ
+    }
+    run = simulate(load, WINDOWS);
+    if (run.overload != 0 || run.switches > 2 || run.lastSwitch > WINDOWS / 2) {
+      printf("jitter %u%%: overload %u, switches %u\n", percent, run.overload, run.switches);
+      checkFailures++;
+    }
+  }
+
+  // アンダーランがあれば負荷によらず最高周波数
+  for (uint8_t level = 0; level < GOV_LEVELS; level++) {
+    CHECK_EQ(governorPolicy(level, 0, WINDOW_US, true), GOV_LEVELS - 1);
+  }
+  CHECK_EQ(governorPolicy(0, 0, 0, false), GOV_LEVELS - 1);
+  return checkResult("governor");
+}
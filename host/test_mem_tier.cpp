@@ -0,0 +1,107 @@
+/**
+ * memAlloc()の配置を内部RAMだけの構成とPSRAMのある構成で模擬する
+ * 再生中の主な領域 (クロスフェード中の2系統・索引・キャッシュ) を確保し、内部RAMの使用量と確保の失敗を比べる
+ * 大きさはmain.cppの定義に合わせる (スプライトはLovyanGFXが確保するため含めない)
+ */
+#include "check.h"
+#include "mem_tier.h"
+
+struct MemStats memStats[MEM_TIER_NUM];
+bool memPsram = false;
+portMUX_TYPE memMux = portMUX_INITIALIZER_UNLOCKED;
+
+#define INTERNAL_FREE (120 * 1024)      // 起動後に残る内部RAMの概算
+#define PSRAM_SIZE (4 * 1024 * 1024)
+
+/** 再生中に確保する領域 */
+const struct {
+  const char *name;
+  size_t size;
+  enum MemTier tier;
+} blocks[] = {
+  {"mp3Space", 28 * 1024, mem_fast},            // AudioGeneratorMP3::preAllocSize()の概算
+  {"mp3Space", 28 * 1024, mem_fast},
+  {"readahead", 32768, mem_bulk},               // READAHEAD_MAX
+  {"readahead", 32768, mem_bulk},
+  {"subscript", 2000 * sizeof(uint16_t), mem_bulk},           // 2000曲のシャッフル索引
+  {"glyphCache", 64 * 48, mem_bulk},                          // GLYPH_CACHE_SIZE * sizeof(struct Glyph)
+  {"durations", 256 * (sizeof(uint32_t) + sizeof(int16_t)), mem_bulk},   // DURATION_CACHE_SIZE
+  {"playlist.order", 10000 * sizeof(uint32_t), mem_bulk},     // 10000曲のプレイリストのシャッフル順
+};
+const size_t BLOCK_NUM = sizeof(blocks) / sizeof(blocks[0]);
+
+/** 模擬の結果 */
+struct Layout {
+  size_t internalUsed;
+  size_t psramUsed;
+  uint32_t failed;
+};
+
+/** 容量を設定して全ての領域を確保し、使用量を調べてから解放する */
+struct Layout simulate(const char *name, bool psram, size_t psramSize)
+{
+  struct Layout layout = {0, 0, 0};
+  void *ptr[BLOCK_NUM];
+
+  hostHeap().capacity[0] = INTERNAL_FREE;
+  hostHeap().capacity[1] = psramSize;
+  memPsram = psram;
+  for (uint8_t i = 0; i < MEM_TIER_NUM; i++) {
+    memStats[i] = MemStats();
+  }
+
+  for (size_t i = 0; i < BLOCK_NUM; i++) {
+    ptr[i] = memAlloc(blocks[i].size, blocks[i].tier);
+    layout.failed += (ptr[i] == NULL);
+  }
+  layout.internalUsed = hostHeap().used[0];
+  layout.psramUsed = hostHeap().used[1];
+  printf("{\"target\":\"host\",\"sim\":\"mem_layout\",\"layout\":\"%s\",\"internal_used\":%zu,\"internal_free\":%zu,"
+         "\"psram_used\":%zu,\"failed\":%u,\"spilled\":%u}\n",
+         name, layout.internalUsed, heap_caps_get_free_size(MALLOC_CAP_INTERNAL), layout.psramUsed,
+         layout.failed, memStats[mem_bulk].spilled);
+
+  for (size_t i = 0; i < BLOCK_NUM; i++) {
+    memFree(ptr[i]);
+  }
+  CHECK_EQ(hostHeap().used[0], 0);
+  CHECK_EQ(hostHeap().used[1], 0);
+  CHECK_EQ(memStats[mem_fast].bytes, 0);
+  CHECK_EQ(memStats[mem_bulk].bytes, 0);
+  CHECK_EQ(memStats[mem_bulk].psramBytes, 0);
+  return layout;
+}
+
+int main()
+{
+  size_t fastBytes = 0;                 // ヒープ上の大きさ (MemHeaderを含む)
+  size_t bulkBytes = 0;
+  size_t bulkSize = 0;                  // 要求した大きさ (memStatsが数える)
+  for (size_t i = 0; i < BLOCK_NUM; i++) {
+    (blocks[i].tier == mem_fast ? fastBytes : bulkBytes) += blocks[i].size + sizeof(struct MemHeader);
+    bulkSize += (blocks[i].tier == mem_bulk) ? blocks[i].size : 0;
+  }
+
+  // 内部RAMだけ: 全て内部RAMに置き、入りきらない索引は確保に失敗する (呼出し側は機能を諦める)
+  struct Layout internal = simulate("internal", false, 0);
+  CHECK_EQ(internal.psramUsed, 0);
+  CHECK(internal.failed > 0);
+  CHECK_EQ(internal.failed, memStats[mem_fast].failures + memStats[mem_bulk].failures);
+  CHECK_EQ(memStats[mem_fast].failures, 0);       // デコーダの領域は先に確保するため足りる
+
+  // PSRAMあり: bulk階層だけがPSRAMに移り、内部RAMにはfast階層だけが残る
+  struct Layout psram = simulate("psram", true, PSRAM_SIZE);
+  CHECK_EQ(psram.failed, 0);
+  CHECK_EQ(psram.internalUsed, fastBytes);
+  CHECK_EQ(psram.psramUsed, bulkBytes);
+  CHECK_EQ(memStats[mem_bulk].spilled, 0);
+  CHECK_EQ(memStats[mem_bulk].peak, bulkSize);
+  CHECK(psram.internalUsed < internal.internalUsed);
+
+  // PSRAMが一杯: 入らないbulk階層の領域は内部RAMに置く
+  struct Layout spill = simulate("psram_full", true, 64 * 1024);
+  CHECK(memStats[mem_bulk].spilled > 0);
+  CHECK(spill.psramUsed <= 64 * 1024);
+  CHECK(spill.internalUsed > fastBytes);
+  return checkResult("mem_tier");
+}
@@ -0,0 +1,81 @@
+/**
+ * playlistIndexStep()の索引 (BOM・コメント行・空行・CRLF・チャンク境界をまたぐ行)
+ * 20000行のプレイリストで1回の呼出しがPLAYLIST_CHUNKバイトだけ進むことも確かめる
+ */
+#include "check.h"
+#include "playlist_index.h"
+#include <SD.h>
+#include <vector>
+
+#define TEST_LINES 20000
+
+/** プレイリストを作り、索引に載るべき行の先頭位置を返す */
+std::vector<uint32_t> writePlaylist(const char *path)
+{
+  std::vector<uint32_t> expected;
+  std::string text = "\xEF\xBB\xBF#EXTM3U\r\n";
+  for (uint32_t i = 0; i < TEST_LINES; i++) {
+    if (i % 7 == 0) {
+      text += "#EXTINF:123,Artist - Title\r\n";
+    }
+    if (i % 11 == 0) {
+      text += "\r\n";
+    }
+    expected.push_back(text.size());
+    char line[64];
+    snprintf(line, sizeof(line), "%s/track%05u.mp3%s", (i % 3) ? "dir" : "/music/dir", i, (i % 5) ? "\n" : "\r\n");
+    text += line;
+  }
+  File file = SD.open(path, FILE_WRITE);
+  file.write(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+  file.close();
+  return expected;
+}
+
+int main()
+{
+  char root[] = "/tmp/playlist_indexXXXXXX";
+  CHECK(mkdtemp(root) != NULL);
+  SD.root = root;
+
+  std::vector<uint32_t> expected = writePlaylist("/list.m3u8");
+  struct Playlist list;
+  list.file = SD.open("/list.m3u8");
+  list.index = SD.open("/list.idx", "w+");
+  struct PlaylistHeader empty = {0, 0};
+  list.index.write(reinterpret_cast<const uint8_t *>(&empty), sizeof(empty));
+
+  uint32_t steps = 0;
+  uint32_t size = list.file.size();
+  while (!list.complete) {
+    uint32_t before = list.scanPos;
+    playlistIndexStep(&list);
+    CHECK(list.scanPos - before <= PLAYLIST_CHUNK);
+    steps++;
+  }
+  CHECK_EQ(list.scanPos, size);
+  CHECK_EQ(steps, size / PLAYLIST_CHUNK + 1);
+  CHECK_EQ(list.count, expected.size());
+
+  struct PlaylistHeader header;
+  list.index.seek(0);
+  CHECK_EQ(list.index.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)), sizeof(header));
+  CHECK_EQ(header.size, size);
+  CHECK_EQ(header.count, expected.size());
+
+  std::vector<uint32_t> offsets(list.count);
+  CHECK_EQ(list.index.read(reinterpret_cast<uint8_t *>(offsets.data()), offsets.size() * sizeof(uint32_t)),
+           offsets.size() * sizeof(uint32_t));
+  uint32_t wrong = 0;
+  for (size_t i = 0; i < offsets.size() && i < expected.size(); i++) {
+    wrong += (offsets[i] != expected[i]);
+  }
+  CHECK_EQ(wrong, 0);
+
+  list.index.close();
+  list.file.close();
+  SD.remove("/list.idx");
+  SD.remove("/list.m3u8");
+  SD.rmdir("");
+  return checkResult("playlist_index");
+}
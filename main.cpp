@@ -1,75 +1,288 @@
 #include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include <new>
 
 #define LGFX_USE_V1
 
 #include <SD.h>
+#include <sd_diskio.h>
+extern "C" {
+#include "diskio_impl.h"
+}
+#include <Preferences.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 #include <LovyanGFX.hpp>
 #include <U8g2_for_LovyanGFX.h>
 
 #include <AudioFileSourceSD.h>
-#include <AudioFileSourceID3.h>
+#include <AudioFileSourceBuffer.h>
 #include <AudioGeneratorMP3.h>
 #include <AudioOutputI2S.h>
 
-#define X_PIXEL 128
-#define Y_PIXEL 64
+#include "mpeg_frame.h"
+#include "collation.h"
+#include "playlist_index.h"
+#include "governor.h"
+#include "mem_tier.h"
+
+/**********************************
+ *             構成
+ **********************************/
+// ボードと機能はビルド時に -DPLAYER_BOARD=... -DPLAYER_FEATURES=... で選ぶ
+// 無効にした機能は呼出し側の条件が定数になる (サイズの差は tools/sizereport.py で比べる)
+
+#define BOARD_DEVKIT 0                  // ESP32-DevKitC + I2S DAC + SSD1306 (I2C)
+
+#define FEATURES_FULL 0                 // 全機能
+#define FEATURES_BASELINE 1             // フォルダ再生のみ (サイズ比較の基準)
+
+#ifndef PLAYER_BOARD
+#define PLAYER_BOARD BOARD_DEVKIT
+#endif
+#ifndef PLAYER_FEATURES
+#define PLAYER_FEATURES FEATURES_FULL
+#endif
+
+/** ESP32-DevKitC のピン配置 */
+namespace board_devkit {
+  constexpr uint8_t prev = 14;
+  constexpr uint8_t play = 26;
+  constexpr uint8_t next = 27;
+  constexpr uint8_t back = 13;
+  constexpr uint8_t volUp = 16;
+  constexpr uint8_t volDown = 17;
+
+  constexpr uint8_t i2sDout = 32;
+  constexpr uint8_t i2sBclk = 33;
+  constexpr uint8_t i2sLrc = 25;
+  constexpr int i2sMode = 0;            //!< AudioOutputI2S::EXTERNAL_I2S (外付けDAC)
+
+  constexpr uint8_t i2cPort = 1;        //!< 表示パネルのI2C
+  constexpr uint8_t sda = 21;
+  constexpr uint8_t scl = 22;
+}
+
+/** 0.96インチ 128x64 SSD1306 (I2C) */
+namespace panel_ssd1306 {
+  typedef lgfx::Panel_SSD1306 Type;
+  constexpr int width = 128;
+  constexpr int height = 64;
+  constexpr uint8_t address = 0x3C;
+  constexpr uint32_t freq = 400000;     //!< I2Cクロック
+}
 
-#define PREV 14
-#define PLAY 26
-#define NEXT 27
-#define BACK 13
+/** 有効にする機能 */
+template <bool Crossfade, bool Visualizer, bool AlbumArt, bool Library, bool Queue, bool Diagnostics, bool PowerSave,
+          bool Durations>
+struct FeatureSet {
+  static constexpr bool crossfade = Crossfade;      //!< クロスフェード (2つ目のデコーダとミキサ)
+  static constexpr bool visualizer = Visualizer;    //!< スペクトラム・レベルメータ
+  static constexpr bool albumArt = AlbumArt;        //!< カバー画像サムネイル
+  static constexpr bool library = Library;          //!< タグによるライブラリ表示
+  static constexpr bool queue = Queue;              //!< 再生キューと一覧表示中の再生
+  static constexpr bool diagnostics = Diagnostics;  //!< トレース・I/O統計・操作の記録と再生 (シリアルコマンド)
+  static constexpr bool powerSave = PowerSave;      //!< CPU周波数の調整と浅い眠り
+  static constexpr bool durations = Durations;      //!< 一覧に曲の長さを表示
+};
 
-#define VOL_UP 16
-#define VOL_DOWN 17
+#if PLAYER_BOARD == BOARD_DEVKIT
+namespace board = board_devkit;
+namespace panel = panel_ssd1306;
+#else
+#error "PLAYER_BOARD is not supported"
+#endif
+
+#if PLAYER_FEATURES == FEATURES_FULL
+typedef FeatureSet<true, true, true, true, true, true, true, true> Features;
+#elif PLAYER_FEATURES == FEATURES_BASELINE
+typedef FeatureSet<false, false, false, false, false, false, false, false> Features;
+#else
+#error "PLAYER_FEATURES is not supported"
+#endif
+
+#define X_PIXEL panel::width
+#define Y_PIXEL panel::height
+
+#define PREV board::prev
+#define PLAY board::play
+#define NEXT board::next
+#define BACK board::back
+
+#define VOL_UP board::volUp
+#define VOL_DOWN board::volDown
 #define INIT_VOLUME 0.5
 #define MAX_VOL 0.5
 
-#define I2S_DOUT 32
-#define I2S_BCLK 33
-#define I2S_LRC 25
-
-#define EXTERNAL_I2S 0
+#define I2S_DOUT board::i2sDout
+#define I2S_BCLK board::i2sBclk
+#define I2S_LRC board::i2sLrc
+
+#define I2S_MODE board::i2sMode
+
+#define I2S_DMA_BUF_LEN 128             // AudioOutputI2Sの1DMAバッファ当たりのサンプル数
+#define DMA_BUF_MIN 4
+#define DMA_BUF_MAX 32
+#define DMA_BUF_INIT 8
+#define READAHEAD_MIN 2048              // 先読みバッファ[byte]
+#define READAHEAD_MAX 32768
+#define READAHEAD_INIT 4096
+#define AUDIO_BUFFER_BUDGET 49152       // 先読み+DMAバッファの上限[byte]
+#define BUFFER_SHRINK_TRACKS 3          // この曲数連続で余裕があればバッファを縮小する
+#define BUFFER_MIN_PLAY_S 30            // 途中で止めた曲はこの時間[s]以上再生していればバッファ調整に使う
+#define BITRATE_CLASS_NUM 4             // ビットレート帯の数 (~128/~192/~256/~320kbps)
+#define CROSSFADE_MS 4000               // クロスフェードの長さ[ms]
+#define CROSSFADE_HEAP_MIN 65536        // 2つ目のデコーダを開始するのに必要な最大確保可能ヒープ[byte]
+#define MIX_BLOCK 256                   // ミキサに渡すブロックのフレーム数
 
 #define ROOT 0
 
 #define N_BUF 50
 #define N_DIR 15
 
+#define LISTING_DIR "/.list"            // N_BUFを超えるディレクトリの整列済み一覧の保存先
+#define MERGE_WAYS 3                    // 外部マージソートで同時に開くランファイル数 (SDの同時オープン数5以内)
+#define PREFIX_MAX 64                   // 頭文字索引の最大数
+#define JUMP_PRESS_TIME 800             // 頭文字ジャンプとする長押し時間[ms]
+
+#define GLYPH_CACHE_SIZE 64             // グリフキャッシュの文字数
+#define GLYPH_MAX 16                    // キャッシュするグリフの最大幅・高さ
+#define UI_TEXT(s) s                    // 組込みフォントで描く固定文字列 (tools/fontsubset.py が文字を集める)
+#if __has_include("ui_font.h")
+#define UI_FONT_SUBSET 1                // tools/fontsubset.py の生成したサブセットフォントを使う (tools/fontsubset_prebuild.py がビルド前に生成)
+#else
+#define UI_FONT_SUBSET 0                // 未生成なら全文字のフォントをリンクする
+#endif
+#define TAG_FONT_PATH "/.font/tag16.fnt" // 曲名・アーティスト名用のフォントファイル (サブセット使用時)
+#define TAG_FONT_FALLBACK 1             // フォントファイルにない曲名の文字を全文字のフォントで描く (0: リンクせず四角を描く)
+#define FONT_PAGE_GLYPHS 64             // フォントファイルの索引を一度に読込む文字数
+#define FONT_PAGE_MAX 256               // フォントファイルの索引ページ数の上限
+#define FONT_INDEX_PAGES 4              // 保持するフォントファイルの索引ページ数
+#define FONT_STORE_SIZE 48              // フォントファイルから読込んで保持する文字数 (再生画面の1行分以上)
+#define FONT_CORE 0
+#define FONT_STACK 4096
+
 #define ICON_WIDTH 14
 #define SEL_LINE_HEIGHT 13
 
 #define MPEGFRAME_HEADER_SIZE 4
+#define MPEG_SYNC_SCAN 8192             // ID3v2タグの後で最初のフレームを探す範囲[byte]
+#define MPEG_SCAN_CHUNK 256             // 同期ワードを探す時の1回の読込量[byte]
 #define ID3v1_SIZE 128
 
 #define FONT_SELECT &helvR08_tf
 
+#define SD_MOUNT_CORE 0                 // SDマウントタスクを実行するコア
+#define SD_MOUNT_STACK 4096
+#define SD_RETRY_INTERVAL 200           // カード未挿入時のSD.begin()再試行間隔[ms]
+#define SD_MOUNT_WAIT 500               // カード挿入画面を出すまでの待ち時間[ms]
+#define SD_MAX_FILES 10                 // 同時に開けるファイル数 (再生・プレイリスト・ライブラリ作成・サムネイル作成が並行する)
+
+#define BENCHMARK 0                     // 1: 起動時にベンチマークを実行し結果をJSONで出力する
+#define BENCH_DIR "/bench"              // ベンチマーク用ディレクトリ (mp3/にMP3ファイルを置く)
+#define BENCH_ITERATION 20
+#define BENCH_JSON "{\"version\":\"" __DATE__ " " __TIME__ "\","   // ベンチマーク結果の各行の先頭 (ビルドを識別する)
+#define BENCH_SOAK_TRACKS 1000          // ヒープ耐久試験で切替える曲数
+#define BENCH_SOAK_LOOPS 50             // 1曲あたりのmp3->loop()回数
+
+#define TRACE_SIZE 1024                 // トレースリングのイベント数 (2の累乗)
+#define TRACE_DRAIN_CMD 'T'             // シリアルで受信するとトレースを出力する
+
+#define IO_STATS_CMD 'I'                // シリアルで受信するとSDのI/O統計を出力する
+#define INPUT_RECORD_CMD 'R'            // シリアルで受信するとボタン操作の記録を開始・終了する
+#define INPUT_REPLAY_CMD 'P'            // シリアルで受信すると記録したボタン操作を再生する
+#define INPUT_TRACE_DIR "/.input"
+#define INPUT_TRACE_PATH "/.input/trace.bin"
+#define INPUT_EVENT_MAX 256             // 記録できるボタンの変化の数
+#define INPUT_SETTLE 3000               // 再生の最後の操作から結果を待つ時間[ms]
+#define IO_SECTOR 512
+#define IO_MERGE_SECTORS 8              // 単一セクタの読込をまとめて読む最大セクタ数 (クラスタ境界は越えない)
+#define IO_TASKS 6                      // I/O種別を設定できるタスク数
+#define IO_YIELD_INTERVAL 10            // 音声の先読みに余裕がない間、後回しにするI/Oを待たせる間隔[ms]
+
+#define ART_SIZE 32                     // カバー画像サムネイルの幅・高さ
+#define ART_X 96
+#define ART_Y 30
+#define ART_CACHE_DIR "/.art"           // サムネイルキャッシュの保存先
+#define ART_PATH_LEN 256
+#define ART_CORE 0
+#define ART_STACK 8192
+
+#define QUEUE_MAX 8                     // 再生キューに入れられる曲数
+#define QUEUE_PATH_LEN 256
+#define QUEUE_NOTICE_MS 700             // キュー追加の結果を表示する時間
+#define QUEUE_CORE 0
+#define QUEUE_STACK 8192
+#define PLAYER_CORE 1                   // 一覧表示中の再生タスク (一覧の処理と同じコアで優先度を上げる)
+#define PLAYER_STACK 8192
+
+#define DURATION_CACHE_SIZE 256         // 一覧に表示する曲の長さを覚えておく曲数
+#define DURATION_CORE 0
+#define DURATION_STACK 6144
+
+#define VIS_N 128                       // FFTの点数 (2の累乗)
+#define VIS_BARS 8                      // スペクトラムの本数
+#define VIS_FPS 20                      // 表示更新レート
+#define VIS_BUDGET_US 2000              // 1フレームの解析に使える時間[us]
+#define VIS_OVER_LIMIT 3                // この回数連続で超過したら簡易表示に切替える
+#define VIS_CORE 0
+#define VIS_STACK 4096
+
+#define DISPLAY_CORE 0                  // 画面転送タスクを実行するコア (音声処理と別のコア)
+#define DISPLAY_STACK 4096
+
+#define GOV_WINDOW_MS 500               // CPU負荷を測る区間
+#define GOV_INPUT_HOLD_MS 2000          // 操作の後に最高周波数を保ち、眠らない時間
+#define GOV_SLEEP_MS 100                // 一時停止中・一覧表示中に1回に眠る最長時間 (ボタンでも起きる)
+#define GOV_YIELD_MAX_MS 20             // DMAキューに余裕がある時に再生処理を休む最長時間
+#define GOV_STATS_CMD 'G'               // シリアルで受信するとCPU周波数・眠りの滞在時間を出力する
+
+#define MEM_STATS_CMD 'M'               // シリアルで受信するとメモリ階層毎の使用量を出力する
+
+#define LIBRARY_DIR "/.lib"             // 曲情報データベースの保存先
+#define LIBRARY_CACHE_DIR "/.lib/cache" // バッファに収まらないライブラリ一覧の保存先 (ライブラリ更新時に削除)
+#define LIBRARY_PLAYLIST "/.lib/query.m3u"  // ライブラリで選択したアルバムの再生用プレイリスト
+#define LIBRARY_ROOT "lib:"             // ライブラリ表示の仮想パス
+#define LIBRARY_TEXT_LEN 40             // レコードに保存するタグの最大バイト数 (終端含む)
+#define ID3_TEXT_MAX 128                // 読込むテキストフレームの最大バイト数
+#define LIBRARY_RUN 128                 // 外部ソートで1度にRAM上で整列するレコード数
+#define LIBRARY_ALBUM_SEP " / "         // アルバム一覧のアルバムとアルバムアーティストの区切り
+#define LIBRARY_VERSION 2               // レコード形式 (異なれば前回のデータベースを使わずに全曲読み直す)
+#define LIBRARY_SCAN_INTERVAL 20        // 1ファイル処理毎の待ち時間[ms]
+#define LIBRARY_CORE 0
+#define LIBRARY_STACK 8192
+
+#define LISTING_CACHE_LINES 5           // 起動時に表示するキャッシュ済みファイル数 (1画面分)
+#define LISTING_CACHE_NAME_LEN 64
+
 #define swap(type, x, y) do { type t = x; x = y; y = t; } while (0)
 
 /**********************************
  *   LovyanGFX ディスプレイ設定
  **********************************/
-class LGFX_SSD1306 : public lgfx::LGFX_Device {
-  lgfx::Panel_SSD1306   _panel_instance;
+class LGFX_Panel : public lgfx::LGFX_Device {
+  panel::Type   _panel_instance;
   lgfx::Bus_I2C   _bus_instance;
 
   public:
-    LGFX_SSD1306() {
+    LGFX_Panel() {
       {
         auto cfg = _bus_instance.config();
-        cfg.i2c_port    = 1;                      //! 使用するI2Cポート (0 or 1)
-        cfg.freq_write  = 400000;                 //! 送信時クロック
-        cfg.freq_read   = 400000;                 //! 受信時クロック
-        cfg.pin_sda     = 21;                     //! SDAピン番号
-        cfg.pin_scl     = 22;                     //! SCLピン番号
-        cfg.i2c_addr    = 0x3C;                   //! I2Cデバイスのアドレス
+        cfg.i2c_port    = board::i2cPort;         //! 使用するI2Cポート (0 or 1)
+        cfg.freq_write  = panel::freq;            //! 送信時クロック
+        cfg.freq_read   = panel::freq;            //! 受信時クロック
+        cfg.pin_sda     = board::sda;             //! SDAピン番号
+        cfg.pin_scl     = board::scl;             //! SCLピン番号
+        cfg.i2c_addr    = panel::address;         //! I2Cデバイスのアドレス
 
         _bus_instance.config(cfg);                //! 設定値をバスに反映
         _panel_instance.setBus(&_bus_instance);   //! バスをパネルにセット
       }
       {
         auto cfg = _panel_instance.config();      //! 表示パネル設定用の構造体を取得します。
-        cfg.memory_width  = 128;                  //! 最大の幅
-        cfg.memory_height =  64;                  //! 最大の高さ
+        cfg.memory_width  = panel::width;         //! 最大の幅
+        cfg.memory_height = panel::height;        //! 最大の高さ
 
         _panel_instance.config(cfg);              //! 設定をパネルに反映
       }
@@ -88,12 +301,22 @@ enum Mode {
   shuffle                       //!< シャッフル
 };
 
+/** ビジュアライザ表示 */
+enum VisMode {
+  vis_off,                      //!< 表示なし
+  vis_spectrum,                 //!< スペクトラム (FFT)
+  vis_meter                     //!< レベルメーター (RMS/ピーク)
+};
+
 /** ボタン入力 */
 enum Button {
   prev,                         //!< 前
   next,                         //!< 次
   play,                         //!< 再生・決定
-  back                          //!< 戻る
+  back,                         //!< 戻る
+  prev_jump,                    //!< 前の頭文字へ (前ボタン長押し)
+  next_jump,                    //!< 次の頭文字へ (次ボタン長押し)
+  enqueue                       //!< 再生キューに追加 (再生ボタン長押し)
 };
 
 enum Btn_Status {
@@ -108,6 +331,7 @@ struct Status {
   float volume = INIT_VOLUME;
   enum Mode mode = normal;      //!< 通常:normal / リピート:repeat / シャッフル:shuffle
   bool pause = false;
+  enum VisMode vis = vis_off;   //!< ビジュアライザ表示
 };
 
 /** 再生中ID3タグ情報 */
@@ -121,9 +345,26 @@ struct ID3tag {
 /** ディレクトリ移動履歴 */
 struct Dir {
   String path;                  //!< パス
-  uint8_t numSelectFile = 0;    //!< 選択したファイル番号 (開始0/上から)
-  uint8_t totalFileCount = 0;   //!< ディレクトリ内のディレクトリを含むファイル数 (開始1)
-  uint8_t dirCount = 0;         //!< ディレクトリ内のディレクトリ数 (開始1)
+  uint16_t numSelectFile = 0;   //!< 選択したファイル番号 (開始0/上から)
+  uint16_t totalFileCount = 0;  //!< ディレクトリ内のディレクトリを含むファイル数 (開始1)
+  uint16_t dirCount = 0;        //!< ディレクトリ内のディレクトリ数 (開始1)
+  uint16_t windowStart = 0;     //!< ファイルリストバッファ先頭のファイル番号
+  bool external = false;        //!< 一覧がバッファに収まらずSD上にあるか
+  uint32_t signature = 0;       //!< 一覧に載せたエントリの署名 (signEntry, SD上の一覧の照合用)
+};
+
+/** 頭文字索引 (整列済み一覧で頭文字が変わる位置) */
+struct PrefixIndex {
+  uint32_t key;                 //!< ディレクトリ/ファイルの別と正規化した先頭文字
+  uint16_t first;               //!< その頭文字の最初のファイル番号
+};
+
+/** SD上の整列済み一覧の索引ファイルヘッダ */
+struct ListingHeader {
+  uint16_t totalFileCount;
+  uint16_t dirCount;
+  uint8_t prefixCount;
+  uint32_t signature;           //!< 作成時のDir::signature (名前の変更・差し替えを検出する)
 };
 
 /** ファイルリストバッファ */
@@ -132,6 +373,65 @@ struct Buffer {
   bool isDir;                   //!< ディレクトリであるか
 };
 
+/** 曲情報データベースのレコード (固定長、artist.dat/album.datにそれぞれの順で整列して保存) */
+struct TrackRecord {
+  char artist[LIBRARY_TEXT_LEN];        //!< アーティスト (UTF-8, 0埋め)
+  char album[LIBRARY_TEXT_LEN];         //!< アルバム
+  char title[LIBRARY_TEXT_LEN];         //!< タイトル
+  char albumArtist[LIBRARY_TEXT_LEN];   //!< アルバムアーティスト (なければ空)
+  uint32_t pathOffset;                  //!< パス一覧 (paths.dat) 上の位置
+  uint16_t duration;                    //!< 長さ[s]
+  uint8_t track;                        //!< トラック番号
+  uint8_t reserved;
+};
+
+/** 曲情報データベースの概要 (library.inf) */
+struct LibraryInfo {
+  uint32_t records;             //!< 曲数
+  uint16_t artists;             //!< アーティスト数
+  uint16_t albums;              //!< アルバム数
+  uint32_t dirs;                //!< ディレクトリ数
+  uint32_t version;             //!< レコード形式 (LIBRARY_VERSION)
+};
+
+/** ディレクトリ毎の走査結果 (dirs.allにパスのハッシュをキーとするハッシュ表で保存) */
+struct DirState {
+  uint32_t hash;                //!< パスのハッシュ (0は空き)
+  uint32_t signature;           //!< 曲ファイルの名前・サイズ・更新日時の署名
+  uint32_t first;               //!< tracks.all上の先頭レコード番号
+  uint32_t count;               //!< 曲数
+};
+
+/** ライブラリ走査の進捗 (NVSに保存し、電源断後に再開する) */
+struct ScanState {
+  uint32_t queuePos;            //!< 次に処理するディレクトリのキュー上の位置
+  uint32_t queueSize;           //!< キュー (queue.tmp) の確定済みサイズ
+  uint32_t records;             //!< tracks.newの確定済みレコード数
+  uint32_t pathsSize;           //!< paths.newの確定済みサイズ
+  uint32_t dirs;                //!< dirs.newの確定済みエントリ数
+  uint32_t changed;             //!< タグを読み直したディレクトリ数
+  uint32_t entries;             //!< 署名を求めた曲ファイル数
+  uint32_t signUs;              //!< 署名 (ディレクトリの一覧) に要した時間[us]
+};
+
+/**
+ * レコードの整列順
+ * 曲名順・長さ順は一覧で選べる画面がないため作らない (1つ増やす毎に全曲分の外部ソートとSD容量が要る)
+ */
+enum LibraryOrder {
+  by_artist,                    //!< アーティスト, アルバム, トラック番号, タイトル
+  by_album                      //!< アルバム, アルバムアーティスト, トラック番号, タイトル
+};
+
+/** ライブラリ一覧の書出し先 */
+struct ListingWriter {
+  struct Dir *dir;
+  struct Buffer *buf;
+  uint16_t total;               //!< 件数の見込み (頭文字索引の間引き用)
+  File dat;                     //!< N_BUF件を超えた場合のSD上の一覧
+  File idx;
+};
+
 #pragma pack(1)                 // 境界調整(パディングなし)
 /** ID3v2ヘッダ */
 struct ID3v2Header {
@@ -150,6 +450,16 @@ struct ID3v2ExtHeader {
 };
 #pragma pack()
 
+/** 読込むID3v2テキストフレーム */
+enum ID3Text {
+  id3_artist,                   //!< TPE1 (v2.2: TP1)
+  id3_album,                    //!< TALB (v2.2: TAL)
+  id3_title,                    //!< TIT2 (v2.2: TT2)
+  id3_track,                    //!< TRCK (v2.2: TRK)
+  id3_album_artist,             //!< TPE2 (v2.2: TP2)
+  ID3_TEXT_NUM
+};
+
 #pragma pack(1)
 /** ID3v2フレーム */
 struct ID3v2Frame {
@@ -173,12 +483,508 @@ struct XingHeader {
 };
 #pragma pack()
 
-/** MPEGフレームヘッダ */
-struct MPEGFrameHeader {
-  uint16_t bitrate;             //!< ビットレート
-  uint16_t sampling_rate;       //!< サンプリングレート
-  uint8_t padding_bit;          //!< パディングビット
-  uint8_t channel;              //!< チャンネル
+/** 充填量を推定しアンダーランを検出するI2S出力 */
+class AudioOutputI2SMonitor : public AudioOutputI2S {
+  public:
+    const uint8_t dmaCount;     //!< DMAバッファ数
+    const int32_t capacity;     //!< DMAキュー容量[サンプル]
+    uint32_t underrun = 0;      //!< アンダーラン回数
+    int32_t minFill = 0;        //!< DMAキュー最小充填量[サンプル]
+    uint32_t maxDecode = 0;     //!< mp3->loop() 1回の最大所要時間[us]
+    uint32_t consumed = 0;      //!< 曲の開始から出力したサンプル数
+    void (*tap)(const int16_t sample[2]) = NULL;   //!< デコード済みサンプルの取得先
+
+    AudioOutputI2SMonitor(int port, int output_mode, uint8_t dma_buf_count)
+      : AudioOutputI2S(port, output_mode, dma_buf_count), dmaCount(dma_buf_count), capacity(dma_buf_count * I2S_DMA_BUF_LEN) {}
+
+    bool begin() override
+    {
+      reset();
+      running = true;
+      return AudioOutputI2S::begin();
+    }
+
+    bool stop() override
+    {
+      running = false;
+      return AudioOutputI2S::stop();
+    }
+
+    bool ConsumeSample(int16_t sample[2]) override
+    {
+      if (!AudioOutputI2S::ConsumeSample(sample)) {
+        fill = capacity;        // 書込めない = DMAキューが満杯
+        primed = true;
+        return false;
+      }
+      fill++;
+      consumed++;
+      if (tap != NULL) {
+        tap(sample);
+      }
+      return true;
+    }
+
+    int32_t getFill() { return fill; }
+    bool isRunning() { return running; }
+    int getRate() { return hertz; }
+
+    /** 統計と充填量推定を曲の開始時の状態に戻す */
+    void reset()
+    {
+      fill = 0;
+      primed = false;
+      underrun = 0;
+      minFill = capacity;
+      maxDecode = 0;
+      consumed = 0;
+      lastTime = micros();
+      remainder = 0;
+    }
+
+    /**
+     * 経過時間分の再生済みサンプルを差し引く (mp3->loop()毎に呼出)
+     * @return アンダーランを検出した場合 true
+     */
+    bool update(uint32_t decode_us)
+    {
+      uint32_t now = micros();
+      uint64_t played = (uint64_t)(now - lastTime) * hertz + remainder;
+      lastTime = now;
+      remainder = played % 1000000;
+
+      if (decode_us > maxDecode) {
+        maxDecode = decode_us;
+      }
+      if (!running || !primed) {
+        return false;
+      }
+
+      fill -= played / 1000000;
+      if (fill < minFill) {
+        minFill = max(fill, (int32_t)0);
+      }
+      if (fill < 0) {
+        fill = 0;
+        underrun++;
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    int32_t fill = 0;           //!< DMAキュー充填量の推定値[サンプル]
+    bool primed = false;        //!< 一度DMAキューが満杯になったか (曲頭の充填中は判定しない)
+    bool running = false;
+    uint32_t lastTime = 0;
+    uint64_t remainder = 0;
+};
+
+/** デコーダの出力をブロック単位で溜める (ミキサが読み終わるまでデコーダを待たせる) */
+class AudioOutputBlock : public AudioOutput {
+  public:
+    int16_t frame[MIX_BLOCK][2];
+
+    bool begin() override
+    {
+      count = 0;
+      head = 0;
+      return true;
+    }
+
+    bool stop() override { return true; }
+
+    bool ConsumeSample(int16_t sample[2]) override
+    {
+      if (count >= MIX_BLOCK) {
+        return false;
+      }
+      frame[count][0] = sample[0];
+      frame[count][1] = sample[1];
+      count++;
+      return true;
+    }
+
+    uint16_t available() { return count - head; }
+    const int16_t *data() { return frame[head]; }
+    int getRate() { return hertz; }
+
+    /** n フレーム読んだ (全て読んだらブロックを空にする) */
+    void consume(uint16_t n)
+    {
+      head += n;
+      if (head >= count) {
+        count = 0;
+        head = 0;
+      }
+    }
+
+  private:
+    uint16_t count = 0;         //!< 溜まっているフレーム数
+    uint16_t head = 0;          //!< 次に読む位置
+};
+
+/**
+ * 再生系統 (SDソース・先読み・ID3・デコーダ一式)
+ * 曲ごとにnew/deleteするとヒープが断片化するため、領域は最初に1度だけ確保して使い回す
+ */
+struct Deck {
+  AudioFileSourceSD *source = NULL;         //!< 1度だけ生成し曲ごとにopen/closeする
+  AudioFileSourceBuffer *readahead = NULL;  //!< 再生中だけreadaheadObjに配置する
+  AudioGeneratorMP3 *mp3 = NULL;            //!< 1度だけ生成し曲ごとにbegin/stopする
+  uint8_t *readaheadBuffer = NULL;          //!< 先読みバッファ (READAHEAD_MAX)
+  uint8_t *mp3Space = NULL;                 //!< デコーダの作業領域
+  alignas(AudioFileSourceBuffer) uint8_t readaheadObj[sizeof(AudioFileSourceBuffer)];
+  bool loaded = false;          //!< 曲を開いている
+  AudioOutputBlock pcm;         //!< ミキサ経由で再生する時の出力先
+  bool mixed = false;           //!< ミキサ経由で再生しているか
+};
+
+/** 1曲分の出力の統計 (バッファ設定の調整に使う) */
+struct PlayStats {
+  uint8_t bitrateClass = 0;     //!< ビットレート帯
+  uint32_t underrun = 0;        //!< アンダーラン回数
+  int32_t minFill = 0;          //!< DMAキュー最小充填量[サンプル]
+  int32_t capacity = 0;         //!< DMAキュー容量[サンプル]
+  uint32_t consumed = 0;        //!< 出力したサンプル数
+  int rate = 0;                 //!< サンプリングレート
+};
+
+/** クロスフェードの状態 */
+struct Crossfade {
+  bool enabled = false;         //!< 曲間をクロスフェードする (NVSに保存)
+  bool active = false;          //!< フェード中
+  bool skipped = false;         //!< 再生中の曲ではフェードしない (ヒープ不足)
+  uint32_t length = 0;          //!< フェード長[フレーム]
+  uint32_t pos = 0;             //!< フェード位置[フレーム]
+  uint32_t gain = 0;            //!< 入ってくる曲のゲイン (Q15を16bit左シフト)
+  uint32_t step = 0;            //!< 1フレーム当たりのゲイン増分
+  int rate = 0;                 //!< ミキサがI2Sに設定したサンプリングレート
+  struct PlayStats outgoing;    //!< 出ていく曲の統計 (フェード開始時に写し、フェード終了時に調整に使う)
+};
+
+/** トレースイベント種別 */
+enum TraceType : uint8_t {
+  trace_decode,                 //!< mp3->loop() 1回 (value: 所要時間[us])
+  trace_sd_read,                //!< デコーダのSD読込 (value: 所要時間[us])
+  trace_flush,                  //!< 画面転送 (value: 所要時間[us])
+  trace_button,                 //!< ボタン入力 (arg: GPIO, value: Btn_Status)
+  trace_track,                  //!< 曲の開始 (value: mp3Begin所要時間[us])
+  trace_volume,                 //!< 音量変更 (value: 音量x100)
+  trace_tag_error,              //!< タグ解析エラー (arg: エラー番号)
+  trace_underrun,               //!< アンダーラン (value: 直前のmp3->loop()所要時間[us])
+  trace_buffer,                 //!< バッファ設定の変更 (arg: DMAバッファ数, value: 先読みバッファ[byte])
+  trace_heap,                   //!< 曲開始時のヒープ (arg: 最大確保可能[KiB], value: 空き[KiB])
+  trace_cpu_freq,               //!< CPU周波数の変更 (arg: 直前の区間の負荷[%], value: 周波数[MHz])
+  trace_sleep,                  //!< 浅い眠りから起きた (arg: ボタンで起きたか, value: 眠った時間[ms])
+  trace_no_memory,              //!< 領域を確保できず機能を諦めた (arg: 確保先の番号, value: 要求サイズ[KiB])
+  trace_library_scan,           //!< ライブラリの変更確認の完了 (arg: 変更のあったディレクトリ数, value: 署名の所要時間[ms])
+  trace_lost = 0xFF             //!< 出力時に書込み途中か上書き済みだった枠 (出力のみ)
+};
+
+#pragma pack(1)
+/** トレースイベント (8バイト) */
+struct TraceEvent {
+  uint32_t time;                //!< 発生時刻 (所要時間を持つイベントは開始時刻) [us]
+  uint8_t type;                 //!< TraceType
+  uint8_t arg;                  //!< 種別毎の引数
+  uint16_t value;               //!< 種別毎の値 (所要時間は65535usで飽和)
+};
+#pragma pack()
+
+#pragma pack(1)
+/** 記録したボタンの変化 */
+struct InputEvent {
+  uint32_t time;                //!< 記録開始からの経過時間[ms]
+  uint8_t button;               //!< inputPinsの番号
+  uint8_t level;                //!< LOW/HIGH
+};
+#pragma pack()
+
+/**
+ * ボタン操作の記録・再生
+ * 再生中はGPIOの代わりに記録した変化を時刻通りに与え、操作毎に画面転送・音声開始までの時間を測る
+ * ボタンの判定は仮想時刻で行う (ループが遅れても次のイベントの時刻で止まり、記録した間隔を保つ)
+ */
+struct InputReplay {
+  bool recording;
+  bool replaying;
+  struct InputEvent event[INPUT_EVENT_MAX];
+  uint16_t count;               //!< 記録したイベント数
+  uint16_t pos;                 //!< 次に再生するイベント
+  uint32_t start;               //!< 記録・再生の開始時刻[ms]
+  uint32_t clock;               //!< 再生中の仮想時刻 (再生開始からの経過[ms])
+  uint32_t stepAt;              //!< 仮想時刻を最後に進めた時刻[ms]
+  uint8_t level[6];             //!< ボタン毎の最後の状態
+  uint16_t actions;             //!< 再生中に確定した操作の数
+  uint8_t actionPin;            //!< 測定中の操作のGPIO
+  uint8_t actionState;          //!< 測定中の操作 (Btn_Status)
+  uint32_t actionAt;            //!< 測定中の操作が確定した時刻[us] (0: なし)
+  volatile uint32_t flushUs;    //!< 操作から画面転送完了まで[us] (0: 未転送)
+  bool trackBegun;              //!< 操作の後に曲を開始した
+  uint32_t audioUs;             //!< 操作から最初のデコードまで[us] (0: 音声開始なし)
+};
+
+/** SD I/Oの種別 (統計の集計単位・優先度) */
+enum IoClass : uint8_t {
+  io_audio,                     //!< 再生中の曲の読込 (最優先)
+  io_metadata,                  //!< タグ・再生時間・サムネイルの読込
+  io_directory,                 //!< ディレクトリ列挙・FAT・その他
+  IO_CLASS_NUM
+};
+
+/** SD I/Oの種別毎の統計 */
+struct IoStats {
+  uint32_t commands = 0;        //!< カードに発行した読込コマンド数
+  uint32_t sectors = 0;         //!< カードから読んだセクタ数
+  uint32_t merged = 0;          //!< まとめ読み済みの領域から返したセクタ数
+  uint32_t seeks = 0;           //!< 直前の読込と連続しない読込の回数
+  uint32_t writes = 0;          //!< 書込コマンド数
+  uint32_t writeSectors = 0;    //!< 書込セクタ数
+  uint32_t totalUs = 0;         //!< コマンド所要時間の合計[us]
+  uint32_t maxUs = 0;           //!< コマンド所要時間の最大[us]
+};
+
+/** タスク毎のI/O種別 */
+struct IoTag {
+  TaskHandle_t task = NULL;
+  enum IoClass cls = io_directory;
+};
+
+/** SDのディスクI/O層の状態 (FATFSのボリュームロック下でのみ更新される) */
+struct BlockDevice {
+  int8_t pdrv = -1;             //!< 差し替えたドライブ番号 (-1: 未差し替え)
+  uint32_t dataStart = 0;       //!< データ領域の先頭セクタ
+  uint8_t clusterSize = 0;      //!< クラスタのセクタ数 (0: 不明)
+  uint32_t next[IO_CLASS_NUM];  //!< 種別毎の連続とみなす次のセクタ
+  uint32_t cacheSector = 0;     //!< まとめ読みした先頭セクタ
+  uint8_t cacheCount = 0;       //!< まとめ読みしたセクタ数
+  uint8_t cache[IO_MERGE_SECTORS * IO_SECTOR];
+};
+
+/** CPU周波数・省電力の状態 */
+struct Governor {
+  uint8_t level;                //!< 現在の周波数 (GOV_MHZの番号)
+  uint32_t windowStart;         //!< 負荷の測定区間の開始時刻[us]
+  uint32_t busyUs;              //!< 測定区間内のデコード時間の合計[us]
+  bool underrun;                //!< 測定区間内にアンダーランがあったか
+  uint32_t lastInput;           //!< 最後に操作した時刻[ms]
+  uint32_t levelSince;          //!< 現在の周波数にした時刻[ms]
+  uint32_t residencyMs[GOV_LEVELS];   //!< 周波数毎の滞在時間[ms] (眠っていた時間を含む)
+  uint32_t sleepMs;             //!< 浅い眠りの合計時間[ms]
+  uint32_t sleeps;              //!< 浅い眠りに入った回数
+  uint8_t transfers;            //!< 実行中のSD・画面の転送数
+  bool sleeping;                //!< 浅い眠りに入るところか
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
+
+/** カバー画像サムネイル (1bpp, 行毎MSB先頭) */
+struct AlbumArt {
+  uint32_t key;                 //!< 対象ファイルのパスのハッシュ
+  bool valid;                   //!< 画像があるか
+  uint8_t bitmap[ART_SIZE * ART_SIZE / 8];
+};
+
+/** サムネイル作成要求 */
+struct ArtRequest {
+  uint32_t key;                 //!< パスのハッシュ
+  char path[ART_PATH_LEN];      //!< ファイルパス
+};
+
+/** 再生開始に必要な曲の情報 (キューの曲は先読みしておく) */
+struct TrackInfo {
+  char path[QUEUE_PATH_LEN];    //!< ファイルパス
+  char text[ID3_TEXT_NUM][LIBRARY_TEXT_LEN];   //!< ID3タグのテキスト
+  double duration;              //!< 長さ[s]
+  struct MPEGFrameHeader frame; //!< 最初のフレームの情報
+  uint32_t audioStart;          //!< ID3v2タグの直後の位置
+  bool ready;                   //!< 読込済みか
+};
+
+/**
+ * 一覧に表示する曲の長さ (表示中の行から順に調べるタスクと共有するためlockで保護する)
+ * 覚えた長さはパスのハッシュで引き、一杯になったら古いものから置き換える
+ */
+struct DurationCache {
+  uint32_t *key;                        //!< パスのハッシュ (DURATION_CACHE_SIZE, 0は空き)
+  int16_t *seconds;                     //!< 長さ[s] (DURATION_CACHE_SIZE, -1: 求められなかった)
+  uint16_t next;                        //!< 次に置き換える位置
+  String dir;                           //!< 一覧表示中のディレクトリ (表示側のみ使う)
+  String job[N_BUF];                    //!< 調べる曲のパス (優先順)
+  uint8_t jobCount;
+  uint8_t jobPos;                       //!< 次に調べるjob
+  volatile bool busy;                   //!< 調べ終えていない曲がある
+  volatile uint32_t updated;            //!< 長さを覚えた回数 (表示の更新用)
+  SemaphoreHandle_t lock;               //!< (NULL: タスク未起動)
+  TaskHandle_t task;
+};
+
+/** 再生キュー (リングバッファ, 先読みタスクと共有するためlockで保護する) */
+struct PlayQueue {
+  struct TrackInfo entry[QUEUE_MAX];
+  uint8_t head;                 //!< 次に再生する曲の位置
+  uint8_t count;                //!< 曲数
+  volatile bool background;     //!< 一覧表示中も再生を続けているか (falseにすると再生タスクが終わる)
+  char playing[QUEUE_PATH_LEN]; //!< 再生中の曲のパス
+  SemaphoreHandle_t lock;
+  TaskHandle_t task;            //!< 先読みタスク
+  TaskHandle_t player;          //!< 一覧表示中の再生タスク (終了を待っていなければNULL)
+  SemaphoreHandle_t playerDone; //!< 再生タスクの終了通知
+};
+
+#pragma pack(1)
+/** 圧縮フォントの文字索引 (tools/fontsubset.py の出力と同じ配置) */
+struct PackedGlyph {
+  uint16_t code;                //!< コードポイント (昇順)
+  uint8_t advance;              //!< 送り幅
+  uint8_t width;                //!< ビットマップの幅
+  uint8_t height;               //!< ビットマップの高さ
+  int8_t x;                     //!< 行の左上からの描画位置
+  int8_t y;
+  uint8_t reserved;
+  uint32_t offset;              //!< ビットマップの位置 (1bpp, 行毎(width+7)/8バイト, MSB先頭)
+};
+/** フォントファイルのヘッダ (この後にページ毎の先頭コードポイント・索引・ビットマップが続く) */
+struct PackedFontHeader {
+  char magic[4];                //!< "PFN1"
+  uint16_t count;               //!< 文字数
+  uint8_t height;               //!< 行の高さ
+  uint8_t pageShift;            //!< 索引1ページの文字数 (2のべき乗の指数)
+};
+#pragma pack()
+
+/** 組込みの圧縮フォント (ui_font.h) */
+struct PackedFont {
+  uint16_t count;
+  uint8_t height;
+  const struct PackedGlyph *index;
+  const uint8_t *bitmap;
+};
+
+/** フォントファイルから読込んだ文字 */
+struct FileGlyph {
+  uint16_t code;                //!< コードポイント (0: 空き)
+  bool found;                   //!< フォントファイルにあったか (なければ組込みで描く)
+  uint32_t lastUse;             //!< 最終使用順 (LRU)
+  struct PackedGlyph packed;
+  uint8_t bits[GLYPH_MAX * GLYPH_MAX / 8];
+};
+
+/**
+ * SD上のフォントファイル (索引はページ単位で必要な時に読込む)
+ * SDは読込タスクだけが読み、描画側は読込済みの文字 (store) だけを見る (lockで保護する)
+ */
+struct FontFile {
+  const char *path;
+  File file;
+  bool tried;                   //!< 開こうとしたか (失敗しても開き直さない)
+  volatile bool unusable;       //!< 開けないか不正 (全て組込みで描く)
+  uint16_t count;
+  volatile uint8_t height;      //!< 行の高さ (開くまで0)
+  uint16_t pages;
+  uint32_t bitmapStart;         //!< ビットマップの先頭位置
+  uint16_t pageFirst[FONT_PAGE_MAX];  //!< ページ毎の先頭のコードポイント
+  int16_t page[FONT_INDEX_PAGES];       //!< 読込済みのページ (-1: なし)
+  uint8_t pageCount[FONT_INDEX_PAGES];  //!< 読込済みページの文字数
+  uint32_t pageUse[FONT_INDEX_PAGES];   //!< ページの最終使用順 (LRU, 読込タスクだけが使う)
+  uint32_t pageClock;
+  uint32_t clock;               //!< 文字の使用順カウンタ (lockで保護する)
+  struct PackedGlyph index[FONT_INDEX_PAGES][FONT_PAGE_GLYPHS];
+  struct FileGlyph store[FONT_STORE_SIZE];  //!< 読込済みの文字
+  uint16_t request[FONT_STORE_SIZE];        //!< 読込依頼
+  uint8_t requestCount;
+  volatile uint32_t updated;    //!< 文字を読込んだ回数 (変われば描き直す)
+  SemaphoreHandle_t lock;
+  TaskHandle_t task;            //!< 読込タスク (最初の依頼で起動する)
+};
+
+/** 画面用フォント (LovyanGFXのフォントか, 組込みの圧縮フォントとフォントファイル) */
+struct UiFont {
+  const lgfx::IFont *gfx;       //!< LovyanGFXのフォント (NULL: 圧縮フォントを使う)
+  const struct PackedFont *packed; //!< 組込みの圧縮フォント
+  struct FontFile *file;        //!< gfx・packedより先に探すフォントファイル (NULL: なし)
+};
+
+#if UI_FONT_SUBSET
+#include "ui_font.h"
+#endif
+
+/** ラスタライズ済みグリフ (1bpp, 行毎MSB先頭) */
+struct Glyph {
+  const struct UiFont *font;    //!< フォント (未使用時NULL)
+  uint32_t code;                //!< コードポイント
+  uint8_t width;                //!< 送り幅
+  uint8_t height;               //!< 高さ
+  uint32_t lastUse;             //!< 最終使用順 (LRU)
+  uint8_t bitmap[GLYPH_MAX * GLYPH_MAX / 8];
+};
+
+/** ビジュアライザ (音声処理側で採取したブロックを別コアで解析する) */
+struct Visualizer {
+  int16_t block[2][2][VIS_N];   //!< 採取ブロック [面][L/R][サンプル] (採取中/解析中の2面)
+  uint8_t writing;              //!< 採取中の面
+  uint16_t pos;                 //!< 採取位置
+  volatile bool armed;          //!< 採取要求 (フレーム間隔毎に立てる)
+  volatile bool busy;           //!< 解析中
+  volatile bool updated;        //!< 解析結果が更新された
+  uint8_t bars[VIS_BARS];       //!< 棒の高さ
+  uint32_t lastArm;             //!< 最後に採取要求した時刻[ms]
+  uint32_t dropped;             //!< 描画を間引いたフレーム数
+  uint8_t overBudget;           //!< 解析時間の連続超過回数
+  TaskHandle_t task;
+};
+
+/**
+ * 画面転送の二重バッファ (1bpp, 行毎MSB先頭)
+ * canvasで合成した画面をbackに詰めて転送タスクに渡し、転送タスクはfrontに入れ替えてから転送する
+ */
+struct DisplayFrame {
+  uint8_t back[Y_PIXEL][X_PIXEL / 8];   //!< 転送待ちの画面
+  uint8_t front[Y_PIXEL][X_PIXEL / 8];  //!< 転送中の画面
+  uint8_t dirtyTop;             //!< backの未転送の行範囲 [dirtyTop, dirtyBottom)
+  uint8_t dirtyBottom;
+  uint32_t frames;              //!< 転送した回数
+  uint32_t merged;              //!< 転送中に重なって1回にまとめた要求の数
+  uint32_t requestedAt;         //!< backに最後に詰めた時刻[us]
+  SemaphoreHandle_t lock;       //!< backの排他 (保持するのは行のコピーの間だけ)
+  TaskHandle_t task;
+};
+
+/** ビットレート帯毎のバッファ設定 */
+struct BufferSetting {
+  uint16_t readahead;           //!< 先読みバッファ[byte]
+  uint8_t dmaCount;             //!< DMAバッファ数
+  uint8_t cleanTracks;          //!< 余裕を持って再生できた連続曲数
+};
+
+/** カード毎のバッファ設定 (NVS保存用) */
+struct BufferTable {
+  uint64_t cardSize;            //!< カードの識別用 (容量が異なれば初期値に戻す)
+  struct BufferSetting setting[BITRATE_CLASS_NUM];
+};
+
+/** 起動フェーズ */
+enum BootPhase {
+  boot_serial,                  //!< シリアル初期化
+  boot_i2s,                     //!< I2S初期化
+  boot_display,                 //!< ディスプレイ初期化
+  boot_sd_mount,                //!< SDマウント (別コアで並行実行)
+  boot_first_pixel,             //!< 最初の画面表示 (終了時刻のみ)
+  boot_first_audio,             //!< 最初の音声出力 (終了時刻のみ)
+  BOOT_PHASE_NUM
+};
+
+/** 起動時間計測結果 (起動からの経過時間[us]) */
+struct BootProfile {
+  uint32_t start[BOOT_PHASE_NUM];
+  uint32_t end[BOOT_PHASE_NUM];
+};
+
+/** ルートディレクトリ先頭1画面分のキャッシュ (NVS保存用) */
+struct ListingCache {
+  uint8_t count;                                            //!< 有効なエントリ数
+  uint8_t isDir[LISTING_CACHE_LINES];                       //!< ディレクトリであるか
+  char filename[LISTING_CACHE_LINES][LISTING_CACHE_NAME_LEN]; //!< ファイル名 (終端含む)
 };
 
 /**********************************
@@ -191,23 +997,80 @@ struct MPEGFrameHeader {
  *       各種宣言(グローバル)
  **********************************/
 
-static LGFX_SSD1306 display;
+static LGFX_Panel display;
 static LGFX_Sprite canvas(&display);
 static LGFX_Sprite canvas2;
 static LGFX_Sprite menu_icon;
 static LGFX_Sprite menu_name;
 static LGFX_Sprite playback_title;
 
-AudioGeneratorMP3 *mp3;
-AudioFileSourceSD *source;
-AudioOutputI2S *out;
-AudioFileSourceID3 *id3;
-uint8_t *subscript;
+struct Deck deck[2];                 //!< 再生系統 (クロスフェード中は2つを同時にデコードする)
+uint8_t current = 0;                 //!< 再生中の曲の再生系統
+struct Crossfade fade;
+AudioOutputI2SMonitor *out;
+uint16_t *subscript = NULL;
 
 ID3tag nowPlaying;                   //!< 再生中ID3v2タグ情報
 Status status;
 struct MPEGFrameHeader mFrameHeader;
 
+struct BootProfile bootProfile;
+struct PrefixIndex prefixIndex[PREFIX_MAX];   //!< 表示中ディレクトリの頭文字索引
+uint8_t prefixCount = 0;
+struct Playlist playlist;
+struct LibraryInfo libraryInfo;
+SemaphoreHandle_t libraryLock;       //!< データベース差し替えと閲覧の排他
+volatile bool libraryBuilding = false;
+volatile bool scanAllowed = true;    //!< バックグラウンドのタスクがSDを使ってよいか (再生中は先読みに余裕がある時のみ)
+struct Glyph *glyphCache = NULL;     //!< グリフキャッシュ (GLYPH_CACHE_SIZE, 最初の描画時にbulk階層に確保)
+uint32_t glyphClock = 0;             //!< グリフキャッシュの使用順カウンタ
+LGFX_Sprite glyphScratch;            //!< グリフのラスタライズ用
+#if UI_FONT_SUBSET
+struct FontFile tagFontFile = {TAG_FONT_PATH};
+const struct UiFont uiFont12 = {NULL, &ui_b12_t_japanese2, NULL};
+const struct UiFont uiFont10 = {NULL, &ui_b10_t_japanese2, NULL};
+#if TAG_FONT_FALLBACK
+const struct UiFont tagFont = {&b16_t_japanese3, NULL, &tagFontFile};     //!< フォントファイルになければ全文字のフォントで描く
+#else
+const struct UiFont tagFont = {NULL, &ui_b12_t_japanese2, &tagFontFile};  //!< フォントファイルになければ組込みで描く
+#endif
+#else
+const struct UiFont uiFont12 = {&b12_t_japanese2, NULL, NULL};
+const struct UiFont uiFont10 = {&b10_t_japanese2, NULL, NULL};
+const struct UiFont tagFont = {&b16_t_japanese3, NULL, NULL};
+#endif
+struct Visualizer vis;
+struct DisplayFrame displayFrame;
+int16_t visCos[VIS_N / 2];           //!< 回転因子 (Q15)
+int16_t visSin[VIS_N / 2];
+int16_t visWindow[VIS_N];            //!< ハン窓 (Q15)
+struct BufferTable bufferTable;
+struct AlbumArt albumArt;            //!< 再生中の曲のカバー画像
+struct PlayQueue playQueue;
+struct DurationCache durations;
+QueueHandle_t artRequest;            //!< サムネイル作成要求 (最新の1件のみ保持)
+QueueHandle_t artResult;             //!< サムネイル作成結果
+uint8_t bitrateClass = 0;            //!< 再生中の曲のビットレート帯
+
+struct TraceEvent traceRing[TRACE_SIZE];
+std::atomic<uint32_t> traceSeq[TRACE_SIZE];  //!< 枠ごとの公開番号 (書込み位置+1, 書込み中は0)
+std::atomic<uint32_t> traceHead(0);  //!< 次に書き込む位置 (単調増加)
+uint32_t traceTail = 0;              //!< 次に出力する位置
+uint32_t traceEnd = 0;               //!< 出力中のダンプの終わり (traceTailと等しければ出力中でない)
+bool traceRequested = false;         //!< 送信バッファが空くのを待っているダンプ要求
+Preferences prefs;
+SemaphoreHandle_t sdMounted;         //!< SDマウント完了通知
+struct BlockDevice blockDev;
+struct IoStats ioStats[IO_CLASS_NUM];
+struct IoTag ioTags[IO_TASKS];
+struct InputReplay input;
+const uint8_t inputPins[6] = {PREV, PLAY, NEXT, BACK, VOL_UP, VOL_DOWN};
+portMUX_TYPE ioTagMux = portMUX_INITIALIZER_UNLOCKED;
+struct MemStats memStats[MEM_TIER_NUM];
+bool memPsram = false;               //!< bulk階層をPSRAMに置くか (PSRAMがあれば起動時にtrue)
+portMUX_TYPE memMux = portMUX_INITIALIZER_UNLOCKED;
+struct Governor gov;
+
 bool ID3flag = false;                //!< ID3取得完了時 true
 
 uint32_t startTime_prev = 0;
@@ -228,388 +1091,3548 @@ enum Btn_Status voldown_status = Release;
  *              関数
  **********************************/
 
+/** ボタン判定の時刻[ms] (再生中は仮想時刻) */
+uint32_t inputClock()
+{
+  return input.replaying ? input.start + input.clock : millis();
+}
+
 uint32_t timeMeasure(uint32_t st_time)
 {
-  return millis() - st_time;
+  return inputClock() - st_time;
 }
 
-uint8_t pushButton(const uint8_t gpio, Btn_Status *button_status, uint32_t *start_time, boolean continuous_set, uint32_t chatter_time, uint32_t long_press_time)
+void bootBegin(enum BootPhase phase)
 {
-  uint8_t ret_state = Release;
-  switch (digitalRead(gpio)) {
-    case LOW:
-      switch (*button_status) {
-        case Release:
-          *button_status = ON_start;
-          *start_time = millis();         //start_timeをリセット
-          break;
-        case ON_start:
-          if (continuous_set) {             
-            if (timeMeasure(*start_time) > long_press_time) {
-              *button_status = continuous_press;
-            }
-          } else {
-            if (timeMeasure(*start_time) > long_press_time) {
-              *button_status = longPress_determined;
-              ret_state = longPress_determined;
-            }
-          }
-          break;
-        case continuous_press:
-          if (timeMeasure(*start_time) > long_press_time) {
-            *start_time = millis();       //start_timeをリセット
-            return continuous_press;
-          }
-          break;
-        default:
-          break;
-      }
-      break;
-    case HIGH:
-      if (*button_status == ON_start) {
-        if (timeMeasure(*start_time) > chatter_time) {
-          ret_state = momentPress_determined;
-        }
-      }
-      *button_status = Release;
-      break;
-    default:
-      break;
-  }
-  return ret_state;
+  bootProfile.start[phase] = micros();
 }
 
-void setVol(uint8_t volUp)
+void bootEnd(enum BootPhase phase)
 {
-  if (volUp) {
-    status.volume += 0.01;
-    if (status.volume > MAX_VOL) {
-      status.volume = MAX_VOL;
-    }
-  }  else {
-    status.volume -= 0.01;
-    if (status.volume < 0.01) {
-      status.volume = 0.01;
-    }
+  bootProfile.end[phase] = micros();
+}
+
+/** トレースリングにイベントを1件記録する (複数コアから呼び出し可・ブロックしない) */
+inline void trace(enum TraceType type, uint8_t arg, uint32_t value, uint32_t time)
+{
+  if (!Features::diagnostics) {
+    return;
   }
+  uint32_t seq = traceHead.fetch_add(1, std::memory_order_relaxed);
+  uint32_t pos = seq & (TRACE_SIZE - 1);
+  struct TraceEvent *ev = &traceRing[pos];
+
+  // 書込み中であることを先に公開し, 中身を書いてから番号を公開する
+  traceSeq[pos].store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  ev->time = time;
+  ev->type = type;
+  ev->arg = arg;
+  ev->value = (value > 0xFFFF) ? 0xFFFF : value;
+  traceSeq[pos].store(seq + 1, std::memory_order_release);
+}
 
-  out->SetGain(status.volume);
-  Serial.println(status.volume);
+/** 開始時刻startからの所要時間を記録する */
+inline void traceSpan(enum TraceType type, uint8_t arg, uint32_t start)
+{
+  trace(type, arg, micros() - start, start);
 }
 
-boolean isDirectoryHideSys(File file)
+/**
+ * 未出力のトレースのダンプを始める (ヘッダのみ書き, イベントはtraceDrainStep()で少しずつ出力する)
+ * 形式: "TRC1" + イベント数(uint16 LE) + 欠落数(uint16 LE) + TraceEvent * イベント数
+ * 開始後に書き込まれたイベントは次回に回す
+ * @return 送信バッファに空きがなく始められなければ false (ダンプ中なら何もせず true)
+ */
+bool traceDrainBegin()
 {
-  String dirname = String(file.name());
-  if (dirname.equals("System Volume Information")) {
-    return false;
+  if (traceEnd != traceTail || Serial.availableForWrite() < 8) {
+    return traceEnd != traceTail;
   }
-  return file.isDirectory();
+  uint32_t head = traceHead.load(std::memory_order_relaxed);
+  uint32_t lost = 0;
+
+  if (head - traceTail > TRACE_SIZE) {
+    lost = head - traceTail - TRACE_SIZE;
+    traceTail = head - TRACE_SIZE;
+  }
+
+  uint16_t count = head - traceTail;
+  uint16_t lost16 = (lost > 0xFFFF) ? 0xFFFF : lost;
+  Serial.write(reinterpret_cast<const uint8_t*>("TRC1"), 4);
+  Serial.write(reinterpret_cast<const uint8_t*>(&count), sizeof(count));
+  Serial.write(reinterpret_cast<const uint8_t*>(&lost16), sizeof(lost16));
+  traceEnd = head;
+  return true;
 }
 
-boolean isSupportedFormat(const String filename)
+/**
+ * ダンプ中のイベントを送信バッファの空きの分だけ出力する (再生ループから毎回呼ぶ・ブロックしない)
+ * 書込み途中の枠や出力前に上書きされた枠は trace_lost として出力し, 件数をヘッダと合わせる
+ */
+void traceDrainStep()
 {
-  if (filename.endsWith(".mp3")) {
-    return true;
+  while (traceTail != traceEnd && Serial.availableForWrite() >= (int)sizeof(struct TraceEvent)) {
+    uint32_t pos = traceTail & (TRACE_SIZE - 1);
+    struct TraceEvent ev;
+    uint32_t seq = traceSeq[pos].load(std::memory_order_acquire);
+    memcpy(&ev, &traceRing[pos], sizeof(ev));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq != traceTail + 1 || traceSeq[pos].load(std::memory_order_relaxed) != seq) {
+      ev.type = trace_lost;
+      ev.arg = 0;
+      ev.value = 0;
+    }
+    Serial.write(reinterpret_cast<const uint8_t*>(&ev), sizeof(ev));
+    traceTail++;
   }
-  //if (filename.endsWith(".wav")) {
-  //  return true;
-  //}
-  //if (filename.endsWith(".flac")) {
-  //  return true;
-  //}
-  return false;
 }
 
-boolean isSupportedFormat(File file)
+/** CPU周波数を切替える (滞在時間を集計し、トレースに記録する) */
+void governorSet(uint8_t level, uint8_t load)
 {
-  const String filename = String(file.name());
-  return isSupportedFormat(filename);
+  if (level == gov.level) {
+    return;
+  }
+  uint32_t now = millis();
+  gov.residencyMs[gov.level] += now - gov.levelSince;
+  gov.levelSince = now;
+  gov.level = level;
+  setCpuFrequencyMhz(GOV_MHZ[level]);
+  trace(trace_cpu_freq, load, GOV_MHZ[level], micros());
 }
 
-void clearBuffer(struct Buffer *buf, uint8_t nArray)
+/** デコード1回分の負荷を集計し、区間が終わるかアンダーランがあれば周波数を決め直す */
+void governorDecode(uint32_t decode_us, bool underrun)
 {
-  for (uint8_t i = 0; i < nArray; i++) {
-    (buf + i)->filename.remove(0);
-    (buf + i)->isDir = false;
+  if (!Features::powerSave) {
+    return;
   }
+  gov.busyUs += decode_us;
+  gov.underrun = gov.underrun || underrun;
+
+  uint32_t now = micros();
+  uint32_t window = now - gov.windowStart;
+  if (window < GOV_WINDOW_MS * 1000 && !gov.underrun) {
+    return;
+  }
+  if (millis() - gov.lastInput >= GOV_INPUT_HOLD_MS) {    // 操作の直後は画面の更新を優先する
+    uint32_t load = (uint64_t)gov.busyUs * 100 / max(window, (uint32_t)1);
+    governorSet(governorPolicy(gov.level, gov.busyUs, window, gov.underrun), min(load, (uint32_t)255));
+  }
+  gov.windowStart = now;
+  gov.busyUs = 0;
+  gov.underrun = false;
 }
 
-void clearDir(struct Dir *dir)
+/** 操作があったら最高周波数にする (しばらく眠らない) */
+void governorInput()
 {
-  dir->path.clear();
-  dir->numSelectFile = 0;
-  dir->totalFileCount = 0;
-  dir->dirCount = 0;
+  if (!Features::powerSave) {
+    return;
+  }
+  gov.lastInput = millis();
+  governorSet(GOV_LEVELS - 1, 0);
 }
 
-void initDirBuffer(File file, struct Dir *dir, struct Buffer *buf)
+/** 周辺機器の転送を始める (浅い眠りの間は起きるまで待つ) */
+void awakeBegin()
 {
-  uint8_t fileCount = 0;
-  uint8_t dirCount = 0;
-  clearBuffer(buf, N_BUF);
-  for (uint8_t i = 0; i < 2; i++) {
-    while (true) {
-      File entry = file.openNextFile();
-
-      if (!entry) {
-        file.rewindDirectory();
-        break;
-      }
-      
-      if (i < 1) {
-        if (isDirectoryHideSys(entry)) {
-          (buf + fileCount)->isDir = true;
-          dirCount++;
-        } else {
-          entry.close();
-          continue;
-        }
-      } else {
-        if (isSupportedFormat(entry)) {
-          (buf + fileCount)->isDir = false;
-        } else {
-          entry.close();
-          continue;
-        }
-      }
-      
-      (buf + fileCount)->filename = String(entry.name());
-      entry.close();
-      fileCount++;
+  if (!Features::powerSave) {
+    return;
+  }
+  while (1) {
+    portENTER_CRITICAL(&gov.mux);
+    bool sleeping = gov.sleeping;
+    if (!sleeping) {
+      gov.transfers++;
+    }
+    portEXIT_CRITICAL(&gov.mux);
+    if (!sleeping) {
+      return;
     }
+    vTaskDelay(1);
   }
+}
 
-  dir->dirCount = dirCount;
-  dir->totalFileCount = fileCount;
+void awakeEnd()
+{
+  if (!Features::powerSave) {
+    return;
+  }
+  portENTER_CRITICAL(&gov.mux);
+  gov.transfers--;
+  portEXIT_CRITICAL(&gov.mux);
 }
 
-void printIcon(lgfx::v1::LovyanGFX *dst, int color, struct Buffer *buf, uint8_t pos) {
-  LGFX_Sprite icon;
+/** スコープの間は浅い眠りに入らせない (SD・画面の転送中に周辺機器のクロックを止めないため) */
+class AwakeScope {
+  public:
+    AwakeScope() { awakeBegin(); }
+    ~AwakeScope() { awakeEnd(); }
+};
 
-  icon.createSprite(SEL_LINE_HEIGHT, ICON_WIDTH);
-  icon.fillSprite((color == TFT_BLACK) ? TFT_WHITE : TFT_BLACK);
-  icon.setTextDatum(top_left);
-  icon.setCursor(0, 1);
-  icon.setFont(&siji_t_6x10);
+/**
+ * 最大ms浅い眠りで待つ (ボタンを押せば起きる)
+ * 操作の直後・ボタンを押している間・転送中・ライブラリ作成中・操作の記録と再生中・一覧表示中の再生中は眠らない
+ * 眠っている間はシリアルの受信も止まるため、コマンドを送る前にボタンを押して起こしておく
+ * @return 眠った場合 true
+ */
+boolean powerIdle(uint32_t ms)
+{
+  if (!Features::powerSave || input.recording || input.replaying || libraryBuilding || durations.busy || playQueue.background
+      || millis() - gov.lastInput < GOV_INPUT_HOLD_MS || displayFrame.dirtyTop < displayFrame.dirtyBottom) {
+    return false;
+  }
+  for (uint8_t i = 0; i < sizeof(inputPins); i++) {
+    if (digitalRead(inputPins[i]) == LOW) {
+      return false;
+    }
+  }
+
+  governorSet(0, 0);
+  portENTER_CRITICAL(&gov.mux);
+  bool idle = (gov.transfers == 0);
+  gov.sleeping = idle;
+  portEXIT_CRITICAL(&gov.mux);
+  if (!idle) {
+    return false;
+  }
+
+  uint32_t start = millis();
+  esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+  esp_light_sleep_start();
+  portENTER_CRITICAL(&gov.mux);
+  gov.sleeping = false;
+  portEXIT_CRITICAL(&gov.mux);
+
+  uint32_t slept = millis() - start;
+  gov.sleepMs += slept;
+  gov.sleeps++;
+  trace(trace_sleep, esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO, slept, micros());
+  return true;
+}
+
+void governorReport()
+{
+  uint32_t now = millis();
+
+  Serial.printf("{\"governor\":\"residency\",\"mhz\":%u,\"sleeps\":%lu,\"sleep_ms\":%lu",
+                GOV_MHZ[gov.level], (unsigned long)gov.sleeps, (unsigned long)gov.sleepMs);
+  for (uint8_t i = 0; i < GOV_LEVELS; i++) {
+    uint32_t ms = gov.residencyMs[i] + ((i == gov.level) ? now - gov.levelSince : 0);
+    Serial.printf(",\"ms_%u\":%lu", GOV_MHZ[i], (unsigned long)ms);
+  }
+  Serial.printf("}\n");
+}
+
+/** ボタンで浅い眠りから起きるように設定する (最高周波数から始める) */
+void initGovernor()
+{
+  for (uint8_t i = 0; i < sizeof(inputPins); i++) {
+    gpio_wakeup_enable((gpio_num_t)inputPins[i], GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+
+  gov.level = GOV_LEVELS - 1;
+  setCpuFrequencyMhz(GOV_MHZ[gov.level]);
+  gov.levelSince = millis();
+  gov.windowStart = micros();
+}
+
+/** SDライブラリ (sd_diskio.cpp) のディスクI/O */
+DSTATUS ff_sd_initialize(uint8_t pdrv);
+DSTATUS ff_sd_status(uint8_t pdrv);
+DRESULT ff_sd_read(uint8_t pdrv, uint8_t *buffer, DWORD sector, UINT count);
+DRESULT ff_sd_write(uint8_t pdrv, const uint8_t *buffer, DWORD sector, UINT count);
+DRESULT ff_sd_ioctl(uint8_t pdrv, uint8_t cmd, void *buff);
+
+/**
+ * 実行中のタスクのI/O種別を設定する
+ * @return 設定前の種別
+ */
+enum IoClass ioSetClass(enum IoClass cls)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  enum IoClass prev = io_directory;
+
+  portENTER_CRITICAL(&ioTagMux);
+  struct IoTag *slot = NULL;
+  for (uint8_t i = 0; i < IO_TASKS; i++) {
+    if (ioTags[i].task == task) {
+      slot = &ioTags[i];
+      break;
+    }
+    if (slot == NULL && ioTags[i].task == NULL) {
+      slot = &ioTags[i];
+    }
+  }
+  if (slot != NULL) {
+    prev = (slot->task == task) ? slot->cls : io_directory;
+    slot->task = task;
+    slot->cls = cls;
+  }
+  portEXIT_CRITICAL(&ioTagMux);
+  return prev;
+}
+
+/** 実行中のタスクのI/O種別 (未設定ならio_directory) */
+enum IoClass ioClass()
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+  for (uint8_t i = 0; i < IO_TASKS; i++) {
+    if (ioTags[i].task == task) {
+      return ioTags[i].cls;
+    }
+  }
+  return io_directory;
+}
+
+/** スコープの間だけI/O種別を切替える */
+class IoScope {
+  public:
+    IoScope(enum IoClass cls) : prev(ioSetClass(cls)) {}
+    ~IoScope() { ioSetClass(prev); }
+
+  private:
+    enum IoClass prev;
+};
+
+/**
+ * 音声の先読みに余裕ができるまで待つ (後回しにしてよいI/Oの前にバックグラウンドタスクから呼ぶ)
+ * FATFSのロックを持ったまま待つと音声の読込も止まるため、ディスクI/O層ではなく呼び出し側で待つ
+ */
+void ioYield()
+{
+  while (!scanAllowed) {
+    vTaskDelay(pdMS_TO_TICKS(IO_YIELD_INTERVAL));
+  }
+}
+
+/** 1セクタの読込をまとめて読むセクタ数 (クラスタの終端・データ領域の先頭を越えない) */
+uint8_t ioMergeCount(uint32_t sector)
+{
+  uint32_t end = sector + IO_MERGE_SECTORS;
+
+  if (blockDev.clusterSize > 0) {
+    if (sector < blockDev.dataStart) {
+      end = min(end, blockDev.dataStart);     // FAT・ルートディレクトリ領域
+    } else {
+      uint32_t offset = (sector - blockDev.dataStart) % blockDev.clusterSize;
+      end = min(end, sector - offset + blockDev.clusterSize);
+    }
+  }
+  return end - sector;
+}
+
+void ioAccount(struct IoStats *stats, UINT count, uint32_t start)
+{
+  uint32_t elapsed = micros() - start;
+
+  stats->commands++;
+  stats->sectors += count;
+  stats->totalUs += elapsed;
+  stats->maxUs = max(stats->maxUs, elapsed);
+}
+
+DSTATUS ioInitialize(uint8_t pdrv)
+{
+  return ff_sd_initialize(pdrv);
+}
+
+DSTATUS ioStatus(uint8_t pdrv)
+{
+  return ff_sd_status(pdrv);
+}
+
+/**
+ * セクタ読込 (種別毎に計数し、1セクタずつの連続読込はクラスタ内をまとめて1コマンドで読む)
+ * FATFSはディレクトリ・FAT・端数の読込を1セクタずつ要求するため、次の要求をまとめ読み済みの領域から返す
+ */
+DRESULT ioRead(uint8_t pdrv, uint8_t *buffer, DWORD sector, UINT count)
+{
+  AwakeScope awake;
+  enum IoClass cls = ioClass();
+  struct IoStats *stats = &ioStats[cls];
+
+  if (count == 1 && blockDev.cacheCount > 0
+      && sector >= blockDev.cacheSector && sector < blockDev.cacheSector + blockDev.cacheCount) {
+    memcpy(buffer, blockDev.cache + (sector - blockDev.cacheSector) * IO_SECTOR, IO_SECTOR);
+    stats->merged++;
+    blockDev.next[cls] = sector + 1;
+    return RES_OK;
+  }
+  if (sector != blockDev.next[cls]) {
+    stats->seeks++;
+  }
+  blockDev.next[cls] = sector + count;
+
+  uint32_t start = micros();
+  uint8_t merge = (count == 1) ? ioMergeCount(sector) : 0;
+  if (merge <= 1) {
+    DRESULT res = ff_sd_read(pdrv, buffer, sector, count);
+    ioAccount(stats, count, start);
+    return res;
+  }
+
+  blockDev.cacheCount = 0;
+  DRESULT res = ff_sd_read(pdrv, blockDev.cache, sector, merge);
+  ioAccount(stats, merge, start);
+  if (res != RES_OK) {
+    return ff_sd_read(pdrv, buffer, sector, count);
+  }
+  blockDev.cacheSector = sector;
+  blockDev.cacheCount = merge;
+  memcpy(buffer, blockDev.cache, IO_SECTOR);
+  return RES_OK;
+}
+
+DRESULT ioWrite(uint8_t pdrv, const uint8_t *buffer, DWORD sector, UINT count)
+{
+  AwakeScope awake;
+  struct IoStats *stats = &ioStats[ioClass()];
+
+  if (sector < blockDev.cacheSector + blockDev.cacheCount && blockDev.cacheSector < sector + count) {
+    blockDev.cacheCount = 0;            // まとめ読みした内容が古くなる
+  }
+  stats->writes++;
+  stats->writeSectors += count;
+  return ff_sd_write(pdrv, buffer, sector, count);
+}
+
+DRESULT ioIoctl(uint8_t pdrv, uint8_t cmd, void *buff)
+{
+  AwakeScope awake;
+  return ff_sd_ioctl(pdrv, cmd, buff);
+}
+
+uint16_t readLE16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t readLE32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/** ブートセクタ (BPB) からデータ領域の先頭とクラスタサイズを読む (FAT12/16/32のみ) */
+void ioReadGeometry(uint8_t pdrv)
+{
+  uint8_t *sec = blockDev.cache;
+  uint32_t base = 0;
+
+  if (ff_sd_read(pdrv, sec, 0, 1) != RES_OK || readLE16(sec + 510) != 0xAA55) {
+    return;
+  }
+  if (sec[0] != 0xEB && sec[0] != 0xE9) {         // MBR: 第1パーティションのブートセクタを読む
+    base = readLE32(sec + 0x1C6);
+    if (ff_sd_read(pdrv, sec, base, 1) != RES_OK || readLE16(sec + 510) != 0xAA55) {
+      return;
+    }
+  }
+  if (readLE16(sec + 11) != IO_SECTOR || sec[13] == 0) {
+    return;                             // exFATなど
+  }
+  uint32_t fatSize = readLE16(sec + 22);
+  if (fatSize == 0) {
+    fatSize = readLE32(sec + 36);
+  }
+  uint32_t rootSectors = (readLE16(sec + 17) * 32 + IO_SECTOR - 1) / IO_SECTOR;
+  blockDev.dataStart = base + readLE16(sec + 14) + sec[16] * fatSize + rootSectors;
+  blockDev.clusterSize = sec[13];
+}
+
+/**
+ * マウント済みのSDのディスクI/Oを計数・まとめ読みする層に差し替える
+ * SD.begin()の後、他のタスクがSDを使い始める前に呼ぶ
+ */
+void initBlockDevice()
+{
+  static const ff_diskio_impl_t impl = {
+    .init = &ioInitialize,
+    .status = &ioStatus,
+    .read = &ioRead,
+    .write = &ioWrite,
+    .ioctl = &ioIoctl,
+  };
+
+  for (uint8_t pdrv = 0; pdrv < FF_VOLUMES; pdrv++) {
+    if (sdcard_type(pdrv) != CARD_NONE) {
+      blockDev.pdrv = pdrv;
+      ioReadGeometry(pdrv);
+      ff_diskio_register(pdrv, &impl);
+      return;
+    }
+  }
+}
+
+/** I/O統計を種別毎にJSONで出力する */
+void ioReport(const char *label)
+{
+  const char *name[IO_CLASS_NUM] = {"audio", "metadata", "directory"};
+
+  for (uint8_t i = 0; i < IO_CLASS_NUM; i++) {
+    struct IoStats *s = &ioStats[i];
+    Serial.printf("{\"io\":\"%s\",\"class\":\"%s\",\"commands\":%lu,\"sectors\":%lu,\"merged\":%lu,\"seeks\":%lu,"
+                  "\"writes\":%lu,\"write_sectors\":%lu,\"avg_us\":%lu,\"max_us\":%lu}\n",
+                  label, name[i], (unsigned long)s->commands, (unsigned long)s->sectors, (unsigned long)s->merged,
+                  (unsigned long)s->seeks, (unsigned long)s->writes, (unsigned long)s->writeSectors,
+                  (unsigned long)(s->commands ? s->totalUs / s->commands : 0), (unsigned long)s->maxUs);
+  }
+}
+
+void ioResetStats()
+{
+  for (uint8_t i = 0; i < IO_CLASS_NUM; i++) {
+    ioStats[i] = IoStats();
+  }
+}
+
+/** 測定中の操作の結果を1行のJSONで出力する */
+void inputReport()
+{
+  if (input.actionAt == 0) {
+    return;
+  }
+  Serial.printf("{\"replay\":%u,\"gpio\":%u,\"state\":%u,\"flush_us\":%ld,\"audio_us\":%ld}\n",
+                input.actions, input.actionPin, input.actionState,
+                input.flushUs ? (long)input.flushUs : -1L, input.audioUs ? (long)input.audioUs : -1L);
+  input.actionAt = 0;
+}
+
+/** 再生を終了し、最後の操作の結果を出力する */
+void inputReplayEnd()
+{
+  inputReport();
+  input.replaying = false;
+  Serial.printf("{\"replay\":\"done\",\"actions\":%u}\n", input.actions);
+}
+
+/** 記録を開始する、または終了してSDに保存する */
+void inputRecordToggle()
+{
+  if (input.replaying) {
+    return;
+  }
+  if (!input.recording) {
+    input.count = 0;
+    input.start = millis();
+    input.recording = true;
+    return;
+  }
+
+  input.recording = false;
+  if (!SD.exists(INPUT_TRACE_DIR)) {
+    SD.mkdir(INPUT_TRACE_DIR);
+  }
+  File file = SD.open(INPUT_TRACE_PATH, FILE_WRITE);
+  if (file) {
+    file.write(reinterpret_cast<const uint8_t*>(input.event), input.count * sizeof(struct InputEvent));
+    file.close();
+  }
+  Serial.printf("{\"record\":\"saved\",\"events\":%u}\n", input.count);
+}
+
+/**
+ * 記録したボタン操作の再生を開始する
+ * 記録を始めた時と同じ画面から再生すること (ボタンは全て離した状態から始める)
+ */
+void inputReplayStart()
+{
+  File file = SD.open(INPUT_TRACE_PATH);
+  if (!file || input.recording) {
+    return;
+  }
+  input.count = file.read(reinterpret_cast<uint8_t*>(input.event), sizeof(input.event)) / sizeof(struct InputEvent);
+  file.close();
+
+  memset(input.level, HIGH, sizeof(input.level));
+  input.pos = 0;
+  input.actions = 0;
+  input.actionAt = 0;
+  input.start = millis();
+  input.clock = 0;
+  input.stepAt = input.start;
+  input.replaying = true;
+}
+
+/**
+ * 仮想時刻を経過時間だけ進め、再生時刻に達したイベントをボタンの状態に反映する
+ * 次のイベントを越えて進めず、同じ時刻のイベントだけを反映する (押下と解放を1度に与えない)
+ * 全て再生して結果が出たら終了する
+ */
+void inputReplayStep()
+{
+  uint32_t now = millis();
+  uint32_t clock = input.clock + (now - input.stepAt);
+  input.stepAt = now;
+
+  if (input.pos < input.count && input.event[input.pos].time <= clock) {
+    input.clock = input.event[input.pos].time;
+    while (input.pos < input.count && input.event[input.pos].time == input.clock) {
+      struct InputEvent *ev = &input.event[input.pos++];
+      if (ev->button < sizeof(inputPins)) {
+        input.level[ev->button] = ev->level;
+      }
+    }
+  } else {
+    input.clock = clock;
+  }
+  if (input.pos >= input.count && (input.count == 0 || input.clock > input.event[input.count - 1].time + INPUT_SETTLE)) {
+    inputReplayEnd();
+  }
+}
+
+/** ボタンの状態を読む (記録中は変化を記録し、再生中は記録した状態を返す) */
+int readButton(uint8_t gpio)
+{
+  uint8_t i = 0;
+  while (i < sizeof(inputPins) && inputPins[i] != gpio) {
+    i++;
+  }
+  if (i >= sizeof(inputPins)) {
+    return digitalRead(gpio);
+  }
+
+  if (input.replaying) {
+    inputReplayStep();
+    return input.replaying ? input.level[i] : digitalRead(gpio);
+  }
+  int level = digitalRead(gpio);
+  if (input.recording && level != input.level[i] && input.count < INPUT_EVENT_MAX) {
+    struct InputEvent *ev = &input.event[input.count++];
+    ev->time = millis() - input.start;
+    ev->button = i;
+    ev->level = level;
+  }
+  input.level[i] = level;
+  return level;
+}
+
+/** 再生中に操作が確定した (前の操作の結果を出力して測定を始める) */
+void inputAction(uint8_t gpio, uint8_t state)
+{
+  if (!input.replaying) {
+    return;
+  }
+  inputReport();
+  input.actions++;
+  input.actionPin = gpio;
+  input.actionState = state;
+  input.flushUs = 0;
+  input.trackBegun = false;
+  input.audioUs = 0;
+  input.actionAt = micros();
+}
+
+/** 時刻requestedAtに要求された画面転送の完了 (転送タスクから呼ばれる・操作より前の要求は数えない) */
+void inputFlushed(uint32_t requestedAt, uint32_t now)
+{
+  uint32_t at = input.actionAt;
+  if (at != 0 && input.flushUs == 0 && (int32_t)(requestedAt - at) >= 0) {
+    input.flushUs = max(now - at, (uint32_t)1);
+  }
+}
+
+/** 曲を開始した */
+void inputTrackBegin()
+{
+  if (input.actionAt != 0) {
+    input.trackBegun = true;
+  }
+}
+
+/** 曲の最初のデコードを終えた */
+void inputAudioStarted()
+{
+  if (input.actionAt != 0 && input.trackBegun && input.audioUs == 0) {
+    uint32_t elapsed = micros() - input.actionAt;
+    input.audioUs = max(elapsed, (uint32_t)1);
+  }
+}
+
+/** 描画キャッシュのスプライトをbulk階層に置く (領域はLovyanGFXが確保するためmemStatsには数えない) */
+void memSprite(LGFX_Sprite *sprite)
+{
+  sprite->setPsram(memPsram);
+}
+
+/** 階層毎の使用量と内部RAM・PSRAMの空きをJSONで出力する */
+void memReport(const char *label)
+{
+  const char *name[MEM_TIER_NUM] = {"fast", "bulk"};
+  LGFX_Sprite *sprites[] = {&canvas, &canvas2, &menu_icon, &menu_name, &playback_title, &glyphScratch};
+  uint32_t spriteBytes = 0;
+  for (uint8_t i = 0; i < sizeof(sprites) / sizeof(sprites[0]); i++) {
+    spriteBytes += sprites[i]->bufferLength();
+  }
+
+  for (uint8_t i = 0; i < MEM_TIER_NUM; i++) {
+    struct MemStats st;
+    portENTER_CRITICAL(&memMux);
+    st = memStats[i];
+    portEXIT_CRITICAL(&memMux);
+    Serial.printf("{\"mem\":\"%s\",\"tier\":\"%s\",\"bytes\":%lu,\"peak\":%lu,\"psram_bytes\":%lu,"
+                  "\"allocs\":%lu,\"spilled\":%lu,\"failures\":%lu}\n",
+                  label, name[i], (unsigned long)st.bytes, (unsigned long)st.peak, (unsigned long)st.psramBytes,
+                  (unsigned long)st.allocs, (unsigned long)st.spilled, (unsigned long)st.failures);
+  }
+  Serial.printf("{\"mem\":\"%s\",\"tier\":\"heap\",\"psram\":%s,\"sprite_bytes\":%lu,"
+                "\"internal_free\":%lu,\"internal_largest\":%lu,\"internal_min_free\":%lu,\"psram_free\":%lu,\"psram_largest\":%lu}\n",
+                label, memPsram ? "true" : "false", (unsigned long)spriteBytes,
+                (unsigned long)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+                (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+                (unsigned long)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+                (unsigned long)heap_caps_get_free_size(MALLOC_CAP_SPIRAM),
+                (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
+
+/** シリアルから出力要求を受けていればトレース・I/O統計を出力する */
+void traceService()
+{
+  if (!Features::diagnostics) {
+    return;
+  }
+  if (traceRequested) {
+    traceRequested = !traceDrainBegin();
+  }
+  traceDrainStep();
+  if (Serial.available() == 0) {
+    return;
+  }
+  switch (Serial.read()) {
+    case TRACE_DRAIN_CMD:
+      traceRequested = !traceDrainBegin();
+      break;
+    case IO_STATS_CMD:
+      ioReport("total");
+      break;
+    case INPUT_RECORD_CMD:
+      inputRecordToggle();
+      break;
+    case INPUT_REPLAY_CMD:
+      inputReplayStart();
+      break;
+    case GOV_STATS_CMD:
+      governorReport();
+      break;
+    case MEM_STATS_CMD:
+      memReport("total");
+      break;
+  }
+}
+
+/** 一度だけ記録する時刻 (最初の画面表示・最初の音声出力) */
+void bootMark(enum BootPhase phase)
+{
+  if (bootProfile.end[phase] == 0) {
+    bootProfile.end[phase] = micros();
+  }
+}
+
+/** 起動フェーズ毎の所要時間をシリアルに出力する */
+void bootReport()
+{
+  const char *name[BOOT_PHASE_NUM] = {
+    "serial", "i2s", "display", "sd_mount", "first_pixel", "first_audio"
+  };
+
+  for (uint8_t i = 0; i < BOOT_PHASE_NUM; i++) {
+    if (bootProfile.end[i] == 0) {
+      continue;
+    }
+    if (bootProfile.start[i] == 0) {
+      Serial.printf("[boot] %-12s at %8lu us\n", name[i], (unsigned long)bootProfile.end[i]);
+    } else {
+      Serial.printf("[boot] %-12s %8lu - %8lu us (%lu us)\n", name[i],
+                    (unsigned long)bootProfile.start[i], (unsigned long)bootProfile.end[i],
+                    (unsigned long)(bootProfile.end[i] - bootProfile.start[i]));
+    }
+  }
+}
+
+uint8_t pushButton(const uint8_t gpio, Btn_Status *button_status, uint32_t *start_time, boolean continuous_set, uint32_t chatter_time, uint32_t long_press_time)
+{
+  uint8_t ret_state = Release;
+  switch (readButton(gpio)) {
+    case LOW:
+      switch (*button_status) {
+        case Release:
+          *button_status = ON_start;
+          *start_time = inputClock();     //start_timeをリセット
+          governorInput();
+          break;
+        case ON_start:
+          if (continuous_set) {             
+            if (timeMeasure(*start_time) > long_press_time) {
+              *button_status = continuous_press;
+            }
+          } else {
+            if (timeMeasure(*start_time) > long_press_time) {
+              *button_status = longPress_determined;
+              ret_state = longPress_determined;
+            }
+          }
+          break;
+        case continuous_press:
+          if (timeMeasure(*start_time) > long_press_time) {
+            *start_time = inputClock();   //start_timeをリセット
+            trace(trace_button, gpio, continuous_press, micros());
+            inputAction(gpio, continuous_press);
+            governorInput();
+            return continuous_press;
+          }
+          break;
+        default:
+          break;
+      }
+      break;
+    case HIGH:
+      if (*button_status == ON_start) {
+        if (timeMeasure(*start_time) > chatter_time) {
+          ret_state = momentPress_determined;
+        }
+      }
+      *button_status = Release;
+      break;
+    default:
+      break;
+  }
+
+  if (ret_state != Release) {
+    trace(trace_button, gpio, ret_state, micros());
+    inputAction(gpio, ret_state);
+    governorInput();
+  }
+  return ret_state;
+}
+
+void setVol(uint8_t volUp)
+{
+  if (volUp) {
+    status.volume += 0.01;
+    if (status.volume > MAX_VOL) {
+      status.volume = MAX_VOL;
+    }
+  }  else {
+    status.volume -= 0.01;
+    if (status.volume < 0.01) {
+      status.volume = 0.01;
+    }
+  }
+
+  out->SetGain(status.volume);
+  trace(trace_volume, 0, (uint32_t)(status.volume * 100 + 0.5), micros());
+}
+
+boolean isDirectoryHideSys(File file)
+{
+  String dirname = String(file.name());
+  if (dirname.equals("System Volume Information") || dirname.startsWith(".")) {
+    return false;                     // 索引・キャッシュ用の隠しディレクトリも除く
+  }
+  return file.isDirectory();
+}
+
+boolean isSupportedFormat(const String filename)
+{
+  if (filename.endsWith(".mp3")) {
+    return true;
+  }
+  //if (filename.endsWith(".wav")) {
+  //  return true;
+  //}
+  //if (filename.endsWith(".flac")) {
+  //  return true;
+  //}
+  return false;
+}
+
+boolean isLibraryPath(const String &path)
+{
+  return Features::library && path.startsWith(LIBRARY_ROOT);
+}
+
+boolean isSupportedFormat(File file)
+{
+  const String filename = String(file.name());
+  return isSupportedFormat(filename);
+}
+
+boolean isPlaylist(const String filename)
+{
+  return filename.endsWith(".m3u") || filename.endsWith(".m3u8");
+}
+
+/** 一覧に表示するファイルであるか */
+boolean isListed(File file)
+{
+  const String filename = String(file.name());
+  return isSupportedFormat(filename) || isPlaylist(filename);
+}
+
+void clearBuffer(struct Buffer *buf, uint8_t nArray)
+{
+  for (uint8_t i = 0; i < nArray; i++) {
+    (buf + i)->filename.remove(0);
+    (buf + i)->isDir = false;
+  }
+}
+
+void clearDir(struct Dir *dir)
+{
+  dir->path.clear();
+  dir->numSelectFile = 0;
+  dir->totalFileCount = 0;
+  dir->dirCount = 0;
+  dir->windowStart = 0;
+  dir->external = false;
+}
+
+uint32_t hashPath(const char *path)
+{
+  uint32_t hash = 2166136261u;        // FNV-1a
+  while (*path) {
+    hash = (hash ^ (uint8_t)*(path++)) * 16777619u;
+  }
+  return hash;
+}
+
+/** エントリの名前・サイズ・更新日時 (FATのディレクトリエントリ) を署名signに加える (FNV-1a) */
+uint32_t signEntry(uint32_t sign, File *entry)
+{
+  uint32_t attr[2] = {(uint32_t)entry->size(), (uint32_t)entry->getLastWrite()};
+  for (const char *p = entry->name(); *p; p++) {
+    sign = (sign ^ (uint8_t)*p) * 16777619u;
+  }
+  for (uint8_t i = 0; i < sizeof(attr); i++) {
+    sign = (sign ^ reinterpret_cast<uint8_t*>(attr)[i]) * 16777619u;
+  }
+  return sign;
+}
+
+/** コードポイントをUTF-8で追加する */
+void appendUTF8(String *dst, uint32_t c)
+{
+  if (c < 0x80) {
+    dst->concat((char)c);
+  } else if (c < 0x800) {
+    dst->concat((char)(0xC0 | (c >> 6)));
+    dst->concat((char)(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    dst->concat((char)(0xE0 | (c >> 12)));
+    dst->concat((char)(0x80 | ((c >> 6) & 0x3F)));
+    dst->concat((char)(0x80 | (c & 0x3F)));
+  } else {
+    dst->concat((char)(0xF0 | (c >> 18)));
+    dst->concat((char)(0x80 | ((c >> 12) & 0x3F)));
+    dst->concat((char)(0x80 | ((c >> 6) & 0x3F)));
+    dst->concat((char)(0x80 | (c & 0x3F)));
+  }
+}
+
+/** UTF-16 (BOMがなければリトルエンディアン) をUTF-8に変換する */
+String decodeUTF16(const char *string)
+{
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(string);
+  bool bigEndian = false;
+  String ret;
+
+  if (p[0] == 0xFE && p[1] == 0xFF) {
+    bigEndian = true;
+    p += 2;
+  } else if (p[0] == 0xFF && p[1] == 0xFE) {
+    p += 2;
+  }
+
+  while (true) {
+    uint32_t c = bigEndian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+    if (c == 0) {
+      break;
+    }
+    p += 2;
+    if (c >= 0xD800 && c <= 0xDBFF) {   // サロゲートペア
+      uint32_t low = bigEndian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+      if (low < 0xDC00 || low > 0xDFFF) {
+        break;
+      }
+      p += 2;
+      c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+    }
+    appendUTF8(&ret, c);
+  }
+  return ret;
+}
+
+/** UTF-8として正しくなければISO-8859-1とみなしてUTF-8に変換する */
+String decodeLatin1(const char *string)
+{
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(string);
+  bool utf8 = true;
+
+  while (*p && utf8) {
+    uint8_t len = (*p < 0x80) ? 1 : (*p >= 0xF0) ? 4 : (*p >= 0xE0) ? 3 : (*p >= 0xC0) ? 2 : 0;
+    if (len == 0) {
+      utf8 = false;
+      break;
+    }
+    for (uint8_t i = 1; i < len; i++) {
+      if ((p[i] & 0xC0) != 0x80) {
+        utf8 = false;
+        break;
+      }
+    }
+    p += utf8 ? len : 0;
+  }
+  if (utf8) {
+    return String(string);
+  }
+
+  String ret;
+  for (p = reinterpret_cast<const uint8_t*>(string); *p; p++) {
+    appendUTF8(&ret, *p);
+  }
+  return ret;
+}
+
+/** 一覧の並び順 (ディレクトリが先) */
+bool lessEntry(bool isDirA, const char *a, bool isDirB, const char *b)
+{
+  if (isDirA != isDirB) {
+    return isDirA;
+  }
+  return compareFilename(a, b) < 0;
+}
+
+bool lessBuffer(const struct Buffer &a, const struct Buffer &b)
+{
+  return lessEntry(a.isDir, a.filename.c_str(), b.isDir, b.filename.c_str());
+}
+
+uint32_t prefixKey(bool isDir, const char *filename)
+{
+  uint32_t c = nextCollationChar(&filename);
+  if (c >= '0' && c <= '9') {
+    c = '0';
+  }
+  return (isDir ? 0 : 0x1000000) | c;
+}
+
+/** 頭文字が変わる位置を索引に加える (索引が溢れる場合は間引く) */
+void addPrefix(bool isDir, const char *filename, uint16_t index, uint16_t total)
+{
+  uint32_t key = prefixKey(isDir, filename);
+
+  if (prefixCount > 0 && prefixIndex[prefixCount - 1].key == key) {
+    return;
+  }
+  if (prefixCount >= PREFIX_MAX
+      || (prefixCount > 0 && index - prefixIndex[prefixCount - 1].first < total / PREFIX_MAX)) {
+    return;
+  }
+  prefixIndex[prefixCount].key = key;
+  prefixIndex[prefixCount].first = index;
+  prefixCount++;
+}
+
+/** 次の頭文字の先頭 (末尾なら先頭に戻る) */
+uint16_t nextPrefix(uint16_t selectNum)
+{
+  struct PrefixIndex *it = std::upper_bound(prefixIndex, prefixIndex + prefixCount, selectNum,
+    [](uint16_t num, const struct PrefixIndex &p) { return num < p.first; });
+  return (it == prefixIndex + prefixCount) ? 0 : it->first;
+}
+
+/** 選択中の頭文字の先頭 (既に先頭なら前の頭文字の先頭) */
+uint16_t prevPrefix(const struct Dir *dir, uint16_t selectNum)
+{
+  struct PrefixIndex *it = std::lower_bound(prefixIndex, prefixIndex + prefixCount, selectNum,
+    [](const struct PrefixIndex &p, uint16_t num) { return p.first < num; });
+  if (it == prefixIndex) {
+    return (prefixCount > 0) ? prefixIndex[prefixCount - 1].first : dir->totalFileCount - 1;
+  }
+  return (it - 1)->first;
+}
+
+String listingPath(const struct Dir *dir, const char *ext)
+{
+  char path[40];
+  const char *base = dir->path.startsWith(LIBRARY_ROOT) ? LIBRARY_CACHE_DIR : LISTING_DIR;
+  sprintf(path, "%s/%08lx.%s", base, (unsigned long)hashPath(dir->path.c_str()), ext);
+  return String(path);
+}
+
+String playlistIndexPath(const String path)
+{
+  char indexPath[32];
+  sprintf(indexPath, LISTING_DIR "/%08lx.m3i", (unsigned long)hashPath(path.c_str()));
+  return String(indexPath);
+}
+
+String runPath(uint16_t run)
+{
+  char path[24];
+  sprintf(path, LISTING_DIR "/r%u.tmp", run);
+  return String(path);
+}
+
+/** バッファを整列しランファイルとして書き出す (1行1エントリ、先頭1文字はD/F) */
+void writeRun(struct Buffer *buf, uint8_t num, uint16_t run)
+{
+  std::sort(buf, buf + num, lessBuffer);
+
+  File f = SD.open(runPath(run), FILE_WRITE);
+  for (uint8_t i = 0; i < num; i++) {
+    f.print(buf[i].isDir ? 'D' : 'F');
+    f.print(buf[i].filename);
+    f.print('\n');
+  }
+  f.close();
+  clearBuffer(buf, num);
+}
+
+/**
+ * ランファイルfirst～first+num-1を併合する
+ * idxを指定した場合は最終出力として各行の位置を書き出し、頭文字索引を作る
+ */
+void mergeRuns(uint16_t first, uint8_t num, File *out, File *idx, uint16_t total)
+{
+  File in[MERGE_WAYS];
+  String head[MERGE_WAYS];
+  uint16_t index = 0;
+
+  for (uint8_t i = 0; i < num; i++) {
+    in[i] = SD.open(runPath(first + i));
+    head[i] = in[i].readStringUntil('\n');
+  }
+
+  while (true) {
+    int8_t sel = -1;
+    for (uint8_t i = 0; i < num; i++) {
+      if (head[i].isEmpty()) {
+        continue;
+      }
+      if (sel < 0 || lessEntry(head[i][0] == 'D', head[i].c_str() + 1, head[sel][0] == 'D', head[sel].c_str() + 1)) {
+        sel = i;
+      }
+    }
+    if (sel < 0) {
+      break;
+    }
+
+    if (idx != NULL) {
+      uint32_t offset = out->position();
+      idx->write(reinterpret_cast<const uint8_t*>(&offset), sizeof(offset));
+      addPrefix(head[sel][0] == 'D', head[sel].c_str() + 1, index++, total);
+    }
+    out->print(head[sel]);
+    out->print('\n');
+    head[sel] = in[sel].readStringUntil('\n');
+  }
+
+  for (uint8_t i = 0; i < num; i++) {
+    in[i].close();
+    SD.remove(runPath(first + i));
+  }
+}
+
+/**
+ * バッファに収まらないディレクトリを外部マージソートしてSDに保存する
+ * N_BUF件ずつ整列したランを作り、MERGE_WAYS個ずつ併合を繰り返す
+ */
+void sortExternal(File file, struct Dir *dir, struct Buffer *buf)
+{
+  uint16_t runs = 0;
+  uint8_t num = 0;
+
+  if (!SD.exists(LISTING_DIR)) {
+    SD.mkdir(LISTING_DIR);
+  }
+
+  clearBuffer(buf, N_BUF);
+  while (true) {
+    File entry = file.openNextFile();
+    if (!entry) {
+      file.rewindDirectory();
+      break;
+    }
+    bool isDir = isDirectoryHideSys(entry);
+    if (isDir || (!entry.isDirectory() && isListed(entry))) {
+      buf[num].filename = String(entry.name());
+      buf[num].isDir = isDir;
+      if (++num >= N_BUF) {
+        writeRun(buf, num, runs++);
+        num = 0;
+      }
+    }
+    entry.close();
+  }
+  if (num > 0) {
+    writeRun(buf, num, runs++);
+  }
+
+  uint16_t first = 0;
+  while (runs - first > MERGE_WAYS) {
+    uint8_t n = MERGE_WAYS;
+    File out = SD.open(runPath(runs), FILE_WRITE);
+    mergeRuns(first, n, &out, NULL, 0);
+    out.close();
+    first += n;
+    runs++;
+  }
+
+  struct ListingHeader header = {dir->totalFileCount, dir->dirCount, 0, dir->signature};
+  File out = SD.open(listingPath(dir, "dat"), FILE_WRITE);
+  File idx = SD.open(listingPath(dir, "idx"), FILE_WRITE);
+  idx.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+  prefixCount = 0;
+  mergeRuns(first, runs - first, &out, &idx, dir->totalFileCount);
+  out.close();
+  idx.close();
+
+  // 頭文字索引はヘッダの後ろにまとめて保存する
+  header.prefixCount = prefixCount;
+  File pfx = SD.open(listingPath(dir, "pfx"), FILE_WRITE);
+  pfx.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+  pfx.write(reinterpret_cast<const uint8_t*>(prefixIndex), sizeof(struct PrefixIndex) * prefixCount);
+  pfx.close();
+}
+
+/**
+ * 保存済みの整列済み一覧が現在のディレクトリと一致すれば頭文字索引を読込む
+ * 件数が同じでも名前の変更・ファイルの差し替えがあれば署名が変わり、作り直させる
+ */
+boolean loadExternalListing(struct Dir *dir)
+{
+  struct ListingHeader header;
+  File pfx = SD.open(listingPath(dir, "pfx"));
+
+  if (!pfx) {
+    return false;
+  }
+  if (pfx.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)
+      || header.totalFileCount != dir->totalFileCount || header.dirCount != dir->dirCount
+      || header.signature != dir->signature || header.prefixCount > PREFIX_MAX) {
+    pfx.close();
+    return false;
+  }
+  prefixCount = header.prefixCount;
+  pfx.read(reinterpret_cast<uint8_t*>(prefixIndex), sizeof(struct PrefixIndex) * prefixCount);
+  pfx.close();
+  return true;
+}
+
+/** SD上の整列済み一覧からstart番目以降をバッファに読込む */
+void loadWindow(struct Dir *dir, struct Buffer *buf, uint16_t start)
+{
+  uint32_t offset;
+
+  clearBuffer(buf, N_BUF);
+  dir->windowStart = start;
+
+  File idx = SD.open(listingPath(dir, "idx"));
+  idx.seek(sizeof(struct ListingHeader) + start * sizeof(offset));
+  idx.read(reinterpret_cast<uint8_t*>(&offset), sizeof(offset));
+  idx.close();
+
+  File dat = SD.open(listingPath(dir, "dat"));
+  dat.seek(offset);
+  for (uint8_t i = 0; i < N_BUF && start + i < dir->totalFileCount; i++) {
+    String line = dat.readStringUntil('\n');
+    buf[i].isDir = (line[0] == 'D');
+    buf[i].filename = line.substring(1);
+  }
+  dat.close();
+}
+
+/** index番目のエントリを取得する (バッファ外であれば読込み直す) */
+struct Buffer *entryAt(struct Dir *dir, struct Buffer *buf, uint16_t index)
+{
+  if (!dir->external) {
+    return &buf[index];
+  }
+  if (index < dir->windowStart || index >= dir->windowStart + N_BUF) {
+    uint16_t start = (index > N_BUF / 2) ? index - N_BUF / 2 : 0;
+    loadWindow(dir, buf, min(start, (uint16_t)(dir->totalFileCount - min((uint16_t)N_BUF, dir->totalFileCount))));
+  }
+  return &buf[index - dir->windowStart];
+}
+
+/**
+ * ディレクトリ一覧を整列して読込む
+ * N_BUF件以内ならRAM上で整列し、超える場合はSD上で外部ソートした一覧を使う
+ */
+void initDirBuffer(File file, struct Dir *dir, struct Buffer *buf)
+{
+  uint16_t fileCount = 0;
+  uint16_t dirCount = 0;
+  uint32_t sign = 2166136261u;
+  clearBuffer(buf, N_BUF);
+  dir->windowStart = 0;
+  dir->external = false;
+
+  while (true) {
+    File entry = file.openNextFile();
+
+    if (!entry) {
+      file.rewindDirectory();
+      break;
+    }
+
+    if (isDirectoryHideSys(entry)) {
+      if (fileCount < N_BUF) {
+        (buf + fileCount)->isDir = true;
+      }
+      dirCount++;
+    } else if (!entry.isDirectory() && isListed(entry)) {
+      if (fileCount < N_BUF) {
+        (buf + fileCount)->isDir = false;
+      }
+    } else {
+      entry.close();
+      continue;
+    }
+
+    if (fileCount < N_BUF) {
+      (buf + fileCount)->filename = String(entry.name());
+    }
+    sign = signEntry(sign, &entry);
+    entry.close();
+    fileCount++;
+  }
+
+  dir->dirCount = dirCount;
+  dir->totalFileCount = fileCount;
+  dir->signature = sign;
+  prefixCount = 0;
+
+  if (fileCount <= N_BUF) {
+    std::sort(buf, buf + fileCount, lessBuffer);
+    for (uint16_t i = 0; i < fileCount; i++) {
+      addPrefix(buf[i].isDir, buf[i].filename.c_str(), i, fileCount);
+    }
+    return;
+  }
+
+  dir->external = true;
+  if (!loadExternalListing(dir)) {
+    sortExternal(file, dir, buf);
+  }
+  loadWindow(dir, buf, 0);
+}
+
+void printIcon(lgfx::v1::LovyanGFX *dst, int color, struct Buffer *buf, uint8_t pos) {
+  LGFX_Sprite icon;
+
+  memSprite(&icon);
+  icon.createSprite(SEL_LINE_HEIGHT, ICON_WIDTH);
+  icon.fillSprite((color == TFT_BLACK) ? TFT_WHITE : TFT_BLACK);
+  icon.setTextDatum(top_left);
+  icon.setCursor(0, 1);
+  icon.setFont(&siji_t_6x10);
   icon.setTextColor(color);
 
-  if (buf->isDir) {
-    icon.print("");
-  } else {
-    icon.print("");
+  if (buf->isDir) {
+    icon.print("");
+  } else {
+    icon.print("");
+  }
+
+  icon.pushSprite(dst, 0, pos);
+  icon.deleteSprite();
+}
+
+/** 一覧の項目のパス */
+String listedPath(const String &dirPath, const String &filename)
+{
+  if (dirPath != "/") {
+    return dirPath + "/" + filename;
+  }
+  return "/" + filename;
+}
+
+/** 長さを覚えている位置 (lockを取って呼ぶ, なければ-1) */
+int16_t durationSlot(uint32_t key)
+{
+  for (uint16_t i = 0; i < DURATION_CACHE_SIZE; i++) {
+    if (durations.key[i] == key) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** 一覧表示中のディレクトリの曲の長さ[s] (まだ調べていないか求められなければ-1, 調べ終わるのを待たない) */
+int16_t cachedDuration(const struct Buffer *buf)
+{
+  if (!Features::durations || durations.lock == NULL || buf->isDir) {
+    return -1;
+  }
+  uint32_t key = hashPath(listedPath(durations.dir, buf->filename).c_str());
+  xSemaphoreTake(durations.lock, portMAX_DELAY);
+  int16_t slot = durationSlot(key);
+  int16_t seconds = (slot >= 0) ? durations.seconds[slot] : -1;
+  xSemaphoreGive(durations.lock);
+  return seconds;
+}
+
+/** 曲の長さをrightに右揃えで描く (背景を塗ってファイル名に重ねる) */
+void printFileDuration(lgfx::v1::LovyanGFX *dst, int color, int16_t seconds, int32_t right, int32_t y)
+{
+  if (seconds < 0) {
+    return;
+  }
+  char text[8];
+  sprintf(text, "%d:%02d", seconds / 60, seconds % 60);
+
+  dst->setFont(FONT_SELECT);
+  int32_t width = dst->textWidth(text);
+  dst->fillRect(right - width - 3, y, width + 3, SEL_LINE_HEIGHT, (color == TFT_BLACK) ? TFT_WHITE : TFT_BLACK);
+  dst->setTextDatum(top_right);
+  dst->setTextColor(color);
+  dst->drawString(text, right, y);
+}
+
+/**
+ * index番目がバッファにあれば返す (読込み直さない)
+ * @return バッファ外ならNULL
+ */
+struct Buffer *bufferedEntry(struct Dir *dir, struct Buffer *buf, uint16_t index)
+{
+  uint16_t start = dir->external ? dir->windowStart : 0;
+  if (index < start || index >= min(start + N_BUF, (int)dir->totalFileCount)) {
+    return NULL;
+  }
+  return &buf[index - start];
+}
+
+/**
+ * バッファ内の曲の長さを調べさせる (表示中の行→後続→先行の順, 覚えている曲は除く)
+ * @param first 表示中の先頭の項目
+ */
+void durationRequest(struct Dir *dir, struct Buffer *buf, uint16_t first)
+{
+  if (!Features::durations || durations.lock == NULL || isLibraryPath(dir->path)) {
+    return;
+  }
+  durations.dir = dir->path;
+  uint16_t start = dir->external ? dir->windowStart : 0;
+  uint16_t end = min(start + N_BUF, (int)dir->totalFileCount);
+  first = constrain(first, start, end);
+  uint16_t after = end - first;
+
+  xSemaphoreTake(durations.lock, portMAX_DELAY);
+  durations.jobCount = 0;
+  durations.jobPos = 0;
+  for (uint16_t n = 0; n < end - start; n++) {
+    uint16_t index = (n < after) ? first + n : first - 1 - (n - after);
+    struct Buffer *entry = &buf[index - start];
+    if (entry->isDir || !isSupportedFormat(entry->filename)) {
+      continue;
+    }
+    String path = listedPath(dir->path, entry->filename);
+    if (durationSlot(hashPath(path.c_str())) < 0) {
+      durations.job[durations.jobCount++] = path;
+    }
+  }
+  durations.busy = (durations.jobCount > 0);
+  xSemaphoreGive(durations.lock);
+
+  if (durations.busy) {
+    xTaskNotifyGive(durations.task);
+  }
+}
+
+/** 表示中の選択行以外の曲の長さを描き直す */
+void printListDurations(struct Dir *dir, struct Buffer *buf, uint16_t first, uint8_t displaypos)
+{
+  for (uint8_t i = 0; i < 5; i++) {
+    struct Buffer *entry = bufferedEntry(dir, buf, first + i);
+    if (i != displaypos && entry != NULL) {
+      printFileDuration(&canvas, TFT_WHITE, cachedDuration(entry), X_PIXEL - 1, SEL_LINE_HEIGHT * i);
+    }
+  }
+}
+
+int32_t printFile(lgfx::v1::LovyanGFX *dst, int color, struct Buffer *buf, uint8_t pos) {
+  LGFX_Sprite filename;
+  int32_t cursor_x;
+
+  memSprite(&filename);
+  filename.createSprite(1000, SEL_LINE_HEIGHT);
+  filename.fillSprite((color == TFT_BLACK) ? TFT_WHITE : TFT_BLACK);
+  filename.setTextDatum(top_left);
+  filename.setCursor(0, 0);
+  filename.setFont(FONT_SELECT);
+  filename.setTextColor(color);
+  filename.setTextWrap(false);
+  filename.print(buf->filename);
+
+  cursor_x = filename.getCursorX();
+
+  filename.pushSprite(dst, 0, pos);
+  filename.deleteSprite();
+
+  // 選択行のスクロール用の幅広のスプライトには描かない (スクロールしないよう画面側で重ねる)
+  if (dst->width() <= X_PIXEL - ICON_WIDTH) {
+    printFileDuration(dst, color, cachedDuration(buf), dst->width(), pos);
+  }
+
+  return cursor_x;
+}
+
+void printDirectory(struct Dir *dir, struct Buffer *buf, uint16_t pos)
+{
+  uint16_t first = pos;
+  menu_icon.createSprite(ICON_WIDTH, display.height());
+  menu_name.createSprite(display.width() - ICON_WIDTH, display.height());
+  menu_icon.clear(TFT_BLACK);
+  menu_name.clear(TFT_BLACK);
+
+  for (uint8_t i = 0; i < 5 && pos < dir->totalFileCount; i++) {
+    struct Buffer *entry = entryAt(dir, buf, pos++);
+
+    printIcon(&menu_icon, TFT_WHITE, entry, SEL_LINE_HEIGHT * i);
+
+    printFile(&menu_name, TFT_WHITE, entry, SEL_LINE_HEIGHT * i);
+  }
+  menu_icon.pushSprite(&canvas, 0, 0);
+  menu_name.pushSprite(&canvas, ICON_WIDTH - 1, 0);
+
+  menu_icon.deleteSprite();
+  menu_name.deleteSprite();
+
+  durationRequest(dir, buf, first);
+}
+
+/**
+ * 画面転送タスク (I2Cの転送は音声処理と別のコアで行い、再生・入力処理をバスで待たせない)
+ * 転送中に届いた要求は行範囲をまとめて次の1回で転送する
+ */
+void displayTask(void *param)
+{
+  (void)param;
+  static const uint16_t palette[2] = {TFT_BLACK, TFT_WHITE};
+  struct DisplayFrame *f = &displayFrame;
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    xSemaphoreTake(f->lock, portMAX_DELAY);
+    uint8_t top = f->dirtyTop;
+    uint8_t bottom = f->dirtyBottom;
+    uint32_t requestedAt = f->requestedAt;
+    if (top < bottom) {
+      memcpy(f->front[top], f->back[top], (bottom - top) * sizeof(f->back[0]));
+    }
+    f->dirtyTop = Y_PIXEL;
+    f->dirtyBottom = 0;
+    xSemaphoreGive(f->lock);
+
+    if (top >= bottom) {
+      continue;
+    }
+    uint32_t start = micros();
+    awakeBegin();
+    display.pushImage(0, top, X_PIXEL, bottom - top, f->front[top], lgfx::color_depth_t::palette_1bit, palette);
+    awakeEnd();
+    traceSpan(trace_flush, top, start);
+    inputFlushed(requestedAt, micros());
+    f->frames++;
+    bootMark(boot_first_pixel);
+  }
+}
+
+void initDisplayTask()
+{
+  displayFrame.dirtyTop = Y_PIXEL;
+  displayFrame.dirtyBottom = 0;
+  displayFrame.lock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(displayTask, "display", DISPLAY_STACK, NULL, 1, &displayFrame.task, DISPLAY_CORE);
+}
+
+/**
+ * canvasのtop行からheight行を転送する (backに1bppで詰めて転送タスクに渡すだけで、転送の完了は待たない)
+ * canvasは白黒でしか描画しないため、黒以外を点灯とする
+ */
+void flushRows(uint8_t top, uint8_t height)
+{
+  struct DisplayFrame *f = &displayFrame;
+  const uint16_t *src = static_cast<const uint16_t*>(canvas.getBuffer());
+  uint8_t bottom = min(top + height, Y_PIXEL);
+
+  xSemaphoreTake(f->lock, portMAX_DELAY);
+  for (uint8_t y = top; y < bottom; y++) {
+    const uint16_t *row = src + y * X_PIXEL;
+    for (uint8_t x = 0; x < X_PIXEL / 8; x++) {
+      uint8_t bits = 0;
+      for (uint8_t b = 0; b < 8; b++) {
+        bits = (bits << 1) | (row[x * 8 + b] != TFT_BLACK);
+      }
+      f->back[y][x] = bits;
+    }
+  }
+  if (f->dirtyTop < f->dirtyBottom) {
+    f->merged++;
+  }
+  f->dirtyTop = min(f->dirtyTop, top);
+  f->dirtyBottom = max(f->dirtyBottom, bottom);
+  f->requestedAt = micros();
+  xSemaphoreGive(f->lock);
+
+  xTaskNotifyGive(f->task);
+}
+
+/** キャンバスを画面に転送する */
+void flushCanvas()
+{
+  flushRows(0, Y_PIXEL);
+}
+
+/** ルートディレクトリ先頭1画面分をNVSに保存する (内容が変わった時のみ書込) */
+void saveListingCache(const struct Dir *dir, const struct Buffer *buf)
+{
+  struct ListingCache cache = {0};
+  struct ListingCache stored = {0};
+
+  cache.count = min((uint16_t)LISTING_CACHE_LINES, dir->totalFileCount);
+  for (uint8_t i = 0; i < cache.count; i++) {
+    cache.isDir[i] = buf[i].isDir;
+    strncpy(cache.filename[i], buf[i].filename.c_str(), LISTING_CACHE_NAME_LEN - 1);
+  }
+
+  prefs.getBytes("listing", &stored, sizeof(stored));
+  if (memcmp(&cache, &stored, sizeof(cache)) != 0) {
+    prefs.putBytes("listing", &cache, sizeof(cache));
+  }
+}
+
+/**
+ * 内容の変わったディレクトリの保存済み一覧を消す (ライブラリ走査で変更を見つけた時)
+ * 次に開いた時に整列し直し、ルートなら起動時の一覧も保存し直す
+ */
+void dropListingCache(const String &path)
+{
+  struct Dir dir;
+  const char *ext[3] = {"dat", "idx", "pfx"};
+
+  dir.path = path;
+  for (uint8_t i = 0; i < 3; i++) {
+    SD.remove(listingPath(&dir, ext[i]));
+  }
+  if (path == "/") {
+    prefs.remove("listing");
+  }
+}
+
+/** SDマウント完了前にキャッシュ済みの一覧を描画する */
+boolean drawCachedListing()
+{
+  struct ListingCache cache = {0};
+  struct Buffer buf[LISTING_CACHE_LINES];
+  struct Dir dir;
+
+  if (prefs.getBytes("listing", &cache, sizeof(cache)) != sizeof(cache) || cache.count == 0) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < cache.count && i < LISTING_CACHE_LINES; i++) {
+    cache.filename[i][LISTING_CACHE_NAME_LEN - 1] = '\0';
+    buf[i].filename = String(cache.filename[i]);
+    buf[i].isDir = cache.isDir[i];
+  }
+
+  dir.totalFileCount = min(cache.count, (uint8_t)LISTING_CACHE_LINES);
+  canvas.clear(TFT_BLACK);
+  printDirectory(&dir, buf, 0);
+  flushCanvas();
+  return true;
+}
+
+/** 索引からコードポイントを二分探索する */
+const struct PackedGlyph *findPackedGlyph(const struct PackedGlyph *index, uint16_t count, uint32_t code)
+{
+  uint16_t lo = 0;
+  uint16_t hi = count;
+  while (lo < hi) {
+    uint16_t mid = (lo + hi) / 2;
+    if (index[mid].code < code) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo < count && index[lo].code == code) ? &index[lo] : NULL;
+}
+
+/** フォントファイルを開いてページ表を読込む (初回のみ, 読込タスクから呼ぶ) */
+bool openFontFile(struct FontFile *font)
+{
+  if (font->tried) {
+    return (bool)font->file;
+  }
+  font->tried = true;
+  for (uint8_t i = 0; i < FONT_INDEX_PAGES; i++) {
+    font->page[i] = -1;
+  }
+
+  IoScope scope(io_metadata);
+  font->file = SD.open(font->path);
+  if (!font->file) {
+    font->unusable = true;
+    return false;
+  }
+  struct PackedFontHeader header;
+  bool valid = font->file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)
+    && memcmp(header.magic, "PFN1", 4) == 0 && (1 << header.pageShift) == FONT_PAGE_GLYPHS;
+  font->pages = valid ? (header.count + FONT_PAGE_GLYPHS - 1) / FONT_PAGE_GLYPHS : 0;
+  if (!valid || font->pages > FONT_PAGE_MAX || header.height > GLYPH_MAX
+      || font->file.read((uint8_t *)font->pageFirst, font->pages * 2) != font->pages * 2) {
+    trace(trace_tag_error, 5, 0, micros());   // Font file invalid.
+    font->file.close();
+    font->unusable = true;
+    return false;
+  }
+  font->count = header.count;
+  font->bitmapStart = sizeof(header) + font->pages * 2 + (uint32_t)header.count * sizeof(struct PackedGlyph);
+  font->height = header.height;
+  return true;
+}
+
+/** フォントファイルの文字を探す (該当ページの索引がなければ最も古いページと置き換えて読込む) */
+const struct PackedGlyph *fileGlyph(struct FontFile *font, uint32_t code)
+{
+  if (!openFontFile(font) || font->pages == 0 || code < font->pageFirst[0] || code > 0xFFFF) {
+    return NULL;
+  }
+  // pageFirst[page] <= code となる最後のページ
+  uint16_t lo = 0;
+  uint16_t hi = font->pages;
+  while (hi - lo > 1) {
+    uint16_t mid = (lo + hi) / 2;
+    if (font->pageFirst[mid] <= code) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  uint8_t slot = 0;
+  for (uint8_t i = 0; i < FONT_INDEX_PAGES; i++) {
+    if (font->page[i] == lo) {
+      slot = i;
+      break;
+    }
+    if (font->pageUse[i] < font->pageUse[slot]) {
+      slot = i;
+    }
+  }
+  if (font->page[slot] != lo) {
+    uint32_t first = (uint32_t)lo * FONT_PAGE_GLYPHS;
+    uint8_t count = min(font->count - first, (uint32_t)FONT_PAGE_GLYPHS);
+    IoScope scope(io_metadata);
+    font->page[slot] = -1;
+    if (!font->file.seek(sizeof(struct PackedFontHeader) + font->pages * 2 + first * sizeof(struct PackedGlyph))
+        || font->file.read((uint8_t *)font->index[slot], count * sizeof(struct PackedGlyph)) != count * sizeof(struct PackedGlyph)) {
+      return NULL;
+    }
+    font->page[slot] = lo;
+    font->pageCount[slot] = count;
+  }
+  font->pageUse[slot] = ++font->pageClock;
+  return findPackedGlyph(font->index[slot], font->pageCount[slot], code);
+}
+
+/** フォントファイルから1文字の索引とビットマップを読込む (ない・大きすぎればfound = false) */
+void loadFileGlyph(struct FontFile *font, struct FileGlyph *glyph)
+{
+  const struct PackedGlyph *packed = fileGlyph(font, glyph->code);
+  glyph->found = false;
+  if (packed == NULL) {
+    return;
+  }
+  uint16_t size = (packed->width + 7) / 8 * packed->height;
+  if (size > sizeof(glyph->bits)) {
+    return;
+  }
+  IoScope scope(io_metadata);
+  if (!font->file.seek(font->bitmapStart + packed->offset) || font->file.read(glyph->bits, size) != size) {
+    return;
+  }
+  glyph->packed = *packed;
+  glyph->found = true;
+}
+
+/**
+ * フォントファイルの読込タスク
+ * 依頼された文字をコードポイント順に (索引ページ毎にまとめて) 読み、最も古い文字と置き換える
+ */
+void fontFileTask(void *param)
+{
+  struct FontFile *font = (struct FontFile *)param;
+  uint16_t codes[FONT_STORE_SIZE];
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    xSemaphoreTake(font->lock, portMAX_DELAY);
+    uint8_t num = font->requestCount;
+    memcpy(codes, font->request, num * sizeof(codes[0]));
+    font->requestCount = 0;
+    xSemaphoreGive(font->lock);
+
+    std::sort(codes, codes + num);
+    for (uint8_t i = 0; i < num; i++) {
+      struct FileGlyph glyph = {0};
+      glyph.code = codes[i];
+      ioYield();                        // 再生の先読みを優先する
+      loadFileGlyph(font, &glyph);
+
+      xSemaphoreTake(font->lock, portMAX_DELAY);
+      struct FileGlyph *oldest = &font->store[0];
+      for (uint8_t j = 0; j < FONT_STORE_SIZE; j++) {
+        if (font->store[j].lastUse < oldest->lastUse) {
+          oldest = &font->store[j];
+        }
+      }
+      glyph.lastUse = ++font->clock;
+      *oldest = glyph;
+      xSemaphoreGive(font->lock);
+    }
+    font->updated++;
+  }
+}
+
+/**
+ * 読込済みの文字を複写する (描画側から呼ぶ・SDを読まない)
+ * @return 未読込なら読込タスクに依頼して false (読込めばupdatedが変わる)
+ */
+bool storedGlyph(struct FontFile *font, uint32_t code, struct FileGlyph *glyph)
+{
+  if (font->unusable || code > 0xFFFF) {
+    glyph->found = false;
+    return true;
+  }
+  if (font->task == NULL) {
+    font->lock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(fontFileTask, "font", FONT_STACK, font, tskIDLE_PRIORITY + 1, &font->task, FONT_CORE);
+  }
+
+  bool stored = false;
+  bool requested = false;
+  xSemaphoreTake(font->lock, portMAX_DELAY);
+  for (uint8_t i = 0; i < FONT_STORE_SIZE && !stored; i++) {
+    if (font->store[i].code == code && font->store[i].lastUse != 0) {
+      font->store[i].lastUse = ++font->clock;
+      *glyph = font->store[i];
+      stored = true;
+    }
+  }
+  for (uint8_t i = 0; i < font->requestCount && !stored && !requested; i++) {
+    requested = (font->request[i] == code);
+  }
+  if (!stored && !requested && font->requestCount < FONT_STORE_SIZE) {
+    font->request[font->requestCount++] = code;
+    xTaskNotifyGive(font->task);
+  }
+  xSemaphoreGive(font->lock);
+  return stored;
+}
+
+/**
+ * LovyanGFXのフォントでグリフをラスタライズする
+ * @param utf8 1文字分のUTF-8
+ * @return 大きすぎてキャッシュできなければ false
+ */
+bool rasterGfxGlyph(struct Glyph *glyph, const lgfx::IFont *font, const char *utf8)
+{
+  if (glyphScratch.getBuffer() == NULL) {
+    memSprite(&glyphScratch);
+    glyphScratch.setColorDepth(1);
+    glyphScratch.createSprite(GLYPH_MAX, GLYPH_MAX);
+  }
+  glyphScratch.clear(TFT_BLACK);
+  glyphScratch.setFont(font);
+  glyphScratch.setTextDatum(top_left);
+  glyphScratch.setTextColor(TFT_WHITE);
+  int32_t width = glyphScratch.drawString(utf8, 0, 0);
+  int32_t height = glyphScratch.fontHeight();
+  if (width > GLYPH_MAX || height > GLYPH_MAX) {
+    return false;
+  }
+
+  glyph->width = width;
+  glyph->height = height;
+  memset(glyph->bitmap, 0, sizeof(glyph->bitmap));
+  for (uint8_t j = 0; j < height; j++) {
+    for (uint8_t i = 0; i < width; i++) {
+      if (glyphScratch.readPixel(i, j)) {
+        glyph->bitmap[j * (GLYPH_MAX / 8) + i / 8] |= 0x80 >> (i % 8);
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * 圧縮フォントのグリフを展開する
+ * @param bits グリフのビットマップ
+ * @param height フォントの行の高さ
+ * @return 大きすぎれば false
+ */
+bool rasterPackedGlyph(struct Glyph *glyph, const struct PackedGlyph *packed, const uint8_t *bits, uint8_t height)
+{
+  if (packed->advance > GLYPH_MAX || height > GLYPH_MAX) {
+    return false;
+  }
+
+  glyph->width = packed->advance;
+  glyph->height = height;
+  memset(glyph->bitmap, 0, sizeof(glyph->bitmap));
+  uint8_t stride = (packed->width + 7) / 8;
+  for (uint8_t j = 0; j < packed->height; j++) {
+    int16_t y = packed->y + j;
+    if (y < 0 || y >= height) {
+      continue;
+    }
+    for (uint8_t i = 0; i < packed->width; i++) {
+      int16_t x = packed->x + i;
+      if (x >= 0 && x < GLYPH_MAX && (bits[j * stride + i / 8] & (0x80 >> (i % 8)))) {
+        glyph->bitmap[y * (GLYPH_MAX / 8) + x / 8] |= 0x80 >> (x % 8);
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * グリフをラスタライズする (フォントファイル→LovyanGFXのフォント→組込みの圧縮フォントの順に探す)
+ * @param utf8 1文字分のUTF-8
+ * @param pending フォントファイルの読込タスクに依頼したら true (読込めば描き直す)
+ * @return 文字がないか大きすぎれば false
+ */
+bool rasterGlyph(struct Glyph *glyph, const struct UiFont *font, uint32_t code, const char *utf8, bool *pending)
+{
+  struct FileGlyph stored;
+  const struct PackedGlyph *packed;
+
+  if (font->file != NULL) {
+    if (!storedGlyph(font->file, code, &stored)) {
+      *pending = true;
+      return false;
+    }
+    if (stored.found) {
+      return rasterPackedGlyph(glyph, &stored.packed, stored.bits, font->file->height);
+    }
+  }
+  if (font->gfx != NULL) {
+    return rasterGfxGlyph(glyph, font->gfx, utf8);
+  }
+  if (font->packed != NULL && (packed = findPackedGlyph(font->packed->index, font->packed->count, code)) != NULL) {
+    return rasterPackedGlyph(glyph, packed, font->packed->bitmap + packed->offset, font->packed->height);
+  }
+  return false;
+}
+
+/**
+ * グリフを取得する (キャッシュになければラスタライズして最も古いものと置き換える)
+ * @param utf8 1文字分のUTF-8
+ * @param pending フォントファイルの読込待ちなら true
+ */
+struct Glyph *getGlyph(const struct UiFont *font, uint32_t code, const char *utf8, bool *pending)
+{
+  if (glyphCache == NULL) {
+    glyphCache = (struct Glyph *)memAlloc(sizeof(struct Glyph) * GLYPH_CACHE_SIZE, mem_bulk);
+    if (glyphCache == NULL) {
+      return NULL;
+    }
+    memset(glyphCache, 0, sizeof(struct Glyph) * GLYPH_CACHE_SIZE);
+  }
+  struct Glyph *oldest = &glyphCache[0];
+
+  for (uint8_t i = 0; i < GLYPH_CACHE_SIZE; i++) {
+    struct Glyph *g = &glyphCache[i];
+    if (g->font == font && g->code == code) {
+      g->lastUse = ++glyphClock;
+      return g;
+    }
+    if (g->lastUse < oldest->lastUse) {
+      oldest = g;
+    }
+  }
+
+  bool cached = rasterGlyph(oldest, font, code, utf8, pending);
+  if (!cached) {
+    oldest->font = NULL;              // 大きすぎる・ない文字はキャッシュしない (展開途中の枠は空ける)
+    oldest->lastUse = 0;
+    return NULL;
+  }
+  oldest->font = font;
+  oldest->code = code;
+  oldest->lastUse = ++glyphClock;
+  return oldest;
+}
+
+/** フォントの行の高さ */
+int32_t uiFontHeight(lgfx::v1::LovyanGFX *dst, const struct UiFont *font)
+{
+  if (font->file != NULL && !font->file->unusable && font->file->height != 0) {
+    return font->file->height;
+  }
+  if (font->gfx != NULL) {
+    dst->setFont(font->gfx);
+    return dst->fontHeight();
+  }
+  return font->packed->height;
+}
+
+/** フォントファイルから文字を読込んだ回数 (変われば描き直す) */
+uint32_t uiFontUpdates(const struct UiFont *font)
+{
+  return (font->file != NULL) ? font->file->updated : 0;
+}
+
+/**
+ * グリフキャッシュを使って文字列を描画する (dstをNULLにすると幅のみ求める)
+ * どのフォントにもない文字は四角を描き、フォントファイルの読込待ちの文字は同じ幅を空ける
+ * @return 描画後のx座標
+ */
+int32_t drawCachedText(lgfx::v1::LovyanGFX *dst, const struct UiFont *font, const char *utf8, int32_t x, int32_t y, uint32_t color)
+{
+  while (*utf8) {
+    const char *head = utf8;
+    uint32_t code = decodeUTF8(&utf8);
+    char ch[5] = {0};
+    memcpy(ch, head, min((int)(utf8 - head), 4));
+
+    bool pending = false;
+    struct Glyph *g = getGlyph(font, code, ch, &pending);
+    if (g == NULL && font->file == NULL && font->gfx != NULL) {
+      if (dst != NULL) {                // キャッシュできない大きさの文字
+        dst->setFont(font->gfx);
+        dst->setTextColor(color);
+        dst->setTextDatum(top_left);
+        x += dst->drawString(ch, x, y);
+      }
+      continue;
+    }
+    if (g == NULL) {
+      int32_t height = (font->file != NULL && font->file->height != 0) ? font->file->height
+                     : (font->packed != NULL) ? font->packed->height : GLYPH_MAX;
+      if (dst != NULL && !pending) {
+        if (x >= dst->width()) {
+          break;
+        }
+        dst->drawRect(x + 1, y + 1, height / 2 - 1, height - 2, color);
+      }
+      x += height / 2;
+      continue;
+    }
+    if (dst != NULL) {
+      if (x >= dst->width()) {
+        break;
+      }
+      dst->drawBitmap(x, y, g->bitmap, GLYPH_MAX, g->height, color);
+    }
+    x += g->width;
+  }
+  return x;
+}
+
+/** グリフキャッシュを使って文字列を中央揃えで描画する */
+void drawCachedTextCenter(lgfx::v1::LovyanGFX *dst, const struct UiFont *font, const char *utf8, int32_t x, int32_t y, uint32_t color)
+{
+  int32_t width = drawCachedText(NULL, font, utf8, 0, 0, color);
+  drawCachedText(dst, font, utf8, x - width / 2, y - uiFontHeight(dst, font) / 2, color);
+}
+
+void invertRect(uint8_t x, uint8_t y, uint8_t width, uint8_t height)
+{
+  std::uint16_t buffer[width];
+  for (uint16_t i = y ; i < y + height; i++) {
+    canvas.readRect(x, i, width, 1, buffer);
+    for (uint16_t j = 0; j < width; j++) {
+      buffer[j] ^= 0xFFFF;
+    }
+    canvas.pushImage(x, i, width, 1, buffer);
+  }
+}
+
+void invertYRect(uint8_t y, uint8_t height)
+{
+  invertRect(0, y, display.width(), height);
+}
+
+void invertLine(uint8_t pos)
+{
+  invertYRect(SEL_LINE_HEIGHT * pos, SEL_LINE_HEIGHT);
+  flushCanvas();
+}
+
+/** 選択中ファイル名を2ピクセル横スクロールする (末尾に達したら先頭を再描画) */
+void scrollStep(struct Buffer *buf, int32_t text_size, int *scrollPixel)
+{
+  if (*scrollPixel <= 0) {
+    *scrollPixel = text_size + 20;
+    menu_name.setCursor(text_size + 20, 0);
+    menu_name.setFont(FONT_SELECT);
+    menu_name.setTextDatum(top_left);
+    menu_name.setTextColor(TFT_BLACK);
+    menu_name.setTextWrap(false);
+    menu_name.print(buf->filename);
+  }
+
+  menu_name.scroll(-2, 0);
+  *scrollPixel -= 2;
+}
+
+/** 選択表示を解除する */
+void unselectLine(struct Buffer *entry, uint8_t displaypos)
+{
+  menu_icon.fillSprite(TFT_BLACK);
+  printIcon(&menu_icon, TFT_WHITE, entry, 0);
+  menu_icon.pushSprite(&canvas, 0, SEL_LINE_HEIGHT * displaypos);
+
+  menu_name.fillSprite(TFT_BLACK);
+  printFile(&menu_name, TFT_WHITE, entry, 0);
+  menu_name.pushSprite(&canvas, ICON_WIDTH, SEL_LINE_HEIGHT * displaypos);
+  printFileDuration(&canvas, TFT_WHITE, cachedDuration(entry), X_PIXEL - 1, SEL_LINE_HEIGHT * displaypos);
+
+  flushCanvas();
+}
+
+/** 一覧表示中の待ち (操作がなければ浅い眠りで待つ, 一覧表示中の再生は再生タスクが続ける) */
+void browseWait(uint32_t ms)
+{
+  if (!powerIdle(ms)) {
+    delay(ms);
+  }
+}
+
+enum Button filenameScroll(struct Dir *dir, struct Buffer *buf, uint8_t displaypos, uint16_t filepos)
+{
+  enum Button push;
+  int scrollPixel = 0;
+  struct Buffer *entry = entryAt(dir, buf, filepos);
+
+  menu_icon.createSprite(ICON_WIDTH, SEL_LINE_HEIGHT);
+  menu_name.createSprite(1000, SEL_LINE_HEIGHT);
+
+  printIcon(&menu_icon, TFT_BLACK, entry, 0);
+  menu_icon.pushSprite(&canvas, 0, SEL_LINE_HEIGHT * displaypos);
+
+  int32_t text_size = printFile(&menu_name, TFT_BLACK, entry, 0);
+
+  if (text_size > display.width() - ICON_WIDTH) {
+    menu_name.setScrollRect(0, 0, text_size * 2 + 20, SEL_LINE_HEIGHT, TFT_WHITE);
+  }
+  flushCanvas();                        // 選択行以外の変更も反映する (以降は選択行だけを転送する)
+  uint32_t durationsSeen = durations.updated;
+  int16_t seconds = cachedDuration(entry);
+    
+  while (1) {
+    menu_name.pushSprite(&canvas, ICON_WIDTH - 1, SEL_LINE_HEIGHT * displaypos);
+    printFileDuration(&canvas, TFT_BLACK, seconds, X_PIXEL - 1, SEL_LINE_HEIGHT * displaypos);
+    if (Features::durations && durations.updated != durationsSeen) {
+      // 調べ終えた曲の長さを表示中の行に反映する
+      durationsSeen = durations.updated;
+      seconds = cachedDuration(entry);
+      printListDurations(dir, buf, filepos - displaypos, displaypos);
+      flushCanvas();
+    } else {
+      flushRows(SEL_LINE_HEIGHT * displaypos, SEL_LINE_HEIGHT);
+    }
+    
+    if (text_size > display.width() - ICON_WIDTH) {
+      browseWait(100);
+      scrollStep(entry, text_size, &scrollPixel);
+    } else if (!powerIdle(GOV_SLEEP_MS)) {
+      delay(10);                        // 再生タスク・走査タスクに譲る
+    }
+
+    traceService();
+
+    uint8_t prev_state = pushButton(PREV, &prev_status, &startTime_prev, false, 10, JUMP_PRESS_TIME);
+    if (prev_state == momentPress_determined || prev_state == longPress_determined) {
+      unselectLine(entry, displaypos);
+      push = (prev_state == longPress_determined) ? prev_jump : prev;
+      break;
+    }
+
+    uint8_t next_state = pushButton(NEXT, &next_status, &startTime_next, false, 10, JUMP_PRESS_TIME);
+    if (next_state == momentPress_determined || next_state == longPress_determined) {
+      unselectLine(entry, displaypos);
+      push = (next_state == longPress_determined) ? next_jump : next;
+      break;
+    }
+
+    uint8_t play_state = pushButton(PLAY, &play_status, &startTime_play, false, 10, 500);
+    if (play_state == momentPress_determined) {
+      push = play;
+      break;
+    }
+    if (Features::queue && play_state == longPress_determined) {
+      push = enqueue;
+      break;
+    }
+
+    uint8_t back_state = pushButton(BACK, &back_status, &startTime_back, false, 10, 500);
+    if (back_state == momentPress_determined) {
+      push = back;
+      break;
+    }
+
+    uint8_t volup_state = pushButton(VOL_UP, &volup_status, &startTime_volup, true, 10, 500);
+    if (volup_state == momentPress_determined || volup_state == continuous_press) {
+      setVol(1);
+    }
+
+    uint8_t voldown_state = pushButton(VOL_DOWN, &voldown_status, &startTime_voldown, true, 10, 500);
+    if (voldown_state == momentPress_determined || voldown_state == continuous_press) {
+      setVol(0);
+    }
+  }
+
+  menu_icon.deleteSprite();
+  menu_name.deleteSprite();
+
+  return push;
+}
+
+/**
+ * selectNum番目を選択した状態の一覧を描画する
+ * @return 選択行の表示位置
+ */
+int8_t printSelection(struct Dir *dir, struct Buffer *buf, uint16_t selectNum)
+{
+  if (selectNum <= 2 || dir->totalFileCount <= 5) {
+    printDirectory(dir, buf, 0);
+    return selectNum;
+  } else if (selectNum <= dir->totalFileCount - 1 && selectNum >= dir->totalFileCount - 3) {
+    printDirectory(dir, buf, dir->totalFileCount - 5);
+    return 4 - ((dir->totalFileCount - 1) - selectNum);
+  }
+  printDirectory(dir, buf, selectNum - 2);
+  return 2;
+}
+
+uint8_t countLatestDir(const struct Dir *dir)
+{
+  uint8_t count = 0;
+  while (dir[count].path != NULL) {
+    count++;
+  }
+  return count - 2;
+}
+
+uint32_t readSyncsafe(const uint8_t *size)
+{
+  return (size[0] << 21) + (size[1] << 14) + (size[2] << 7) + size[3];
+}
+
+uint32_t readBigEndian(const uint8_t *size)
+{
+  return ((uint32_t)size[0] << 24) + (size[1] << 16) + (size[2] << 8) + size[3];
+}
+
+/** posのフレームに続くフレームが同じバージョン・レイヤ・サンプリングレートか (ファイル末尾なら true) */
+boolean confirmFrame(File *file, uint32_t pos, const struct MPEGFrameHeader *frame)
+{
+  struct MPEGFrameHeader next;
+  uint8_t buff[MPEGFRAME_HEADER_SIZE];
+
+  pos += frame->frame_size;
+  if (pos + MPEGFRAME_HEADER_SIZE > file->size()) {
+    return true;
+  }
+  file->seek(pos);
+  return file->read(buff, sizeof(buff)) == sizeof(buff) && decodeFrameHeader(readBigEndian(buff), &next)
+    && next.version == frame->version && next.layer == frame->layer && next.sampling_rate == frame->sampling_rate;
+}
+
+/**
+ * posから最大MPEG_SYNC_SCANバイトの範囲で最初のフレームを探す
+ * タグの後のゴミ・偶然の同期ワードを読み飛ばすため、続くフレームも確かめる
+ */
+boolean findFrame(File *file, uint32_t pos, struct MPEGFrameHeader *frame)
+{
+  uint8_t buff[MPEG_SCAN_CHUNK];
+  uint32_t end = min(pos + MPEG_SYNC_SCAN, (uint32_t)file->size());
+
+  while (pos + MPEGFRAME_HEADER_SIZE <= end) {
+    file->seek(pos);
+    int len = file->read(buff, sizeof(buff));
+    if (len < MPEGFRAME_HEADER_SIZE) {
+      return false;
+    }
+    for (int i = 0; i + MPEGFRAME_HEADER_SIZE <= len && pos + i < end; i++) {
+      if (buff[i] == 0xFF && (buff[i + 1] & 0xE0) == 0xE0
+          && decodeFrameHeader(readBigEndian(buff + i), frame) && confirmFrame(file, pos + i, frame)) {
+        frame->offset = pos + i;
+        return true;
+      }
+    }
+    pos += len - (MPEGFRAME_HEADER_SIZE - 1);     // 読込の境界にまたがるヘッダも探す
+  }
+  return false;
+}
+
+/** 最初のフレームのXing/Infoヘッダ (VBRの総フレーム数) を読む */
+void readXingHeader(File *file, struct MPEGFrameHeader *frame)
+{
+  struct XingHeader xing;
+  const size_t len = offsetof(struct XingHeader, filesize);
+
+  frame->frames = 0;
+  if (frame->layer != 3) {
+    return;
+  }
+  file->seek(frame->offset + MPEGFRAME_HEADER_SIZE + (frame->crc ? 2 : 0)
+             + MPEG_SIDE_INFO[frame->version != 3][frame->channel == 3]);
+  if (file->read(reinterpret_cast<uint8_t*>(&xing), len) != len
+      || (memcmp(xing.tag, "Xing", 4) != 0 && memcmp(xing.tag, "Info", 4) != 0)) {
+    return;
+  }
+  if (xing.flags[3] & 0x01) {
+    frame->frames = readBigEndian(xing.num_flames);
+  }
+}
+
+/**
+ * ID3v2タグを飛ばして最初のMPEGフレームを探し、フレームヘッダ情報をframeに格納する
+ * @return 音声データ (最初のフレームからID3v1タグの前まで) のバイト数 (見つからなければ0)
+ */
+size_t getTagData(File file, struct MPEGFrameHeader *frame)
+{
+  IoScope scope(io_metadata);
+  struct MPEGFrameHeader null_struct = {0};
+  *frame = null_struct;
+
+  if (!file) {
+    trace(trace_tag_error, 1, 0, micros());   // File could not open.
+    return 0;
+  }
+
+  // ID3v2ヘッダ 読込
+  struct ID3v2Header header = {0};
+  uint32_t tagpos = 0;
+
+  if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)) {
+    trace(trace_tag_error, 2, 0, micros());   // ID3v2 Header read failed.
+    return 0;
+  }
+  if (memcmp(header.tag, "ID3", 3) == 0) {
+    // ID3v2ヘッダ以降のID3v2タグのサイズ (Syncsafe Integer, v2.4はフッタの分を加える)
+    tagpos = sizeof(header) + readSyncsafe(header.size) + ((header.maj_ver == 4 && (header.flags & 0x10)) ? sizeof(header) : 0);
+  }
+
+  if (!findFrame(&file, tagpos, frame)) {
+    trace(trace_tag_error, 4, 0, micros());   // MPEG frame sync not found.
+    return 0;
+  }
+  readXingHeader(&file, frame);
+
+  //ID3v1タグ確認
+  size_t footer_size = 0;
+  uint8_t tag[3];
+  file.seek(file.size() - ID3v1_SIZE);
+  if (file.read(tag, sizeof(tag)) == sizeof(tag) && memcmp(tag, "TAG", 3) == 0) {
+    footer_size = ID3v1_SIZE;
+  }
+
+  if (file.size() < frame->offset + footer_size) {
+    return 0;
+  }
+  return file.size() - frame->offset - footer_size;
+}
+
+/** MP3の長さ[s]を求める (フレームヘッダ情報をframeに格納する) */
+double getDuration(File file, struct MPEGFrameHeader *frame)
+{
+  IoScope scope(io_metadata);
+  size_t mpeg_size = getTagData(file, frame);
+  if (mpeg_size == 0) {
+    return -1;
+  }
+
+  //時間算出 (VBRはXing/Infoヘッダのフレーム数, CBRは平均フレーム長から求める)
+  double frame_count = frame->frames;
+  if (frame_count == 0) {
+    frame_count = mpeg_size / ((double)frame->samples / 8 * frame->bitrate * 1000 / frame->sampling_rate);
+  }
+
+  return frame_count * frame->samples / frame->sampling_rate;
+}
+
+double getmp3TotalTime(const String path)
+{
+  File file = SD.open(path);
+  double duration_sec = getDuration(file, &mFrameHeader);
+  file.close();
+
+  return duration_sec;
+}
+
+String printDuration(double duration)
+{
+  if (duration < 0) {
+    return String("--:--");
+  }
+  int min = (int)duration / 60;
+  int sec = (int)duration - min * 60;
+
+  char formatted_time[8];
+  sprintf(formatted_time, "%d:%02d", min, sec);
+  return String(formatted_time);
+}
+
+String libraryPath(const char *name)
+{
+  return String(LIBRARY_DIR "/") + name;
+}
+
+String libraryRunPath(uint16_t run)
+{
+  char path[24];
+  sprintf(path, LIBRARY_DIR "/r%u.tmp", run);
+  return String(path);
+}
+
+/** UTF-8文字列を文字の途中で切らずにlen-1バイト以内で複写する (残りは0で埋める) */
+void copyText(char *dst, const String &src, size_t len)
+{
+  size_t n = src.length();
+  if (n >= len) {
+    n = len - 1;
+    while (n > 0 && (src[n] & 0xC0) == 0x80) {
+      n--;
+    }
+  }
+  memcpy(dst, src.c_str(), n);
+  memset(dst + n, 0, len - n);
+}
+
+/** ID3v2テキストフレームの本文 (文字コードの後のsizeバイト) を読込みUTF-8に変換する */
+String readTextFrame(File *file, uint8_t encoding, uint32_t size)
+{
+  char text[ID3_TEXT_MAX + 4] = {0};
+
+  if (size == 0) {
+    return String();
   }
+  uint32_t len = min(size, (uint32_t)ID3_TEXT_MAX);
+
+  switch (encoding) {
+    case 1:                           // UTF-16 (BOMあり)
+      file->read(reinterpret_cast<uint8_t*>(text), len);
+      return decodeUTF16(text);
+    case 2:                           // UTF-16BE (BOMなし)
+      text[0] = 0xFE;
+      text[1] = 0xFF;
+      file->read(reinterpret_cast<uint8_t*>(text) + 2, len);
+      return decodeUTF16(text);
+    case 3:                           // UTF-8
+      file->read(reinterpret_cast<uint8_t*>(text), len);
+      return String(text);
+    default:
+      file->read(reinterpret_cast<uint8_t*>(text), len);
+      return decodeLatin1(text);
+  }
+}
 
-  icon.pushSprite(dst, 0, pos);
-  icon.deleteSprite();
+/**
+ * ID3v2タグのフレームヘッダを辿り、アーティスト・アルバム・タイトル・トラック番号のテキストフレームだけを読込む
+ * 画像・歌詞などそれ以外のフレームは中身を読まずにシークで飛ばすため、タグが大きくても読込量は変わらない
+ * (v2.2の6バイトのフレームヘッダはID3v2Frameの形に詰め替える)
+ * @return ID3v2タグ全体のバイト数 (音声データの開始位置, タグがなければ0)
+ */
+uint32_t readID3Text(File *file, String text[ID3_TEXT_NUM])
+{
+  IoScope scope(io_metadata);
+  const char *ids[2][ID3_TEXT_NUM] = {
+    {"TP1", "TAL", "TT2", "TRK", "TP2"},
+    {"TPE1", "TALB", "TIT2", "TRCK", "TPE2"}
+  };
+  struct ID3v2Header header = {0};
+
+  file->seek(0);
+  if (file->read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)
+      || memcmp(header.tag, "ID3", 3) != 0) {
+    return 0;
+  }
+
+  uint32_t tag_end = sizeof(header) + readSyncsafe(header.size);
+  uint32_t audio_start = tag_end + ((header.maj_ver == 4 && (header.flags & 0x10)) ? sizeof(header) : 0);   // フッタ
+  if (header.maj_ver < 2 || header.maj_ver > 4) {
+    return audio_start;
+  }
+
+  bool v22 = (header.maj_ver == 2);
+  uint8_t frameSize = v22 ? 6 : 10;
+  uint8_t idLen = v22 ? 3 : 4;
+  uint32_t pos = sizeof(header);
+  uint8_t found = 0;
+
+  // 拡張ヘッダ スキップ (v2.3はサイズ自身を含まない)
+  if (!v22 && (header.flags & 0x40)) {
+    uint8_t size[4];
+    file->read(size, sizeof(size));
+    pos += (header.maj_ver == 3) ? readBigEndian(size) + 4 : readSyncsafe(size);
+  }
+
+  while (pos + frameSize < tag_end && found < ID3_TEXT_NUM) {
+    struct ID3v2Frame frame = {0};
+    file->seek(pos);
+    if (v22) {
+      uint8_t raw[7];
+      if (file->read(raw, sizeof(raw)) != sizeof(raw)) {
+        break;
+      }
+      memcpy(frame.frame_id, raw, 3);
+      memcpy(frame.size + 1, raw + 3, 3);
+      frame.encoding = raw[6];
+    } else if (file->read(reinterpret_cast<uint8_t*>(&frame), sizeof(frame)) != sizeof(frame)) {
+      break;
+    }
+    if (frame.frame_id[0] == 0) {
+      break;                          // パディング到達
+    }
+
+    uint32_t size;
+    bool plain;                       // 圧縮・暗号化なし
+    if (header.maj_ver == 4) {
+      size = readSyncsafe(frame.size);
+      plain = (frame.flags[1] & 0x0F) == 0;
+    } else {
+      size = readBigEndian(frame.size);
+      plain = v22 || (frame.flags[1] & 0xC0) == 0;
+    }
+
+    for (uint8_t i = 0; i < ID3_TEXT_NUM && plain; i++) {
+      if (memcmp(frame.frame_id, ids[v22 ? 0 : 1][i], idLen) == 0 && text[i].isEmpty()) {
+        text[i] = readTextFrame(file, frame.encoding, (size > 0) ? size - 1 : 0);
+        found++;
+      }
+    }
+    pos += frameSize + size;
+  }
+  return audio_start;
 }
 
-int32_t printFile(lgfx::v1::LovyanGFX *dst, int color, struct Buffer *buf, uint8_t pos) {
-  LGFX_Sprite filename;
-  int32_t cursor_x;
+/** ID3v2タグからアーティスト・アルバム・タイトル・トラック番号・アルバムアーティストを読込む */
+void readTrackTags(File *file, struct TrackRecord *rec)
+{
+  String text[ID3_TEXT_NUM];
+
+  readID3Text(file, text);
+  copyText(rec->artist, text[id3_artist], sizeof(rec->artist));
+  copyText(rec->album, text[id3_album], sizeof(rec->album));
+  copyText(rec->title, text[id3_title], sizeof(rec->title));
+  copyText(rec->albumArtist, text[id3_album_artist], sizeof(rec->albumArtist));
+  rec->track = text[id3_track].toInt();
+}
 
-  filename.createSprite(1000, SEL_LINE_HEIGHT);
-  filename.fillSprite((color == TFT_BLACK) ? TFT_WHITE : TFT_BLACK);
-  filename.setTextDatum(top_left);
-  filename.setCursor(0, 0);
-  filename.setFont(FONT_SELECT);
-  filename.setTextColor(color);
-  filename.setTextWrap(false);
-  filename.print(buf->filename);
+/** ID3v2にない項目をID3v1タグで補う */
+void readTrackTagsV1(File *file, struct TrackRecord *rec)
+{
+  uint8_t tag[ID3v1_SIZE];
 
-  cursor_x = filename.getCursorX();
+  if (file->size() < ID3v1_SIZE) {
+    return;
+  }
+  file->seek(file->size() - ID3v1_SIZE);
+  if (file->read(tag, sizeof(tag)) != sizeof(tag) || memcmp(tag, "TAG", 3) != 0) {
+    return;
+  }
 
-  filename.pushSprite(dst, 0, pos);
-  filename.deleteSprite();
+  char field[31] = {0};
+  struct { char *dst; uint8_t offset; } fields[3] = {
+    {rec->title, 3}, {rec->artist, 33}, {rec->album, 63}
+  };
+  for (uint8_t i = 0; i < 3; i++) {
+    if (fields[i].dst[0] == 0) {
+      memcpy(field, tag + fields[i].offset, 30);
+      String text = decodeLatin1(field);
+      text.trim();
+      copyText(fields[i].dst, text, LIBRARY_TEXT_LEN);
+    }
+  }
+  if (rec->track == 0 && tag[125] == 0) {
+    rec->track = tag[126];
+  }
+}
 
-  return cursor_x;
+/** 曲ファイルからレコードを作成する (タグがなければファイル名を曲名とする) */
+void readTrackRecord(File *file, struct TrackRecord *rec)
+{
+  IoScope scope(io_metadata);
+  struct MPEGFrameHeader frame;
+
+  memset(rec, 0, sizeof(*rec));
+  readTrackTags(file, rec);
+  if (rec->artist[0] == 0 || rec->album[0] == 0 || rec->title[0] == 0) {
+    readTrackTagsV1(file, rec);
+  }
+  if (rec->title[0] == 0) {
+    String name = String(file->name());
+    copyText(rec->title, name.substring(0, name.lastIndexOf('.')), sizeof(rec->title));
+  }
+  if (rec->artist[0] == 0) {
+    copyText(rec->artist, "Unknown", sizeof(rec->artist));
+  }
+  if (rec->album[0] == 0) {
+    copyText(rec->album, "Unknown", sizeof(rec->album));
+  }
+
+  double duration = getDuration(*file, &frame);
+  rec->duration = (duration > 0) ? (uint16_t)min(duration, 65535.0) : 0;
 }
 
-void printDirectory(struct Buffer *buf, uint8_t pos)
+/** info->pathの曲のタグ・長さ・最初のフレームを読込む */
+void readTrackInfo(struct TrackInfo *info)
 {
-  menu_icon.createSprite(ICON_WIDTH, display.height());
-  menu_name.createSprite(display.width() - ICON_WIDTH, display.height());
-  menu_icon.clear(TFT_BLACK);
-  menu_name.clear(TFT_BLACK);
+  String text[ID3_TEXT_NUM];
+  File file = SD.open(info->path);
+  info->audioStart = readID3Text(&file, text);
+  for (uint8_t i = 0; i < ID3_TEXT_NUM; i++) {
+    copyText(info->text[i], text[i], LIBRARY_TEXT_LEN);
+  }
+  info->duration = getDuration(file, &info->frame);
+  file.close();
+  info->ready = true;
+}
 
-  for (uint8_t i = 0; i < 5; i++) {
-    printIcon(&menu_icon, TFT_WHITE, &buf[pos], SEL_LINE_HEIGHT * i);
+/** デコーダに渡し始める位置 (フレームが見つからなかった曲はタグの直後から渡す) */
+uint32_t trackStart(const struct TrackInfo *info)
+{
+  return (info->frame.bitrate != 0) ? info->frame.offset : info->audioStart;
+}
+
+/**
+ * 未読込のキューの曲を探してパスをpathに複写する
+ * @return キュー上の位置 (全て読込済みなら-1)
+ */
+int8_t queueUnread(char *path)
+{
+  int8_t slot = -1;
+
+  xSemaphoreTake(playQueue.lock, portMAX_DELAY);
+  for (uint8_t i = 0; i < playQueue.count; i++) {
+    uint8_t pos = (playQueue.head + i) % QUEUE_MAX;
+    if (!playQueue.entry[pos].ready) {
+      strcpy(path, playQueue.entry[pos].path);
+      slot = pos;
+      break;
+    }
+  }
+  xSemaphoreGive(playQueue.lock);
+  return slot;
+}
+
+/** キューの曲の情報を先読みするタスク (SDの読込は先読みバッファに余裕がある時だけ行う) */
+void queueTask(void *param)
+{
+  (void)param;
+  struct TrackInfo info;
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    int8_t slot;
+    while ((slot = queueUnread(info.path)) >= 0) {
+      ioYield();
+      readTrackInfo(&info);
+
+      // 読込中に再生・追加されて別の曲に入れ替わっていれば捨てる
+      xSemaphoreTake(playQueue.lock, portMAX_DELAY);
+      struct TrackInfo *entry = &playQueue.entry[slot];
+      if (!entry->ready && strcmp(entry->path, info.path) == 0) {
+        *entry = info;
+      }
+      xSemaphoreGive(playQueue.lock);
+    }
+  }
+}
+
+/** 一覧の曲の長さを調べるタスク (SDの読込は先読みバッファに余裕がある時だけ行う) */
+void durationTask(void *param)
+{
+  (void)param;
+  struct MPEGFrameHeader frame;
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (1) {
+      xSemaphoreTake(durations.lock, portMAX_DELAY);
+      if (durations.jobPos >= durations.jobCount) {
+        durations.busy = false;
+        xSemaphoreGive(durations.lock);
+        break;
+      }
+      String path = durations.job[durations.jobPos++];
+      xSemaphoreGive(durations.lock);
+
+      ioYield();
+      File file = SD.open(path);
+      double duration = file ? getDuration(file, &frame) : -1;
+      file.close();
+
+      uint32_t key = hashPath(path.c_str());
+      xSemaphoreTake(durations.lock, portMAX_DELAY);
+      int16_t slot = durationSlot(key);
+      if (slot < 0) {
+        slot = durations.next;
+        durations.next = (durations.next + 1) % DURATION_CACHE_SIZE;
+        durations.key[slot] = key;
+      }
+      durations.seconds[slot] = (duration >= 0) ? (int16_t)min(duration, 32767.0) : -1;
+      durations.updated++;
+      xSemaphoreGive(durations.lock);
+    }
+  }
+}
+
+void initDurations()
+{
+  durations.key = (uint32_t *)memAlloc(sizeof(uint32_t) * DURATION_CACHE_SIZE, mem_bulk);
+  durations.seconds = (int16_t *)memAlloc(sizeof(int16_t) * DURATION_CACHE_SIZE, mem_bulk);
+  if (durations.key == NULL || durations.seconds == NULL) {
+    memFree(durations.key);
+    memFree(durations.seconds);
+    return;
+  }
+  memset(durations.key, 0, sizeof(uint32_t) * DURATION_CACHE_SIZE);
+  xTaskCreatePinnedToCore(durationTask, "duration", DURATION_STACK, NULL, tskIDLE_PRIORITY + 1, &durations.task, DURATION_CORE);
+  durations.lock = xSemaphoreCreateMutex();     // タスクの起動後に作る (lockがあれば依頼できる)
+}
+
+void initQueue()
+{
+  playQueue.lock = xSemaphoreCreateMutex();
+  playQueue.playerDone = xSemaphoreCreateBinary();
+  xTaskCreatePinnedToCore(queueTask, "queue", QUEUE_STACK, NULL, tskIDLE_PRIORITY + 1, &playQueue.task, QUEUE_CORE);
+}
+
+/**
+ * 曲を再生キューの末尾に追加する (情報は先読みタスクが読込む)
+ * @return キューが一杯なら false
+ */
+boolean queuePush(const String &path)
+{
+  xSemaphoreTake(playQueue.lock, portMAX_DELAY);
+  bool added = playQueue.count < QUEUE_MAX;
+  if (added) {
+    struct TrackInfo *entry = &playQueue.entry[(playQueue.head + playQueue.count) % QUEUE_MAX];
+    strncpy(entry->path, path.c_str(), QUEUE_PATH_LEN - 1);
+    entry->path[QUEUE_PATH_LEN - 1] = '\0';
+    entry->ready = false;
+    playQueue.count++;
+  }
+  xSemaphoreGive(playQueue.lock);
+
+  if (added) {
+    xTaskNotifyGive(playQueue.task);
+  }
+  return added;
+}
+
+/**
+ * 再生キューの先頭の曲を取り出す (先読みが間に合っていなければここで読込む)
+ * @return キューが空なら false
+ */
+boolean queuePop(struct TrackInfo *info)
+{
+  xSemaphoreTake(playQueue.lock, portMAX_DELAY);
+  bool found = playQueue.count > 0;
+  if (found) {
+    *info = playQueue.entry[playQueue.head];
+    playQueue.head = (playQueue.head + 1) % QUEUE_MAX;
+    playQueue.count--;
+  }
+  xSemaphoreGive(playQueue.lock);
+
+  if (found && !info->ready) {
+    readTrackInfo(info);
+  }
+  return found;
+}
+
+/**
+ * レコードを整列順の先頭fields個のキーで比較する
+ *   by_artist: アーティスト, アルバム, トラック番号, 曲名
+ *   by_album:  アルバム, アルバムアーティスト, トラック番号, 曲名
+ * (同名のアルバム (ベスト盤など) をアルバムアーティストで分ける)
+ */
+int compareRecord(const struct TrackRecord *a, const struct TrackRecord *b, enum LibraryOrder order, uint8_t fields)
+{
+  int c;
+
+  if (order == by_artist) {
+    c = compareFilename(a->artist, b->artist);
+    if (c != 0 || --fields == 0) {
+      return c;
+    }
+  }
+  c = compareFilename(a->album, b->album);
+  if (c != 0 || --fields == 0) {
+    return c;
+  }
+  if (order == by_album) {
+    c = compareFilename(a->albumArtist, b->albumArtist);
+    if (c != 0 || --fields == 0) {
+      return c;
+    }
+  }
+  if (a->track != b->track) {
+    return a->track - b->track;
+  }
+  if (--fields == 0) {
+    return 0;
+  }
+  return compareFilename(a->title, b->title);
+}
+
+boolean readRecord(File *file, struct TrackRecord *rec)
+{
+  return file->read(reinterpret_cast<uint8_t*>(rec), sizeof(*rec)) == sizeof(*rec);
+}
+
+/** 一覧の1項目にまとめるキーの数 (アルバム一覧はアルバムアーティストまでで1項目) */
+uint8_t entryFields(enum LibraryOrder order, uint8_t keyFields)
+{
+  return (order == by_album) ? keyFields + 2 : keyFields + 1;
+}
+
+/**
+ * 一覧に表示する名前 (by_artistの0番目のキーはアーティスト、それ以外はアルバム)
+ * アルバム一覧ではアルバムアーティストがあれば "アルバム / アルバムアーティスト" とする
+ */
+String recordName(const struct TrackRecord *rec, enum LibraryOrder order, uint8_t field)
+{
+  if (order == by_artist) {
+    return String((field == 0) ? rec->artist : rec->album);
+  }
+  if (rec->albumArtist[0] == 0) {
+    return String(rec->album);
+  }
+  return String(rec->album) + LIBRARY_ALBUM_SEP + rec->albumArtist;
+}
+
+/** ランファイルfirst～first+num-1を併合し、先頭キーの種類数を返す */
+uint16_t mergeRecords(uint16_t first, uint8_t num, File *out, enum LibraryOrder order)
+{
+  File in[MERGE_WAYS];
+  struct TrackRecord head[MERGE_WAYS];
+  bool valid[MERGE_WAYS];
+  struct TrackRecord last;
+  uint32_t distinct = 0;
 
-    printFile(&menu_name, TFT_WHITE, &buf[pos++], SEL_LINE_HEIGHT * i);
+  for (uint8_t i = 0; i < num; i++) {
+    in[i] = SD.open(libraryRunPath(first + i));
+    valid[i] = readRecord(&in[i], &head[i]);
+  }
 
-    if (buf[pos].filename == NULL) {
+  while (true) {
+    int8_t sel = -1;
+    for (uint8_t i = 0; i < num; i++) {
+      if (valid[i] && (sel < 0 || compareRecord(&head[i], &head[sel], order, 4) < 0)) {
+        sel = i;
+      }
+    }
+    if (sel < 0) {
       break;
     }
+
+    if (distinct == 0 || compareRecord(&head[sel], &last, order, entryFields(order, 0)) != 0) {
+      distinct++;
+    }
+    last = head[sel];
+    out->write(reinterpret_cast<const uint8_t*>(&head[sel]), sizeof(head[sel]));
+    valid[sel] = readRecord(&in[sel], &head[sel]);
   }
-  menu_icon.pushSprite(&canvas, 0, 0);
-  menu_name.pushSprite(&canvas, ICON_WIDTH - 1, 0);
 
-  menu_icon.deleteSprite();
-  menu_name.deleteSprite();
+  for (uint8_t i = 0; i < num; i++) {
+    in[i].close();
+    SD.remove(libraryRunPath(first + i));
+  }
+  return min(distinct, (uint32_t)UINT16_MAX);
 }
 
-void invertRect(uint8_t x, uint8_t y, uint8_t width, uint8_t height)
+/** 再生中は先読みバッファ・DMAキューに余裕がある時だけ進める (再生のSD読込を優先する) */
+void libraryThrottle()
 {
-  std::uint16_t buffer[width];
-  for (uint16_t i = y ; i < y + height; i++) {
-    display.readRect(x, i, width, 1, buffer);
-    for (uint16_t j = 0; j < width; j++) {
-      buffer[j] ^= 0xFFFF;
+  vTaskDelay(pdMS_TO_TICKS(LIBRARY_SCAN_INTERVAL));
+  ioYield();
+}
+
+/**
+ * レコードファイル先頭のrecords件を外部マージソートする
+ * LIBRARY_RUN件ずつ整列したランを作り、MERGE_WAYS個ずつ併合を繰り返す
+ * @param distinct 一覧の項目 (アーティスト・アルバム) の数
+ * @return ランの領域を確保できなければ false
+ */
+bool sortRecords(const String &src, const String &dst, enum LibraryOrder order, uint32_t records, uint16_t *distinct)
+{
+  struct TrackRecord *recs = (struct TrackRecord *)memAlloc(sizeof(struct TrackRecord) * LIBRARY_RUN, mem_bulk);
+  if (recs == NULL) {
+    trace(trace_no_memory, 2, sizeof(struct TrackRecord) * LIBRARY_RUN / 1024, micros());   // Library sort run.
+    return false;
+  }
+  uint16_t runs = 0;
+
+  File in = SD.open(src);
+  while (records > 0) {
+    int len = in.read(reinterpret_cast<uint8_t*>(recs), sizeof(struct TrackRecord) * min(records, (uint32_t)LIBRARY_RUN));
+    uint16_t num = max(len, 0) / sizeof(struct TrackRecord);
+    if (num == 0) {
+      break;
     }
-    canvas.pushImage(x, i, width, 1, buffer);
+    records -= num;
+    std::sort(recs, recs + num, [order](const struct TrackRecord &a, const struct TrackRecord &b) {
+      return compareRecord(&a, &b, order, 4) < 0;
+    });
+    File run = SD.open(libraryRunPath(runs++), FILE_WRITE);
+    run.write(reinterpret_cast<const uint8_t*>(recs), num * sizeof(struct TrackRecord));
+    run.close();
+    libraryThrottle();
+  }
+  in.close();
+  memFree(recs);
+
+  uint16_t first = 0;
+  while (runs - first > MERGE_WAYS) {
+    File out = SD.open(libraryRunPath(runs), FILE_WRITE);
+    mergeRecords(first, MERGE_WAYS, &out, order);
+    out.close();
+    first += MERGE_WAYS;
+    runs++;
+    libraryThrottle();
+  }
+
+  File out = SD.open(dst, FILE_WRITE);
+  *distinct = mergeRecords(first, runs - first, &out, order);
+  out.close();
+  return true;
+}
+
+/** 整列済みレコードファイルでkeyの先頭fields個のキー以上となる最初のレコード番号 (二分探索) */
+uint32_t lowerBoundRecord(File *file, const struct TrackRecord *key, enum LibraryOrder order, uint8_t fields)
+{
+  uint32_t lo = 0;
+  uint32_t hi = file->size() / sizeof(struct TrackRecord);
+  struct TrackRecord rec;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    file->seek(mid * sizeof(rec));
+    if (!readRecord(file, &rec)) {
+      break;
+    }
+    if (compareRecord(&rec, key, order, fields) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/** 途中から書き直すファイルを開く (電源断で残った未確定部分は上書きする) */
+File openAt(const String &path, uint32_t pos)
+{
+  File f = SD.open(path, "r+");
+  f.seek(pos);
+  return f;
+}
+
+/** ディレクトリ状態表 (dirs.all) からpathHashの前回の状態を探す */
+boolean lookupDirState(uint32_t pathHash, struct DirState *state)
+{
+  File table = SD.open(libraryPath("dirs.all"));
+  uint32_t capacity = 0;
+
+  if (!table || table.read(reinterpret_cast<uint8_t*>(&capacity), sizeof(capacity)) != sizeof(capacity) || capacity == 0) {
+    table.close();
+    return false;
+  }
+  for (uint32_t i = 0, slot = pathHash & (capacity - 1); i < capacity; i++, slot = (slot + 1) & (capacity - 1)) {
+    table.seek(sizeof(capacity) + slot * sizeof(*state));
+    if (table.read(reinterpret_cast<uint8_t*>(state), sizeof(*state)) != sizeof(*state) || state->hash == 0) {
+      break;
+    }
+    if (state->hash == pathHash) {
+      table.close();
+      return true;
+    }
+  }
+  table.close();
+  return false;
+}
+
+/** 走査順のディレクトリ状態 (dirs.new) からオープンアドレス法のハッシュ表を作る */
+void buildDirTable(uint32_t dirs)
+{
+  uint32_t capacity = 16;
+  struct DirState state;
+  struct DirState slotState;
+  uint8_t zero[64] = {0};
+
+  while (capacity < dirs * 2) {
+    capacity <<= 1;
+  }
+
+  File table = SD.open(libraryPath("dirs.tbl"), "w+");
+  table.write(reinterpret_cast<const uint8_t*>(&capacity), sizeof(capacity));
+  for (uint32_t left = capacity * sizeof(state); left > 0; left -= min(left, (uint32_t)sizeof(zero))) {
+    table.write(zero, min(left, (uint32_t)sizeof(zero)));
+  }
+
+  File list = SD.open(libraryPath("dirs.new"));
+  for (uint32_t n = 0; n < dirs && list.read(reinterpret_cast<uint8_t*>(&state), sizeof(state)) == sizeof(state); n++) {
+    uint32_t slot = state.hash & (capacity - 1);
+    while (true) {
+      table.seek(sizeof(capacity) + slot * sizeof(state));
+      table.read(reinterpret_cast<uint8_t*>(&slotState), sizeof(slotState));
+      if (slotState.hash == 0 || slotState.hash == state.hash) {
+        break;
+      }
+      slot = (slot + 1) & (capacity - 1);
+    }
+    table.seek(sizeof(capacity) + slot * sizeof(state));
+    table.write(reinterpret_cast<const uint8_t*>(&state), sizeof(state));
+  }
+  list.close();
+  table.close();
+}
+
+/**
+ * ディレクトリを一覧し、サブディレクトリをキューに加えて曲ファイルの署名を求める
+ * 署名は曲ファイルの名前・サイズ・更新日時 (FATのディレクトリエントリ) から作る
+ */
+uint32_t signLibraryDir(File *dir, const String &base, struct ScanState *scan)
+{
+  File queue = openAt(libraryPath("queue.tmp"), scan->queueSize);
+  uint32_t sign = 2166136261u;
+
+  while (true) {
+    File entry = dir->openNextFile();
+    if (!entry) {
+      dir->rewindDirectory();
+      break;
+    }
+
+    if (isDirectoryHideSys(entry)) {
+      queue.print(base + "/" + entry.name());
+      queue.print('\n');
+    } else if (!entry.isDirectory() && isSupportedFormat(entry)) {
+      scan->entries++;
+      sign = signEntry(sign, &entry);
+    }
+    entry.close();
+  }
+  scan->queueSize = queue.position();
+  queue.close();
+  return sign ? sign : 1;
+}
+
+/** 変更のないディレクトリのレコードを前回のデータベースから複写する */
+void copyLibraryDir(const struct DirState *prev, struct ScanState *scan)
+{
+  File oldTracks = SD.open(libraryPath("tracks.all"));
+  File oldPaths = SD.open(libraryPath("paths.dat"));
+  File tracks = openAt(libraryPath("tracks.new"), scan->records * sizeof(struct TrackRecord));
+  File paths = openAt(libraryPath("paths.new"), scan->pathsSize);
+  struct TrackRecord rec;
+
+  oldTracks.seek(prev->first * sizeof(rec));
+  for (uint32_t i = 0; i < prev->count && readRecord(&oldTracks, &rec); i++) {
+    oldPaths.seek(rec.pathOffset);
+    String path = oldPaths.readStringUntil('\n');
+    rec.pathOffset = scan->pathsSize;
+    paths.print(path);
+    paths.print('\n');
+    scan->pathsSize += path.length() + 1;
+    tracks.write(reinterpret_cast<const uint8_t*>(&rec), sizeof(rec));
+    scan->records++;
+  }
+  paths.close();
+  tracks.close();
+  oldPaths.close();
+  oldTracks.close();
+}
+
+/** ディレクトリ内の曲のタグを読んでレコードを作る */
+void readLibraryDir(File *dir, const String &base, struct ScanState *scan)
+{
+  File tracks = openAt(libraryPath("tracks.new"), scan->records * sizeof(struct TrackRecord));
+  File paths = openAt(libraryPath("paths.new"), scan->pathsSize);
+
+  while (true) {
+    File entry = dir->openNextFile();
+    if (!entry) {
+      break;
+    }
+    if (!entry.isDirectory() && isSupportedFormat(entry)) {
+      String path = base + "/" + entry.name();
+      struct TrackRecord rec;
+      readTrackRecord(&entry, &rec);
+      rec.pathOffset = scan->pathsSize;
+      paths.print(path);
+      paths.print('\n');
+      scan->pathsSize += path.length() + 1;
+      tracks.write(reinterpret_cast<const uint8_t*>(&rec), sizeof(rec));
+      scan->records++;
+      entry.close();
+      libraryThrottle();
+      continue;
+    }
+    entry.close();
+  }
+  paths.close();
+  tracks.close();
+}
+
+/**
+ * ディレクトリ1つ分を走査する
+ * 署名が前回と同じならレコードを複写し、異なる (新規を含む) 場合のみタグを読む
+ * FATではファイルを追加・削除してもディレクトリ自身の更新日時は変わらないため、署名は一覧から求める
+ */
+void scanLibraryDir(const String &dirPath, struct ScanState *scan)
+{
+  File dir = SD.open(dirPath);
+  String base = (dirPath == "/") ? String() : dirPath;
+  struct DirState prev;
+  struct DirState state;
+
+  state.hash = hashPath(dirPath.c_str());
+  state.hash = state.hash ? state.hash : 1;
+  uint32_t start = micros();
+  state.signature = dir ? signLibraryDir(&dir, base, scan) : 0;
+  scan->signUs += micros() - start;
+  state.first = scan->records;
+
+  if (lookupDirState(state.hash, &prev) && prev.signature == state.signature) {
+    dir.close();
+    copyLibraryDir(&prev, scan);
+  } else {
+    readLibraryDir(&dir, base, scan);
+    dir.close();
+    dropListingCache(dirPath);
+    scan->changed++;
+  }
+  state.count = scan->records - state.first;
+
+  File dirs = openAt(libraryPath("dirs.new"), scan->dirs * sizeof(state));
+  dirs.write(reinterpret_cast<const uint8_t*>(&state), sizeof(state));
+  dirs.close();
+  scan->dirs++;
+}
+
+/** 作成した一覧の削除 (ライブラリ更新時) */
+void clearLibraryCache()
+{
+  File cache = SD.open(LIBRARY_CACHE_DIR);
+  while (cache) {
+    File entry = cache.openNextFile();
+    if (!entry) {
+      break;
+    }
+    String path = String(LIBRARY_CACHE_DIR "/") + entry.name();
+    entry.close();
+    SD.remove(path);
+  }
+  cache.close();
+}
+
+/**
+ * 走査結果を整列してデータベースを作成し、閲覧と排他して差し替える
+ * 整列の領域を確保できなければ今のデータベースを残す (次回の起動時に作り直す)
+ */
+void buildLibrary(const struct ScanState *scan)
+{
+  struct LibraryInfo info = {scan->records, 0, 0, scan->dirs, LIBRARY_VERSION};
+
+  if (!sortRecords(libraryPath("tracks.new"), libraryPath("artist.new"), by_artist, scan->records, &info.artists) ||
+      !sortRecords(libraryPath("tracks.new"), libraryPath("album.new"), by_album, scan->records, &info.albums)) {
+    return;
+  }
+  buildDirTable(scan->dirs);
+
+  xSemaphoreTake(libraryLock, portMAX_DELAY);
+  const char *names[5][2] = {
+    {"artist.new", "artist.dat"}, {"album.new", "album.dat"}, {"paths.new", "paths.dat"},
+    {"tracks.new", "tracks.all"}, {"dirs.tbl", "dirs.all"}
+  };
+  for (uint8_t i = 0; i < 5; i++) {
+    SD.remove(libraryPath(names[i][1]));
+    SD.rename(libraryPath(names[i][0]), libraryPath(names[i][1]));
+  }
+  File f = SD.open(libraryPath("library.inf"), FILE_WRITE);
+  f.write(reinterpret_cast<const uint8_t*>(&info), sizeof(info));
+  f.close();
+
+  if (!SD.exists(LIBRARY_CACHE_DIR)) {
+    SD.mkdir(LIBRARY_CACHE_DIR);
   }
+  clearLibraryCache();
+  libraryInfo = info;
+  xSemaphoreGive(libraryLock);
 }
 
-void invertYRect(uint8_t y, uint8_t height)
+/** 走査用の作業ファイルを空にして最初から始める */
+void beginLibraryScan(struct ScanState *scan)
 {
-  invertRect(0, y, display.width(), height);
-}
+  const char *names[4] = {"queue.tmp", "tracks.new", "paths.new", "dirs.new"};
 
-void invertLine(uint8_t pos)
-{
-  invertYRect(SEL_LINE_HEIGHT * pos, SEL_LINE_HEIGHT);
-  canvas.pushSprite(0, 0);
+  if (!SD.exists(LIBRARY_DIR)) {
+    SD.mkdir(LIBRARY_DIR);
+  }
+  for (uint8_t i = 0; i < 4; i++) {
+    File f = SD.open(libraryPath(names[i]), FILE_WRITE);
+    if (i == 0) {
+      f.print("/\n");
+    }
+    f.close();
+  }
+  memset(scan, 0, sizeof(*scan));
+  scan->queueSize = 2;
 }
 
-enum Button filenameScroll(struct Buffer *buf, uint8_t displaypos, uint8_t filepos)
+/**
+ * ライブラリ走査タスク (毎起動時に低優先度で実行する)
+ * ディレクトリを幅優先で辿り (未処理のディレクトリはSD上のキューに置く)、
+ * 変更のあったディレクトリだけタグを読み直す
+ * 1ディレクトリ毎に進捗をNVSに保存し、電源断後は続きから再開する
+ */
+void libraryTask(void *param)
 {
-  enum Button push;
-  int scrollPixel = 0;
+  (void)param;
+  struct ScanState scan;
+
+  File queue = SD.open(libraryPath("queue.tmp"));
+  bool resume = prefs.getBytes("libscan", &scan, sizeof(scan)) == sizeof(scan) && queue && queue.size() >= scan.queueSize;
+  queue.close();
+  if (!resume) {
+    beginLibraryScan(&scan);
+    prefs.putBytes("libscan", &scan, sizeof(scan));
+  }
 
-  menu_icon.createSprite(ICON_WIDTH, SEL_LINE_HEIGHT);
-  menu_name.createSprite(1000, SEL_LINE_HEIGHT);
+  while (scan.queuePos < scan.queueSize) {
+    queue = SD.open(libraryPath("queue.tmp"));
+    queue.seek(scan.queuePos);
+    String dirPath = queue.readStringUntil('\n');
+    scan.queuePos = queue.position();
+    queue.close();
 
-  printIcon(&menu_icon, TFT_BLACK, &buf[filepos], 0);
-  menu_icon.pushSprite(&canvas, 0, SEL_LINE_HEIGHT * displaypos);
+    scanLibraryDir(dirPath, &scan);
+    prefs.putBytes("libscan", &scan, sizeof(scan));
+    libraryThrottle();
+  }
 
-  int32_t text_size = printFile(&menu_name, TFT_BLACK, &buf[filepos], 0);
+  // 変更確認の費用 (全ディレクトリの一覧) を記録する
+  trace(trace_library_scan, min(scan.changed, (uint32_t)0xFF), scan.signUs / 1000, micros());
+  if (scan.changed > 0 || scan.dirs != libraryInfo.dirs || !SD.exists(libraryPath("artist.dat"))) {
+    buildLibrary(&scan);
+  }
+  SD.remove(libraryPath("queue.tmp"));
+  SD.remove(libraryPath("tracks.new"));
+  SD.remove(libraryPath("paths.new"));
+  SD.remove(libraryPath("dirs.new"));
+  prefs.remove("libscan");
+
+  libraryBuilding = false;
+  vTaskDelete(NULL);
+}
 
-  if (text_size > display.width() - ICON_WIDTH) {
-    menu_name.setScrollRect(0, 0, text_size * 2 + 20, SEL_LINE_HEIGHT, TFT_WHITE);
+/** 作成済みのライブラリ情報を読込み、更新の確認 (走査) を開始する */
+void initLibrary()
+{
+  libraryLock = xSemaphoreCreateMutex();
+
+  File f = SD.open(libraryPath("library.inf"));
+  if (!f || f.read(reinterpret_cast<uint8_t*>(&libraryInfo), sizeof(libraryInfo)) != sizeof(libraryInfo)
+      || libraryInfo.version != LIBRARY_VERSION) {
+    memset(&libraryInfo, 0, sizeof(libraryInfo));
+    SD.remove(libraryPath("dirs.all"));   // 形式の異なる前回のレコードは複写できない
+    prefs.remove("libscan");
   }
-    
-  while (1) {
-    menu_name.pushSprite(&canvas, ICON_WIDTH - 1, SEL_LINE_HEIGHT * displaypos);
-    canvas.pushSprite(0, 0);
-    
-    if (text_size > display.width() - ICON_WIDTH) {
-      delay(100);
+  f.close();
 
-      if (scrollPixel <= 0) {
-        scrollPixel = text_size + 20;
-        menu_name.setCursor(text_size + 20, 0);
-        menu_name.setFont(FONT_SELECT);
-        menu_name.setTextDatum(top_left);
-        menu_name.setTextColor(TFT_BLACK);
-        menu_name.setTextWrap(false);
-        menu_name.print(buf[filepos].filename);
-      }
+  libraryBuilding = true;
+  xTaskCreatePinnedToCore(libraryTask, "library", LIBRARY_STACK, NULL, tskIDLE_PRIORITY + 1, NULL, LIBRARY_CORE);
+}
+
+/** 一覧の1行とその位置をSD上に書き出す */
+void writeListingEntry(struct ListingWriter *w, const char *name, bool isDir)
+{
+  uint32_t offset = w->dat.position();
+  w->idx.write(reinterpret_cast<const uint8_t*>(&offset), sizeof(offset));
+  w->dat.print(isDir ? 'D' : 'F');
+  w->dat.print(name);
+  w->dat.print('\n');
+}
 
-      menu_name.scroll(-2, 0);
-      scrollPixel -= 2;
+/** 一覧を1件加える (N_BUF件を超えたらSD上の一覧に切替える) */
+void addListingEntry(struct ListingWriter *w, const char *name, bool isDir)
+{
+  struct Dir *dir = w->dir;
+
+  if (dir->totalFileCount == N_BUF) {
+    struct ListingHeader header = {0};
+    w->dat = SD.open(listingPath(dir, "dat"), FILE_WRITE);
+    w->idx = SD.open(listingPath(dir, "idx"), FILE_WRITE);
+    w->idx.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+    for (uint8_t i = 0; i < N_BUF; i++) {
+      writeListingEntry(w, w->buf[i].filename.c_str(), w->buf[i].isDir);
     }
+  }
 
-    uint8_t prev_state = pushButton(PREV, &prev_status, &startTime_prev, false, 10, 2000);
-    if (prev_state == momentPress_determined) {
-      menu_icon.fillSprite(TFT_BLACK);
-      printIcon(&menu_icon, TFT_WHITE, &buf[filepos], 0);
-      menu_icon.pushSprite(&canvas, 0, SEL_LINE_HEIGHT * displaypos);
+  if (dir->totalFileCount < N_BUF) {
+    w->buf[dir->totalFileCount].filename = String(name);
+    w->buf[dir->totalFileCount].isDir = isDir;
+  } else {
+    writeListingEntry(w, name, isDir);
+  }
+  addPrefix(isDir, name, dir->totalFileCount, w->total);
+  dir->totalFileCount++;
+  dir->dirCount += isDir ? 1 : 0;
+}
+
+/** SD上に書き出した一覧のヘッダ・頭文字索引を保存し、先頭を読込む */
+void endListing(struct ListingWriter *w)
+{
+  if (!w->dat) {
+    return;
+  }
+  struct ListingHeader header = {w->dir->totalFileCount, w->dir->dirCount, prefixCount, w->dir->signature};
+  w->dat.close();
+  w->idx.seek(0);
+  w->idx.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+  w->idx.close();
+
+  File pfx = SD.open(listingPath(w->dir, "pfx"), FILE_WRITE);
+  pfx.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+  pfx.write(reinterpret_cast<const uint8_t*>(prefixIndex), sizeof(struct PrefixIndex) * prefixCount);
+  pfx.close();
+
+  w->dir->external = true;
+  loadWindow(w->dir, w->buf, 0);
+}
 
-      menu_name.fillSprite(TFT_BLACK);
-      printFile(&menu_name, TFT_WHITE, &buf[filepos], 0);
-      menu_name.pushSprite(&canvas, ICON_WIDTH, SEL_LINE_HEIGHT * displaypos);
+/**
+ * 整列済みレコードファイルから一覧を作る
+ * keyの先頭keyFields個のキーが一致する範囲 (keyがNULLなら全体) で、次のキーの異なる値を列挙する
+ */
+void listLibrary(struct ListingWriter *w, enum LibraryOrder order, const struct TrackRecord *key, uint8_t keyFields, bool isDir)
+{
+  File db = SD.open(libraryPath(order == by_artist ? "artist.dat" : "album.dat"));
+  struct TrackRecord rec;
+  struct TrackRecord last;
+  bool first = true;
 
-      canvas.pushSprite(0, 0);
-      
-      push = prev;
+  if (!db) {
+    return;
+  }
+  if (key != NULL) {
+    db.seek(lowerBoundRecord(&db, key, order, keyFields) * sizeof(rec));
+  }
+  while (readRecord(&db, &rec)) {
+    if (key != NULL && compareRecord(&rec, key, order, keyFields) != 0) {
       break;
     }
+    if (first || compareRecord(&rec, &last, order, entryFields(order, keyFields)) != 0) {
+      addListingEntry(w, recordName(&rec, order, keyFields).c_str(), isDir);
+      last = rec;
+      first = false;
+    }
+  }
+  db.close();
+  endListing(w);
+}
 
-    uint8_t next_state = pushButton(NEXT, &next_status, &startTime_next, false, 10, 2000);
-    if (next_state == momentPress_determined) {
-      menu_icon.fillSprite(TFT_BLACK);
-      printIcon(&menu_icon, TFT_WHITE, &buf[filepos], 0);
-      menu_icon.pushSprite(&canvas, 0, SEL_LINE_HEIGHT * displaypos);
+/** SD上に保存済みのライブラリ一覧を読込む (ライブラリ更新時に削除される) */
+boolean loadLibraryListing(struct Dir *dir, struct Buffer *buf)
+{
+  struct ListingHeader header;
+  File pfx = SD.open(listingPath(dir, "pfx"));
 
-      menu_name.fillSprite(TFT_BLACK);
-      printFile(&menu_name, TFT_WHITE, &buf[filepos], 0);
-      menu_name.pushSprite(&canvas, ICON_WIDTH, SEL_LINE_HEIGHT * displaypos);
+  if (!pfx || pfx.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)) {
+    pfx.close();
+    return false;
+  }
+  pfx.close();
 
-      canvas.pushSprite(0, 0);
+  dir->totalFileCount = header.totalFileCount;
+  dir->dirCount = header.dirCount;
+  dir->signature = header.signature;    // ライブラリ更新時に一覧ごと削除するため署名は照合しない
+  if (!loadExternalListing(dir)) {
+    return false;
+  }
+  dir->external = true;
+  loadWindow(dir, buf, 0);
+  return true;
+}
 
-      push = next;
-      break;
-    }
+/**
+ * ライブラリの仮想ディレクトリの一覧を読込む
+ *   lib:                 Artists / Albums
+ *   lib:/Artists         アーティスト一覧
+ *   lib:/Artists/<名前>  アーティストのアルバム一覧
+ *   lib:/Albums          アルバム一覧
+ */
+void initLibraryBuffer(struct Dir *dir, struct Buffer *buf)
+{
+  String sub = dir->path.substring(strlen(LIBRARY_ROOT));
+  struct ListingWriter w = {dir, buf, N_BUF};
+  struct TrackRecord key = {0};
 
-    uint8_t play_state = pushButton(PLAY, &play_status, &startTime_play, false, 10, 500);
-    if (play_state == momentPress_determined) {
-      push = play;
-      break;
-    }
+  clearBuffer(buf, N_BUF);
+  dir->windowStart = 0;
+  dir->external = false;
+  dir->totalFileCount = 0;
+  dir->dirCount = 0;
+  dir->signature = 0;
+  prefixCount = 0;
 
-    uint8_t back_state = pushButton(BACK, &back_status, &startTime_back, false, 10, 500);
-    if (back_state == momentPress_determined) {
-      push = back;
-      break;
-    }
+  if (sub.isEmpty()) {
+    addListingEntry(&w, "Artists", true);
+    addListingEntry(&w, "Albums", true);
+    return;
+  }
 
-    uint8_t volup_state = pushButton(VOL_UP, &volup_status, &startTime_volup, true, 10, 500);
-    if (volup_state == momentPress_determined || volup_state == continuous_press) {
-      setVol(1);
+  xSemaphoreTake(libraryLock, portMAX_DELAY);
+  if (!loadLibraryListing(dir, buf)) {
+    dir->totalFileCount = 0;
+    dir->dirCount = 0;
+    prefixCount = 0;
+    if (sub == "/Artists") {
+      w.total = libraryInfo.artists;
+      listLibrary(&w, by_artist, NULL, 0, true);
+    } else if (sub == "/Albums") {
+      w.total = libraryInfo.albums;
+      listLibrary(&w, by_album, NULL, 0, false);
+    } else if (sub.startsWith("/Artists/")) {
+      copyText(key.artist, sub.substring(strlen("/Artists/")), sizeof(key.artist));
+      listLibrary(&w, by_artist, &key, 1, false);
     }
+  }
+  xSemaphoreGive(libraryLock);
+}
 
-    uint8_t voldown_state = pushButton(VOL_DOWN, &voldown_status, &startTime_voldown, true, 10, 500);
-    if (voldown_state == momentPress_determined || voldown_state == continuous_press) {
-      setVol(0);
-    }
+/** ライブラリで選択したアルバムの曲をプレイリストに書き出す */
+String writeLibraryPlaylist(const struct Dir *dir, const String &name)
+{
+  String sub = dir->path.substring(strlen(LIBRARY_ROOT));
+  struct TrackRecord key = {0};
+  struct TrackRecord rec;
+  enum LibraryOrder order = by_album;
+  uint8_t fields = 2;                   // アルバムとアーティスト・アルバムアーティスト
+  int sep = name.lastIndexOf(LIBRARY_ALBUM_SEP);
+
+  copyText(key.album, name, sizeof(key.album));
+  if (sub.startsWith("/Artists/")) {
+    copyText(key.artist, sub.substring(strlen("/Artists/")), sizeof(key.artist));
+    order = by_artist;
+  } else if (sep >= 0) {
+    copyText(key.album, name.substring(0, sep), sizeof(key.album));
+    copyText(key.albumArtist, name.substring(sep + strlen(LIBRARY_ALBUM_SEP)), sizeof(key.albumArtist));
   }
 
-  menu_icon.deleteSprite();
-  menu_name.deleteSprite();
+  xSemaphoreTake(libraryLock, portMAX_DELAY);
+  File db = SD.open(libraryPath(order == by_artist ? "artist.dat" : "album.dat"));
+  File paths = SD.open(libraryPath("paths.dat"));
+  File m3u = SD.open(LIBRARY_PLAYLIST, FILE_WRITE);
 
-  return push;
+  uint32_t first = lowerBoundRecord(&db, &key, order, fields);
+  if (order == by_album && sep >= 0 && !(db.seek(first * sizeof(rec)) && readRecord(&db, &rec) && compareRecord(&rec, &key, order, fields) == 0)) {
+    copyText(key.album, name, sizeof(key.album));   // 区切りを含む名前のアルバム (アルバムアーティストなし)
+    key.albumArtist[0] = 0;
+    first = lowerBoundRecord(&db, &key, order, fields);
+  }
+  db.seek(first * sizeof(rec));
+  while (readRecord(&db, &rec) && compareRecord(&rec, &key, order, fields) == 0) {
+    paths.seek(rec.pathOffset);
+    m3u.print(paths.readStringUntil('\n'));
+    m3u.print('\n');
+  }
+  m3u.close();
+  paths.close();
+  db.close();
+  xSemaphoreGive(libraryLock);
+
+  SD.remove(playlistIndexPath(LIBRARY_PLAYLIST));   // 内容が変わるため索引は作り直す
+  return String(LIBRARY_PLAYLIST);
+}
+
+/** パスを開きディレクトリであるかを返す (ライブラリの仮想ディレクトリはSDを開かない) */
+boolean openPath(File *root, const String &path)
+{
+  if (isLibraryPath(path)) {
+    return true;
+  }
+  *root = SD.open(path);
+  return root->isDirectory();
+}
+
+/** 1つ上の階層に戻る (最上位ではフォルダ表示とライブラリ表示を切替える) */
+uint8_t backDir(File *root, struct Dir *dir, uint8_t level)
+{
+  root->close();
+  if (level > ROOT) {
+    clearDir(dir + level);
+    level--;
+  } else {
+    bool library = isLibraryPath(dir->path);
+    clearDir(dir);
+    dir->path = (library || !Features::library) ? String("/") : String(LIBRARY_ROOT);
+  }
+  openPath(root, (dir + level)->path);
+  return level;
 }
 
 uint8_t select(File root, struct Dir *dir, struct Buffer *buf, uint8_t level)
 {
+  bool isDir = true;
+
   while (1) {
     canvas.clear(TFT_BLACK);
 
-    initDirBuffer(root, dir + level, buf);
-    uint8_t selectNum = (dir + level)->numSelectFile;
-    int8_t position;
-
-    if (selectNum >= 0 && selectNum <= 2) {
-      printDirectory(buf, 0);
-      position = selectNum;
-    } else if (selectNum <= (dir + level)->totalFileCount - 1 && selectNum >= (dir + level)->totalFileCount - 3) {
-      printDirectory(buf, (dir + level)->totalFileCount - 5);
-      position = 4 - (((dir + level)->totalFileCount - 1) - selectNum);
+    if (isLibraryPath((dir + level)->path)) {
+      initLibraryBuffer(dir + level, buf);
     } else {
-      printDirectory(buf, selectNum - 2);
-      position = 2;
+      initDirBuffer(root, dir + level, buf);
+      if (level == ROOT) {
+        saveListingCache(dir + level, buf);
+      }
     }
+    uint16_t selectNum = (dir + level)->numSelectFile;
+    int8_t position = printSelection(dir + level, buf, selectNum);
 
     if ((dir + level)->totalFileCount <= 0) {
       canvas.clear(TFT_BLACK);
-      canvas.setFont(&b12_t_japanese2);
-      canvas.setTextDatum(middle_center);
-      canvas.drawString("ファイルがありません", 64, 32); 
-      canvas.pushSprite(0, 0);
+      if (isLibraryPath((dir + level)->path) && libraryBuilding) {
+        drawCachedTextCenter(&canvas, &uiFont12, UI_TEXT("ライブラリ作成中"), 64, 32, TFT_WHITE);
+      } else {
+        drawCachedTextCenter(&canvas, &uiFont12, UI_TEXT("ファイルがありません"), 64, 32, TFT_WHITE);
+      }
+      flushCanvas();
 
       while (1) {
-          if (digitalRead(BACK) == LOW && level > 0) {
-              delay(100);
-              (dir + level)->path.clear();
-              root.close();
-              root = SD.open((dir + (--level))->path);
+          if (readButton(BACK) == LOW) {
+              browseWait(100);
+              level = backDir(&root, dir, level);
               break;
           }
+          if (!powerIdle(GOV_SLEEP_MS)) {
+            delay(10);
+          }
       }
       continue;
     }
 
     while (1) {
-      enum Button push = filenameScroll(buf, position, selectNum);
+      enum Button push = filenameScroll(dir + level, buf, position, selectNum);
 
       if (push == prev) {
         if ((dir + level)->totalFileCount != 1) {
@@ -624,11 +4647,11 @@ uint8_t select(File root, struct Dir *dir, struct Buffer *buf, uint8_t level)
               } else {
                 position = 4;
                 canvas.clear(TFT_BLACK);
-                printDirectory(buf, selectNum - 4);
+                printDirectory(dir + level, buf, selectNum - 4);
               }
             } else {
               canvas.clear(TFT_BLACK);
-              printDirectory(buf, selectNum - 1);
+              printDirectory(dir + level, buf, selectNum - 1);
               selectNum--;
             }
           }
@@ -650,44 +4673,82 @@ uint8_t select(File root, struct Dir *dir, struct Buffer *buf, uint8_t level)
               selectNum = 0;
               position = 0;
               canvas.clear(TFT_BLACK);
-              printDirectory(buf, selectNum);
+              printDirectory(dir + level, buf, selectNum);
             } else {
               canvas.clear(TFT_BLACK);
-              printDirectory(buf, selectNum - 3);
+              printDirectory(dir + level, buf, selectNum - 3);
               selectNum++;
             }
           }
         }
       }
 
+      if (push == prev_jump || push == next_jump) {
+        if (push == next_jump) {
+          selectNum = nextPrefix(selectNum);
+        } else {
+          selectNum = prevPrefix(dir + level, selectNum);
+        }
+        canvas.clear(TFT_BLACK);
+        position = printSelection(dir + level, buf, selectNum);
+      }
+
+      if (Features::queue && push == enqueue) {
+        struct Buffer *entry = entryAt(dir + level, buf, selectNum);
+        String message(UI_TEXT("キューに追加できません"));
+        if (!isLibraryPath((dir + level)->path) && !entry->isDir && isSupportedFormat(entry->filename)) {
+          String songPath;
+          if ((dir + level)->path != "/") {
+            songPath = String((dir + level)->path + "/");
+            songPath.concat(entry->filename);
+          } else {
+            songPath = String("/" + entry->filename);
+          }
+          if (queuePush(songPath)) {
+            message = String(UI_TEXT("キューに追加 (")) + playQueue.count + UI_TEXT(")");
+          } else {
+            message = String(UI_TEXT("キューがいっぱいです"));
+          }
+        }
+        canvas.clear(TFT_BLACK);
+        drawCachedTextCenter(&canvas, &uiFont12, message.c_str(), 64, 32, TFT_WHITE);
+        flushCanvas();
+        browseWait(QUEUE_NOTICE_MS);
+
+        canvas.clear(TFT_BLACK);
+        position = printSelection(dir + level, buf, selectNum);
+      }
+
       if (push == play) {
+        struct Buffer *entry = entryAt(dir + level, buf, selectNum);
         (dir + level)->numSelectFile = selectNum;
         (dir + level + 1)->path.clear();
 
-        if (level > 0) {
+        if (isLibraryPath((dir + level)->path) && !entry->isDir) {
+          (dir + level + 1)->path = writeLibraryPlaylist(dir + level, entry->filename);
+        } else if ((dir + level)->path != "/") {
           (dir + level + 1)->path = String((dir + level)->path + "/");
-          (dir + level + 1)->path.concat((buf + selectNum)->filename);
+          (dir + level + 1)->path.concat(entry->filename);
         } else {
-          (dir + level + 1)->path = String("/" + (buf + selectNum)->filename);
+          (dir + level + 1)->path = String("/" + entry->filename);
         }
 
         root.close();
-        root = SD.open((dir + level + 1)->path);
-        if (root.isDirectory()) {
+        isDir = openPath(&root, (dir + level + 1)->path);
+        if (isDir) {
           level++;
         }
         break;
       }
 
-      if (push == back && level > 0) {
-          clearDir(dir + level);
-          root.close();
-          root = SD.open((dir + (--level))->path);
+      if (push == back) {
+          level = backDir(&root, dir, level);
+          isDir = true;
           break;
       }
     }
 
-    if (!root.isDirectory()) {
+    if (!isDir) {
       root.close();
       break;
     }
@@ -695,153 +4756,508 @@ uint8_t select(File root, struct Dir *dir, struct Buffer *buf, uint8_t level)
   return level;
 }
 
-uint8_t countLatestDir(const struct Dir *dir)
+/** ファイル内の指定範囲をLovyanGFXの画像デコーダに渡す */
+class FileRangeWrapper : public lgfx::DataWrapper {
+  public:
+    FileRangeWrapper(File *file, uint32_t offset, uint32_t length) : file(file), base(offset), end(offset + length)
+    {
+      file->seek(base);
+    }
+
+    int read(uint8_t *buf, uint32_t len) override
+    {
+      uint32_t pos = file->position();
+      if (pos >= end) {
+        return 0;
+      }
+      return file->read(buf, min(len, end - pos));
+    }
+    void skip(int32_t offset) override { file->seek(file->position() + offset); }
+    bool seek(uint32_t offset) override { return file->seek(base + offset); }
+    void close() override {}
+    int32_t tell() override { return file->position() - base; }
+
+  private:
+    File *file;
+    uint32_t base;
+    uint32_t end;
+};
+
+/**
+ * ID3v2タグ内のAPICフレームを探し画像データの位置を求める
+ * @return 画像データのサイズ (見つからなければ0)
+ */
+uint32_t findAPIC(File *file, uint32_t *offset)
 {
-  uint8_t count = 0;
-  while (dir[count].path != NULL) {
-    count++;
+  struct ID3v2Header header = {0};
+
+  file->seek(0);
+  if (file->read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)
+      || memcmp(header.tag, "ID3", 3) != 0 || header.maj_ver < 3 || header.maj_ver > 4
+      || (header.flags & 0x80)) {       // タグ全体の非同期化は画像データを直接読めない
+    return 0;
   }
-  return count - 2;
+
+  uint32_t tag_end = sizeof(header) + readSyncsafe(header.size);
+  uint32_t pos = sizeof(header);
+  uint8_t flagMask = (header.maj_ver == 4) ? 0x0F : 0xC0;   // 圧縮・暗号化 (v2.4は非同期化・データ長も)
+
+  // 拡張ヘッダ スキップ (v2.3はサイズ自身を含まない)
+  if (header.flags & 0x40) {
+    uint8_t size[4];
+    file->read(size, sizeof(size));
+    pos += (header.maj_ver == 3) ? readBigEndian(size) + 4 : readSyncsafe(size);
+  }
+
+  while (pos + 10 < tag_end) {
+    uint8_t frame[10];
+    file->seek(pos);
+    if (file->read(frame, sizeof(frame)) != sizeof(frame) || frame[0] == 0) {
+      return 0;                       // パディング到達
+    }
+    uint32_t size = (header.maj_ver == 3) ? readBigEndian(frame + 4) : readSyncsafe(frame + 4);
+
+    if (memcmp(frame, "APIC", 4) == 0 && (frame[9] & flagMask) == 0) {
+      uint8_t encoding = file->read();
+      uint32_t skipped = 1;
+      int c;
+
+      do {                            // MIMEタイプ
+        c = file->read();
+        skipped++;
+      } while (c > 0);
+      file->read();                   // 画像種別
+      skipped++;
+      if (encoding == 1 || encoding == 2) {
+        int c2;
+        do {                          // 説明 (UTF-16, 終端2バイト)
+          c = file->read();
+          c2 = file->read();
+          skipped += 2;
+        } while ((c > 0 || c2 > 0) && c >= 0 && c2 >= 0);
+      } else {
+        do {
+          c = file->read();
+          skipped++;
+        } while (c > 0);
+      }
+
+      if (c < 0 || skipped >= size) {
+        return 0;
+      }
+      *offset = pos + sizeof(frame) + skipped;
+      return size - skipped;
+    }
+    pos += sizeof(frame) + size;
+  }
+  return 0;
 }
 
-size_t getTagData(File file)
+/** JPEG/PNGの画像サイズを取得する (非対応形式は false) */
+boolean getImageSize(File *file, uint32_t offset, uint32_t length, bool *isPng, uint16_t *width, uint16_t *height)
 {
-  uint16_t bitrate[16] = {
-    0, 32, 40, 48, 56, 64, 80, 96,
-    112, 128, 160, 192, 224, 256, 320, 0
-  };
+  uint8_t buf[24];
 
-  uint16_t sampling_rate[4] = {
-    44100, 48000, 32000, 0
-  };
+  file->seek(offset);
+  if (file->read(buf, sizeof(buf)) != sizeof(buf)) {
+    return false;
+  }
+
+  if (memcmp(buf, "\x89PNG", 4) == 0) {
+    *isPng = true;
+    *width = readBigEndian(buf + 16);
+    *height = readBigEndian(buf + 20);
+    return true;
+  }
+
+  if (buf[0] != 0xFF || buf[1] != 0xD8) {
+    return false;
+  }
+  *isPng = false;
+
+  // SOFマーカーまでセグメントを辿る
+  uint32_t pos = offset + 2;
+  while (pos + 9 < offset + length) {
+    uint8_t seg[9];
+    file->seek(pos);
+    file->read(seg, sizeof(seg));
+    if (seg[0] != 0xFF) {
+      return false;
+    }
+    if (seg[1] >= 0xC0 && seg[1] <= 0xC3) {
+      *height = (seg[5] << 8) | seg[6];
+      *width = (seg[7] << 8) | seg[8];
+      return true;
+    }
+    pos += 2 + ((seg[2] << 8) | seg[3]);
+  }
+  return false;
+}
 
-  uint16_t posBuff;
-  int tagpos = 0;
+/** 画像を縮小描画しFloyd-Steinbergディザで1bppに変換する */
+boolean decodeAlbumArt(File *file, uint32_t offset, uint32_t length, struct AlbumArt *art)
+{
+  bool isPng;
+  uint16_t width, height;
+
+  if (!getImageSize(file, offset, length, &isPng, &width, &height) || width == 0 || height == 0) {
+    return false;
+  }
+
+  LGFX_Sprite sprite;
+  memSprite(&sprite);
+  if (!sprite.createSprite(ART_SIZE, ART_SIZE)) {
+    return false;
+  }
+  sprite.clear(TFT_BLACK);
+
+  float scale = (float)ART_SIZE / max(width, height);
+  int32_t x = (ART_SIZE - (int32_t)(width * scale)) / 2;
+  int32_t y = (ART_SIZE - (int32_t)(height * scale)) / 2;
+  FileRangeWrapper data(file, offset, length);
+  bool ret = isPng ? sprite.drawPng(&data, x, y, ART_SIZE, ART_SIZE, 0, 0, scale, scale)
+                   : sprite.drawJpg(&data, x, y, ART_SIZE, ART_SIZE, 0, 0, scale, scale);
+
+  if (ret) {
+    int16_t luma[ART_SIZE + 2][2];    // 現在行・次行の誤差 (両端に余白)
+    int16_t line[ART_SIZE];
+
+    memset(luma, 0, sizeof(luma));
+    memset(art->bitmap, 0, sizeof(art->bitmap));
+    for (uint8_t j = 0; j < ART_SIZE; j++) {
+      for (uint8_t i = 0; i < ART_SIZE; i++) {
+        bgr888_t rgb = sprite.readPixelRGB(i, j);
+        line[i] = (rgb.R8() * 77 + rgb.G8() * 150 + rgb.B8() * 29) >> 8;
+      }
+      for (uint8_t i = 0; i < ART_SIZE; i++) {
+        int16_t value = line[i] + luma[i + 1][0];
+        int16_t error = (value >= 128) ? value - 255 : value;
+        if (value >= 128) {
+          art->bitmap[j * (ART_SIZE / 8) + i / 8] |= 0x80 >> (i % 8);
+        }
+        luma[i + 2][0] += error * 7 / 16;
+        luma[i][1] += error * 3 / 16;
+        luma[i + 1][1] += error * 5 / 16;
+        luma[i + 2][1] += error / 16;
+      }
+      for (uint8_t i = 0; i < ART_SIZE + 2; i++) {
+        luma[i][0] = luma[i][1];
+        luma[i][1] = 0;
+      }
+    }
+  }
+
+  sprite.deleteSprite();
+  return ret;
+}
 
+/**
+ * サムネイルを読込む
+ * キャッシュ (パスとファイルサイズがキー) がなければID3タグから作成して保存する
+ * 画像がないこともキャッシュし、次回以降はタグを解析しない
+ */
+void loadAlbumArt(const struct ArtRequest *req, struct AlbumArt *art)
+{
+  IoScope scope(io_metadata);
+  File file = SD.open(req->path);
   if (!file) {
-    Serial.println("File could not open.");
-    return 0;
+    return;
   }
 
-  // ID3v2ヘッダ 読込
-  struct ID3v2Header header = {0};
-  uint8_t buff[4];
+  char cachePath[32];
+  sprintf(cachePath, ART_CACHE_DIR "/%08lx.bin", (unsigned long)(req->key ^ (file.size() * 2654435761u)));
 
-  posBuff = file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header));
-  if (posBuff == -1) {
-    Serial.println("ID3v2 Header read failed.");
-    return 0;
+  File cache = SD.open(cachePath);
+  if (cache) {
+    uint8_t valid = cache.read();
+    art->valid = (valid == 1 && cache.read(art->bitmap, sizeof(art->bitmap)) == sizeof(art->bitmap));
+    cache.close();
+    file.close();
+    return;
   }
 
-  if (memcmp(header.tag, "ID3", 3) == 0) {
-    tagpos += posBuff;
+  uint32_t offset = 0;
+  uint32_t length = findAPIC(&file, &offset);
+  art->valid = (length > 0 && decodeAlbumArt(&file, offset, length, art));
+  file.close();
 
-    //Syncsafe Integer->整数へ変換
-    //ID3v2ヘッダ以降のID3v2タグのサイズ
-    uint32_t ID3v2_size = (header.size[0] << 21) + (header.size[1] << 14) + (header.size[2] << 7) + header.size[3];
+  if (!SD.exists(ART_CACHE_DIR)) {
+    SD.mkdir(ART_CACHE_DIR);
+  }
+  cache = SD.open(cachePath, FILE_WRITE);
+  if (cache) {
+    cache.write(art->valid ? 1 : 0);
+    if (art->valid) {
+      cache.write(art->bitmap, sizeof(art->bitmap));
+    }
+    cache.close();
+  }
+}
 
-    // ID3v2 読込スキップ
-    tagpos += ID3v2_size;
-    file.seek(tagpos);
+/** サムネイル作成タスク (音声処理と別のコアで低優先度で実行) */
+void albumArtTask(void *param)
+{
+  (void)param;
+  struct ArtRequest req;
+  struct AlbumArt art;
 
-  } else {
-    file.seek(0);
+  while (1) {
+    xQueueReceive(artRequest, &req, portMAX_DELAY);
+    ioYield();
+    memset(&art, 0, sizeof(art));
+    art.key = req.key;
+    loadAlbumArt(&req, &art);
+    xQueueOverwrite(artResult, &art);
   }
+}
 
-  //MPEGフレームヘッダ 読込
-  struct MPEGFrameHeader null_struct = {0};
-  mFrameHeader = null_struct;
+/** 再生開始した曲のサムネイルを要求する (前の要求が未処理なら置き換える) */
+void requestAlbumArt(const String path)
+{
+  struct ArtRequest req;
 
-  uint8_t buff_mFrameHeader[4];
-  if (file.read(buff_mFrameHeader, sizeof(buff_mFrameHeader)) == -1) {
-    Serial.println("MPEG Frame Header read failed.");
-    return 0;
+  req.key = hashPath(path.c_str());
+  strncpy(req.path, path.c_str(), ART_PATH_LEN - 1);
+  req.path[ART_PATH_LEN - 1] = '\0';
+
+  albumArt.key = req.key;
+  albumArt.valid = false;
+  xQueueOverwrite(artRequest, &req);
+}
+
+/**
+ * 再生中の曲のサムネイルが届いていれば取り込む
+ * @return 表示を更新すべき場合 true
+ */
+boolean receiveAlbumArt()
+{
+  struct AlbumArt art;
+
+  if (xQueueReceive(artResult, &art, 0) != pdTRUE || art.key != albumArt.key) {
+    return false;
   }
-  uint32_t combine_mFrameHeader = (buff_mFrameHeader[0] << 24) + (buff_mFrameHeader[1] << 16) + (buff_mFrameHeader[2] << 8) + buff_mFrameHeader[3];
+  albumArt = art;
+  return art.valid;
+}
 
-  combine_mFrameHeader >>= 6;
-  if (!((combine_mFrameHeader >> 15) && 0x07FF)) {
-    Serial.println("An unexpected error occurred while reading MPEG Frame Header. -1");
-    return 0;
+/** デコード済みサンプルの採取 (音声処理側で呼ばれるため採取要求時以外は何もしない) */
+void visTap(const int16_t sample[2])
+{
+  if (!vis.armed) {
+    return;
   }
-  combine_mFrameHeader &= 0x03FF;
 
-  mFrameHeader.channel = combine_mFrameHeader & 0x03;
-  combine_mFrameHeader >>= 2;
-  mFrameHeader.padding_bit = combine_mFrameHeader & 0x03;
-  combine_mFrameHeader >>= 2;
-  uint8_t samplingrateBit = combine_mFrameHeader & 0x03;
-  combine_mFrameHeader >>= 2;
-  uint8_t bitrateBit = combine_mFrameHeader & 0x0F;
-  combine_mFrameHeader >>= 4;
+  vis.block[vis.writing][0][vis.pos] = sample[0];
+  vis.block[vis.writing][1][vis.pos] = sample[1];
+  if (++vis.pos < VIS_N) {
+    return;
+  }
 
-  if (combine_mFrameHeader != 0) {
-    Serial.println("An unexpected error occurred while reading MPEG Frame Header. -2");
-    return -8;
+  vis.pos = 0;
+  vis.armed = false;
+  if (vis.busy) {
+    vis.dropped++;                    // 解析が間に合っていなければ捨てる
+    return;
   }
+  vis.busy = true;
+  vis.writing ^= 1;
+  xTaskNotifyGive(vis.task);
+}
 
-  mFrameHeader.bitrate = bitrate[bitrateBit];
-  mFrameHeader.sampling_rate = sampling_rate[samplingrateBit];
+/** 固定小数点 (Q15) 基数2 FFT (オーバーフロー防止のため各段で1/2にする) */
+void fftQ15(int16_t *re, int16_t *im)
+{
+  for (uint16_t i = 1, j = 0; i < VIS_N; i++) {
+    uint16_t bit = VIS_N >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      swap(int16_t, re[i], re[j]);
+      swap(int16_t, im[i], im[j]);
+    }
+  }
 
-  if (mFrameHeader.bitrate == 0) {
-    Serial.println("Unsupported bitrate.");
-    return 0;
+  for (uint16_t len = 2; len <= VIS_N; len <<= 1) {
+    uint16_t half = len >> 1;
+    uint16_t step = VIS_N / len;
+    for (uint16_t i = 0; i < VIS_N; i += len) {
+      for (uint16_t k = 0; k < half; k++) {
+        int32_t wr = visCos[k * step];
+        int32_t wi = -visSin[k * step];
+        int32_t br = re[i + k + half];
+        int32_t bi = im[i + k + half];
+        int32_t tr = (br * wr - bi * wi) >> 15;
+        int32_t ti = (br * wi + bi * wr) >> 15;
+        int32_t ar = re[i + k];
+        int32_t ai = im[i + k];
+        re[i + k + half] = (ar - tr) >> 1;
+        im[i + k + half] = (ai - ti) >> 1;
+        re[i + k] = (ar + tr) >> 1;
+        im[i + k] = (ai + ti) >> 1;
+      }
+    }
   }
+}
 
-  if (mFrameHeader.sampling_rate == 0) {
-    Serial.println("Unsupported sampling rate.");
-    return 0;
+/** 振幅を棒の高さ (対数目盛) に変換する */
+uint8_t visLevel(uint32_t value, uint8_t offset)
+{
+  int8_t level = (31 - __builtin_clz(value | 1)) - offset;
+  return constrain(level * ART_SIZE / 12, 0, ART_SIZE);
+}
+
+/** 採取したブロックからスペクトラムを求める */
+void visSpectrum(int16_t (*block)[VIS_N], uint8_t *bars)
+{
+  const uint8_t edge[VIS_BARS + 1] = {1, 2, 3, 5, 8, 13, 21, 34, VIS_N / 2};
+  int16_t re[VIS_N];
+  int16_t im[VIS_N];
+
+  for (uint16_t i = 0; i < VIS_N; i++) {
+    re[i] = (((block[0][i] + block[1][i]) >> 1) * visWindow[i]) >> 15;
+    im[i] = 0;
   }
-  
-  tagpos += MPEGFRAME_HEADER_SIZE;
+  fftQ15(re, im);
 
-  size_t header_size = tagpos;
-  size_t footer_size = 0;
+  for (uint8_t b = 0; b < VIS_BARS; b++) {
+    uint32_t peak = 0;
+    for (uint8_t k = edge[b]; k < edge[b + 1]; k++) {
+      uint32_t mag = abs(re[k]) + abs(im[k]);
+      peak = max(peak, mag);
+    }
+    bars[b] = visLevel(peak, 0);
+  }
+}
 
-  //ID3v1タグ確認
-  file.seek(file.size() - ID3v1_SIZE);
-  uint8_t tag[3];
-  file.read(tag, sizeof(tag));
-  if (memcmp(tag, "TAG", 3) == 0) {
-    footer_size = ID3v1_SIZE;
+/** 採取したブロックからL/RのRMSとピークを求める */
+void visMeter(int16_t (*block)[VIS_N], uint8_t *bars)
+{
+  for (uint8_t ch = 0; ch < 2; ch++) {
+    uint64_t sum = 0;
+    uint32_t peak = 0;
+    for (uint16_t i = 0; i < VIS_N; i++) {
+      int32_t v = block[ch][i];
+      sum += v * v;
+      peak = max(peak, (uint32_t)abs(v));
+    }
+    bars[ch * 2] = visLevel(sqrt(sum / VIS_N), 3);      // RMS
+    bars[ch * 2 + 1] = visLevel(peak, 3);              // ピーク
+  }
+}
+
+/** 解析タスク (音声処理と別のコアで低優先度で実行し、予算超過時は簡易表示に落とす) */
+void visualizerTask(void *param)
+{
+  (void)param;
+  uint8_t bars[VIS_BARS];
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    uint32_t start = micros();
+
+    int16_t (*block)[VIS_N] = vis.block[vis.writing ^ 1];
+    memset(bars, 0, sizeof(bars));
+    if (status.vis == vis_spectrum) {
+      visSpectrum(block, bars);
+    } else {
+      visMeter(block, bars);
+    }
+
+    for (uint8_t i = 0; i < VIS_BARS; i++) {
+      // 下降はゆっくり
+      vis.bars[i] = max(bars[i], (uint8_t)(vis.bars[i] > 2 ? vis.bars[i] - 2 : 0));
+    }
+    vis.updated = true;
+
+    if (micros() - start > VIS_BUDGET_US) {
+      if (++vis.overBudget >= VIS_OVER_LIMIT && status.vis == vis_spectrum) {
+        status.vis = vis_meter;
+      }
+    } else {
+      vis.overBudget = 0;
+    }
+    vis.busy = false;
+  }
+}
+
+void initVisualizer()
+{
+  for (uint16_t i = 0; i < VIS_N / 2; i++) {
+    visCos[i] = 32767 * cos(2 * PI * i / VIS_N);
+    visSin[i] = 32767 * sin(2 * PI * i / VIS_N);
+  }
+  for (uint16_t i = 0; i < VIS_N; i++) {
+    visWindow[i] = 32767 * (0.5 - 0.5 * cos(2 * PI * i / (VIS_N - 1)));
+  }
+  xTaskCreatePinnedToCore(visualizerTask, "visualizer", VIS_STACK, NULL, tskIDLE_PRIORITY + 1, &vis.task, VIS_CORE);
+}
+
+/** ビジュアライザ表示を切替える */
+void cycleVisualizer()
+{
+  switch (status.vis) {
+    case vis_off:
+      status.vis = vis_spectrum;
+      break;
+    case vis_spectrum:
+      status.vis = vis_meter;
+      break;
+    default:
+      status.vis = vis_off;
+      break;
   }
-
-  return header_size + footer_size;
+  memset(vis.bars, 0, sizeof(vis.bars));
+  vis.overBudget = 0;
+  out->tap = (status.vis == vis_off) ? NULL : visTap;
 }
 
-double getmp3TotalTime(const String path)
+/** ビジュアライザの領域だけを描画・転送する */
+void drawVisualizer()
 {
-  File file = SD.open(path);
+  LGFX_Sprite bars(&canvas);
+  bars.createSprite(ART_SIZE, ART_SIZE);
+  bars.clear(TFT_BLACK);
 
-  size_t tag_size = getTagData(file);
-  if (tag_size == 0) {
-    return -1;
+  if (status.vis == vis_spectrum) {
+    for (uint8_t i = 0; i < VIS_BARS; i++) {
+      bars.fillRect(i * (ART_SIZE / VIS_BARS), ART_SIZE - vis.bars[i], ART_SIZE / VIS_BARS - 1, vis.bars[i], TFT_WHITE);
+    }
+  } else {
+    for (uint8_t ch = 0; ch < 2; ch++) {
+      int32_t x = ch * (ART_SIZE / 2);
+      bars.fillRect(x, ART_SIZE - vis.bars[ch * 2], ART_SIZE / 2 - 2, vis.bars[ch * 2], TFT_WHITE);
+      bars.drawFastHLine(x, ART_SIZE - vis.bars[ch * 2 + 1], ART_SIZE / 2 - 2, TFT_WHITE);
+    }
   }
 
-  size_t mpeg_size = file.size() - tag_size;
-
-  //時間算出
-  size_t frame_size = 144 * (mFrameHeader.bitrate * 1000) / mFrameHeader.sampling_rate + mFrameHeader.padding_bit;
-  double frame_count = mpeg_size / frame_size;
-
-  double duration_sec = frame_count * (1152.0 / mFrameHeader.sampling_rate);
-
-  file.close();
-
-  return duration_sec;
+  bars.pushSprite(&canvas, ART_X, ART_Y);
+  bars.deleteSprite();
+  flushRows(ART_Y, ART_SIZE);
 }
 
-String printDuration(double duration)
+/**
+ * 一定間隔でサンプル採取を要求し、結果が出ていれば描画する
+ * DMAキューの残りが少ない時は描画せずにフレームを捨てる
+ */
+void serviceVisualizer()
 {
-  if (duration < 0) {
-    return String("--:--");
+  if (status.vis == vis_off || status.pause) {
+    return;
+  }
+  if (!vis.armed && millis() - vis.lastArm >= 1000 / VIS_FPS) {
+    vis.lastArm = millis();
+    vis.armed = true;
+  }
+  if (vis.updated) {
+    vis.updated = false;
+    if (out->getFill() < out->capacity / 2) {
+      vis.dropped++;
+      return;
+    }
+    drawVisualizer();
   }
-  int min = (int)duration / 60;
-  int sec = (int)duration - min * 60;
-
-  char formatted_time[8];
-  sprintf(formatted_time, "%d:%02d", min, sec);
-  return String(formatted_time);
 }
 
 void screenPlayback(struct Dir *dir)
@@ -856,33 +5272,47 @@ void screenPlayback(struct Dir *dir)
   playback_title.clear(TFT_WHITE);
   playback_title.setTextDatum(top_left);
   playback_title.setTextColor(TFT_BLACK);
-  playback_title.setFont(&b16_t_japanese3);
-  playback_title.setCursor(0, 0);
+  int32_t x = 0;
 
   if (nowPlaying.Title.isEmpty()) {
-    playback_title.print((dir + 1)->path.substring((dir + 1)->path.lastIndexOf('/') + 1));
+    String filename = (dir + 1)->path.substring((dir + 1)->path.lastIndexOf('/') + 1);
+    x = drawCachedText(&playback_title, &tagFont, filename.c_str(), x, 0, TFT_BLACK);
   } else {
-    playback_title.print(nowPlaying.Title);
+    x = drawCachedText(&playback_title, &tagFont, nowPlaying.Title.c_str(), x, 0, TFT_BLACK);
   }
   
   if (!nowPlaying.Performer.isEmpty()) {
-    playback_title.print("/");
-    playback_title.print(nowPlaying.Performer);
+    x = drawCachedText(&playback_title, &tagFont, "/", x, 0, TFT_BLACK);
+    drawCachedText(&playback_title, &tagFont, nowPlaying.Performer.c_str(), x, 0, TFT_BLACK);
   }
 
   playback_title.pushSprite(&canvas, 0, 0);
   playback_title.deleteSprite();
 
   //総時間表示
-  canvas.setFont(&_7x14B_tn);
-  canvas.setTextDatum(bottom_left);
-  canvas.setCursor(36, 48);
-  canvas.print("--:--");              // 現在再生時間の表示予定地
-  canvas.setFont(&_6x10_tn);
-  canvas.setCursor(canvas.getCursorX() + 3, canvas.getCursorY());
-  canvas.print("/");
-  canvas.setCursor(canvas.getCursorX() + 3, canvas.getCursorY());
-  canvas.print(printDuration(nowPlaying.Time));
+  if (albumArt.valid || status.vis != vis_off) {
+    // カバー画像表示時は右側を空けるため左下に寄せる
+    canvas.setFont(&_7x14B_tn);
+    canvas.setTextDatum(bottom_left);
+    int32_t x = 12 + canvas.drawString("--:--", 12, 63) + 3;
+    canvas.setFont(&_6x10_tn);
+    x += canvas.drawString("/", x, 63) + 3;
+    canvas.drawString(printDuration(nowPlaying.Time), x, 63);
+
+    if (status.vis == vis_off) {
+      canvas.drawBitmap(ART_X, ART_Y, albumArt.bitmap, ART_SIZE, ART_SIZE, TFT_WHITE);
+    }
+  } else {
+    canvas.setFont(&_7x14B_tn);
+    canvas.setTextDatum(bottom_left);
+    canvas.setCursor(36, 48);
+    canvas.print("--:--");              // 現在再生時間の表示予定地
+    canvas.setFont(&_6x10_tn);
+    canvas.setCursor(canvas.getCursorX() + 3, canvas.getCursorY());
+    canvas.print("/");
+    canvas.setCursor(canvas.getCursorX() + 3, canvas.getCursorY());
+    canvas.print(printDuration(nowPlaying.Time));
+  }
 
   //モード表示
   canvas2.createSprite(16, 12);
@@ -936,7 +5366,14 @@ void screenPlayback(struct Dir *dir)
   canvas2.setFont(&siji_t_6x10);
   canvas2.print("");
   canvas2.setFont(&_6x12_tr);
-  canvas2.printf("%02d/%02d", (dir->numSelectFile + 1) - dir->dirCount, dir->totalFileCount - dir->dirCount);
+  if (playlist.active) {
+    canvas2.printf("%02lu/%02lu", (unsigned long)playlist.current + 1, (unsigned long)playlist.count);
+  } else {
+    canvas2.printf("%02d/%02d", (dir->numSelectFile + 1) - dir->dirCount, dir->totalFileCount - dir->dirCount);
+  }
+  if (Features::queue && playQueue.count > 0) {
+    canvas2.printf("+%u", playQueue.count);   // 再生キューの曲数
+  }
   canvas2.pushSprite(&canvas, 0, 17);
   canvas2.deleteSprite();
 
@@ -958,176 +5395,773 @@ void screenPlayback(struct Dir *dir)
   canvas2.printf("%3d", mFrameHeader.bitrate);
   canvas2.pushSprite(&canvas, 85, 19);
 
-  canvas.pushSprite(0, 0);
+  flushCanvas();
+}
+
+void clearID3()
+{
+  nowPlaying.Album.clear();
+  nowPlaying.Title.clear();
+  nowPlaying.Performer.clear();
+  nowPlaying.Time = 0;
+}
+
+void makeIndex(struct Dir *dir)
+{
+  uint16_t num = dir->totalFileCount;
+  subscript = (uint16_t *)memAlloc(sizeof(uint16_t) * max(num, (uint16_t)1), mem_bulk);
+  if (subscript == NULL) {              // 確保できなければ索引なしで順番に再生する
+    trace(trace_no_memory, 3, sizeof(uint16_t) * num / 1024, micros());   // Shuffle index.
+    return;
+  }
+
+  for (uint16_t i = 0; i < num; i++) {
+    subscript[i] = i;
+  }
+} 
+
+void shuffleIndex(struct Dir *dir)
+{
+  int16_t num = dir->totalFileCount;
+  if (subscript == NULL) {
+    return;
+  }
+  randomSeed(199);
+
+  for (int16_t i = num - 1; i >= 0; i--) {
+    uint16_t j = random(num);
+    if (i != j && i != dir->numSelectFile && j != dir->numSelectFile) {
+      swap(uint16_t, subscript[i], subscript[j]);
+    }
+  }
+}
+
+void deleteIndex()
+{
+  memFree(subscript);
+  subscript = NULL;
+}
+
+/**
+ * プレイリストを開く
+ * 作成済みの索引があれば再利用し、なければ先頭の曲が見つかるまで索引を作成する
+ * (残りは再生中にplaylistIndexStep()で作成する)
+ */
+boolean openPlaylist(const String path)
+{
+  String indexPath = playlistIndexPath(path);
+  struct PlaylistHeader header = {0};
+
+  playlist.file = SD.open(path);
+  if (!playlist.file) {
+    return false;
+  }
+  playlist.baseDir = path.substring(0, path.lastIndexOf('/'));
+  playlist.count = 0;
+  playlist.current = 0;
+  playlist.scanPos = 0;
+  playlist.lineHead = true;
+  playlist.complete = false;
+
+  if (!SD.exists(LISTING_DIR)) {
+    SD.mkdir(LISTING_DIR);
+  }
+
+  playlist.index = SD.open(indexPath);
+  if (playlist.index
+      && playlist.index.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) == sizeof(header)
+      && header.size == playlist.file.size() && header.count > 0) {
+    playlist.count = header.count;
+    playlist.complete = true;
+  } else {
+    playlist.index.close();
+    playlist.index = SD.open(indexPath, "w+");
+    playlist.index.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+    while (playlist.count == 0 && !playlist.complete) {
+      playlistIndexStep(&playlist);
+    }
+  }
+
+  playlist.active = (playlist.count > 0);
+  if (!playlist.active) {
+    playlist.index.close();
+    playlist.file.close();
+  }
+  return playlist.active;
+}
+
+void closePlaylist()
+{
+  memFree(playlist.order);
+  playlist.order = NULL;
+  playlist.index.close();
+  playlist.file.close();
+  playlist.baseDir.clear();
+  playlist.active = false;
+}
+
+/** プレイリストのnum曲目のパス (相対パスはプレイリストの場所を基準にする) */
+String playlistPath(uint32_t num)
+{
+  uint32_t offset = 0;
+
+  playlist.index.seek(sizeof(struct PlaylistHeader) + num * sizeof(offset));
+  playlist.index.read(reinterpret_cast<uint8_t*>(&offset), sizeof(offset));
+  playlist.file.seek(offset);
+
+  String line = playlist.file.readStringUntil('\n');
+  line.trim();
+  line.replace("\\", "/");
+  if (line.startsWith("/")) {
+    return line;
+  }
+  return String(playlist.baseDir + "/" + line);
+}
+
+/** num曲目まで索引を作成する (索引が完成すれば止める) */
+void playlistIndexUntil(uint32_t num)
+{
+  while (playlist.count <= num && !playlist.complete) {
+    playlistIndexStep(&playlist);
+  }
+}
+
+/**
+ * シャッフル再生の順を作る (shuffleIndex()と同じく再生中の曲は動かさない)
+ * 全曲の順が要るため索引の完成後に呼ぶ (索引の作成は再生ループが少しずつ進める)
+ * @return 領域を確保できなければ false
+ */
+boolean playlistShuffle()
+{
+  memFree(playlist.order);
+  playlist.order = (uint32_t *)memAlloc(sizeof(uint32_t) * playlist.count, mem_bulk);
+  if (playlist.order == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < playlist.count; i++) {
+    playlist.order[i] = i;
+  }
+  swap(uint32_t, playlist.order[0], playlist.order[playlist.current]);
+  for (uint32_t i = playlist.count - 1; i > 1; i--) {
+    uint32_t j = 1 + random(i);
+    swap(uint32_t, playlist.order[i], playlist.order[j]);
+  }
+  playlist.orderPos = 0;
+  return true;
+}
+
+/** プレイリストの次・前・シャッフル順の曲のパス */
+String playlistStep(int8_t step)
+{
+  String songPath;
+  uint32_t tries = 0;
+
+  if (status.mode == shuffle && playlist.order == NULL && playlist.complete && !playlistShuffle()) {
+    trace(trace_no_memory, 1, playlist.count * sizeof(uint32_t) / 1024, micros());   // Playlist shuffle order.
+  }
+  do {
+    if (status.mode == shuffle && playlist.order != NULL) {
+      playlist.orderPos = (step > 0) ? (playlist.orderPos + 1) % playlist.count
+                                     : (playlist.orderPos + playlist.count - 1) % playlist.count;
+      playlist.current = playlist.order[playlist.orderPos];
+    } else if (status.mode == shuffle && !playlist.complete && playlist.count > 1) {
+      // 順を作れるまでは索引済みの曲から再生中以外を選ぶ
+      playlist.current = (playlist.current + 1 + random(playlist.count - 1)) % playlist.count;
+    } else if (step > 0) {
+      playlistIndexUntil(playlist.current + 1);       // 次の行の分だけ索引の作成を待つ
+      playlist.current = (playlist.current + 1 >= playlist.count) ? 0 : playlist.current + 1;
+    } else {
+      // 索引の作成中に先頭から戻ると索引済みの最後の曲になる (全体を待たない)
+      playlist.current = (playlist.current == 0) ? playlist.count - 1 : playlist.current - 1;
+    }
+    songPath = playlistPath(playlist.current);
+  } while (!isSupportedFormat(songPath) && ++tries < playlist.count);
+
+  return songPath;
+}
+
+String getNextPath(struct Dir *dir, struct Buffer *buffer)
+{
+  if (playlist.active) {
+    return playlistStep(1);
+  }
+
+  int32_t select = dir->numSelectFile;
+  String songPath;
+  struct Buffer *entry;
+
+  do {
+    do {
+      if (select >= dir->totalFileCount - 1) {
+        select = 0;
+      } else {
+        select++;
+      }
+      entry = entryAt(dir, buffer, (subscript != NULL) ? subscript[select] : select);
+    } while (entry->isDir);
+    
+    if (dir->path == "/") {
+      songPath = String("/" + entry->filename);
+    } else {
+      songPath = String(dir->path + "/");
+      songPath.concat(entry->filename);
+    }
+    
+    dir->numSelectFile = select;
+  } while (!isSupportedFormat(songPath));
+
+  return songPath;
+}
+
+String getPrevPath(struct Dir *dir, struct Buffer *buffer)
+{
+  if (playlist.active) {
+    return playlistStep(-1);
+  }
+
+  int32_t select = dir->numSelectFile;
+  String songPath;
+  struct Buffer *entry;
+
+  do {
+    do {
+      if (select <= 0) {
+        select = dir->totalFileCount - 1;
+      } else {
+        select--;
+      }
+      entry = entryAt(dir, buffer, (subscript != NULL) ? subscript[select] : select);
+    } while (entry->isDir);
+
+    if (dir->path == "/") {
+      songPath = String("/" + entry->filename);
+    } else {
+      songPath = String(dir->path + "/");
+      songPath.concat(entry->filename);
+    }
+
+    dir->numSelectFile = select;
+  } while (!isSupportedFormat(songPath));
+
+  return songPath;
+}
+
+/** 読込時間をトレースに記録するSDファイルソース */
+class AudioFileSourceSDTrace : public AudioFileSourceSD {
+  public:
+    AudioFileSourceSDTrace() : AudioFileSourceSD() {}
+    AudioFileSourceSDTrace(const char *filename) : AudioFileSourceSD(filename) {}
+
+    uint32_t read(void *data, uint32_t len) override
+    {
+      IoScope scope(io_audio);
+      uint32_t start = micros();
+      uint32_t ret = AudioFileSourceSD::read(data, len);
+      traceSpan(trace_sd_read, 0, start);
+      return ret;
+    }
+};
+
+AudioOutputI2SMonitor *newOutput(uint8_t dmaCount)
+{
+  AudioOutputI2SMonitor *output = new AudioOutputI2SMonitor(I2S_NUM_0, I2S_MODE, dmaCount);
+  output->SetPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
+  output->SetGain(status.volume);
+  output->tap = (Features::visualizer && status.vis != vis_off) ? visTap : NULL;   // 作り直しても表示を続ける
+  return output;
+}
+
+void initBufferTable()
+{
+  bufferTable.cardSize = SD.cardSize();
+  for (uint8_t i = 0; i < BITRATE_CLASS_NUM; i++) {
+    bufferTable.setting[i].readahead = READAHEAD_INIT;
+    bufferTable.setting[i].dmaCount = DMA_BUF_INIT;
+    bufferTable.setting[i].cleanTracks = 0;
+  }
+}
+
+/** 挿入中のカードのバッファ設定を読込む (別のカードなら初期値) */
+void loadBufferTable()
+{
+  if (prefs.getBytes("buffer", &bufferTable, sizeof(bufferTable)) != sizeof(bufferTable)
+      || bufferTable.cardSize != SD.cardSize()) {
+    initBufferTable();
+  }
+}
+
+uint8_t getBitrateClass(uint16_t bitrate)
+{
+  if (bitrate <= 128) {
+    return 0;
+  } else if (bitrate <= 192) {
+    return 1;
+  } else if (bitrate <= 256) {
+    return 2;
+  }
+  return 3;
+}
+
+uint32_t bufferBytes(const struct BufferSetting *setting)
+{
+  return setting->readahead + setting->dmaCount * I2S_DMA_BUF_LEN * 4;
+}
+
+/** 再生中の曲の出力の統計を写す (統計は次の曲の開始時に消える) */
+void playStats(struct PlayStats *stats)
+{
+  stats->bitrateClass = bitrateClass;
+  stats->underrun = out->underrun;
+  stats->minFill = out->minFill;
+  stats->capacity = out->capacity;
+  stats->consumed = out->consumed;
+  stats->rate = out->getRate();
+}
+
+/**
+ * 再生し終えた曲の統計からバッファ設定を調整する
+ * アンダーランがあれば予算内で拡大し、余裕のある再生が続けば縮小する
+ * @param finished 最後まで再生したか (途中で止めた曲は BUFFER_MIN_PLAY_S 未満なら数えない)
+ */
+void adaptBuffer(const struct PlayStats *stats, bool finished)
+{
+  struct BufferSetting *setting = &bufferTable.setting[stats->bitrateClass];
+  struct BufferSetting prev = *setting;
+
+  if (!finished && stats->consumed < (uint32_t)stats->rate * BUFFER_MIN_PLAY_S) {
+    return;                             // 曲頭の充填中だけの統計では縮小・拡大を判断できない
+  }
+
+  if (stats->underrun > 0) {
+    setting->cleanTracks = 0;
+    if (setting->readahead < READAHEAD_MAX) {
+      setting->readahead *= 2;
+    }
+    if (setting->dmaCount + 4 <= DMA_BUF_MAX) {
+      setting->dmaCount += 4;
+    }
+    while (bufferBytes(setting) > AUDIO_BUFFER_BUDGET && setting->readahead > prev.readahead) {
+      setting->readahead /= 2;
+    }
+    while (bufferBytes(setting) > AUDIO_BUFFER_BUDGET && setting->dmaCount > prev.dmaCount) {
+      setting->dmaCount -= 2;
+    }
+  } else if (stats->minFill > stats->capacity / 2) {
+    if (++setting->cleanTracks >= BUFFER_SHRINK_TRACKS) {
+      setting->cleanTracks = 0;
+      setting->readahead = max(setting->readahead / 2, READAHEAD_MIN);
+      setting->dmaCount = max(setting->dmaCount - 2, DMA_BUF_MIN);
+    }
+  }
+
+  if (setting->readahead != prev.readahead || setting->dmaCount != prev.dmaCount) {
+    prefs.putBytes("buffer", &bufferTable, sizeof(bufferTable));
+    trace(trace_buffer, setting->dmaCount, setting->readahead, micros());
+  }
+}
+
+/**
+ * 再生系統の領域を確保する (確保済みなら何もしない)
+ * 以後は解放せず、曲の切替えではヒープを使わない
+ * @return 確保できたか
+ */
+boolean deckReserve(struct Deck *d)
+{
+  if (d->mp3 != NULL) {
+    return true;
+  }
+  d->readaheadBuffer = (uint8_t*)memAlloc(READAHEAD_MAX, mem_bulk);
+  d->mp3Space = (uint8_t*)memAlloc(AudioGeneratorMP3::preAllocSize(), mem_fast);
+  if (d->readaheadBuffer == NULL || d->mp3Space == NULL) {
+    memFree(d->readaheadBuffer);
+    memFree(d->mp3Space);
+    d->readaheadBuffer = NULL;
+    d->mp3Space = NULL;
+    return false;
+  }
+  d->source = new AudioFileSourceSDTrace();
+  d->mp3 = new AudioGeneratorMP3(d->mp3Space, AudioGeneratorMP3::preAllocSize());
+  return true;
+}
+
+/**
+ * 再生系統を開始する (mixedならブロック出力を経由し、そうでなければI2Sに直接出力する)
+ * タグは読込済みのため、ファイルの音声データの開始位置audioStartから読ませる
+ */
+void deckBegin(struct Deck *d, const String &filename, uint32_t audioStart, uint32_t readaheadSize, bool mixed)
+{
+  // 先読みには開き直すAPIがないため、確保済みの領域に曲ごとに配置し直す
+  d->source->open(filename.c_str());
+  d->source->seek(audioStart, SEEK_SET);
+  d->readahead = new (d->readaheadObj) AudioFileSourceBuffer(d->source, d->readaheadBuffer, min(readaheadSize, (uint32_t)READAHEAD_MAX));
+  d->mixed = mixed;
+  d->loaded = true;
+  d->mp3->begin(d->readahead, mixed ? static_cast<AudioOutput*>(&d->pcm) : out);
+}
+
+void deckStop(struct Deck *d)
+{
+  if (!d->loaded) {
+    return;
+  }
+  d->mp3->stop();
+  d->source->close();
+
+  d->readahead->~AudioFileSourceBuffer();
+  d->readahead = NULL;
+  d->loaded = false;
+  d->pcm.begin();
+}
+
+boolean deckRunning(struct Deck *d)
+{
+  return d->loaded && d->mp3->isRunning();
+}
+
+/** フェードを終えて出ていく曲を止め、その曲の統計でバッファ設定を調整する */
+void crossfadeEnd()
+{
+  deckStop(&deck[current ^ 1]);
+  fade.active = false;
+  adaptBuffer(&fade.outgoing, true);
+}
+
+/**
+ * 再生系統のブロック出力を混合してI2Sに送る
+ * フェード中は入ってくる曲のゲインを0→1、出ていく曲を1→0に線形に変える (Q15固定小数点)
+ */
+void mixBlocks(AudioOutput *dst)
+{
+  struct Deck *in = &deck[current];
+  struct Deck *prev = &deck[current ^ 1];
+  uint16_t n = in->pcm.available();
+  bool prevDone = true;
+
+  if (fade.active) {
+    if (fade.pos >= fade.length || (n > 0 && prev->pcm.getRate() != in->pcm.getRate())) {
+      crossfadeEnd();                   // サンプリングレートが異なる曲は重ねられない
+    } else {
+      prevDone = !deckRunning(prev) && prev->pcm.available() == 0;
+      if (!prevDone) {
+        n = min(n, prev->pcm.available());
+      }
+    }
+  }
+  if (n == 0) {
+    return;
+  }
+  if (in->pcm.getRate() != fade.rate) {
+    fade.rate = in->pcm.getRate();
+    dst->SetRate(fade.rate);
+    dst->SetChannels(2);
+  }
+
+  const int16_t *a = in->pcm.data();
+  const int16_t *b = prevDone ? NULL : prev->pcm.data();
+  uint16_t i;
+  for (i = 0; i < n; i++, a += 2) {
+    int16_t sample[2] = {a[0], a[1]};
+    if (fade.active) {
+      int32_t gainIn = min(fade.gain >> 16, (uint32_t)32767);
+      int32_t gainOut = 32767 - gainIn;
+      for (uint8_t ch = 0; ch < 2; ch++) {
+        int32_t v = a[ch] * gainIn + (b != NULL ? b[ch] * gainOut : 0);
+        sample[ch] = constrain(v >> 15, -32768, 32767);
+      }
+    }
+    if (!dst->ConsumeSample(sample)) {
+      break;                            // DMAキューが満杯
+    }
+    if (fade.active) {
+      fade.gain += fade.step;
+      fade.pos++;
+      b += (b != NULL) ? 2 : 0;
+    }
+  }
+  in->pcm.consume(i);
+  if (fade.active && !prevDone) {
+    prev->pcm.consume(i);
+  }
+}
+
+/**
+ * デコード1回分 (ミキサ経由なら両方の再生系統をデコードして混合する)
+ * @return 再生中の曲が続いているか
+ */
+boolean decodeStep()
+{
+  struct Deck *d = &deck[current];
+
+  if (!Features::crossfade || !d->mixed) {
+    return d->mp3->loop();
+  }
+
+  bool running = deckRunning(d) && d->mp3->loop();
+  if (fade.active && deckRunning(&deck[current ^ 1])) {
+    deck[current ^ 1].mp3->loop();
+  }
+  mixBlocks(out);
+  return running || d->pcm.available() > 0;
+}
+
+/**
+ * 読込済みの曲の情報で再生を開始する (曲の切替えでSDから読むのはデコーダへの入力だけになる)
+ * @param start 曲の切替えを始めた時刻 (トレース用)
+ */
+void mp3BeginTrack(const struct TrackInfo *info, uint32_t start)
+{
+  clearID3();
+  nowPlaying.Performer = info->text[id3_artist];
+  nowPlaying.Album = info->text[id3_album];
+  nowPlaying.Title = info->text[id3_title];
+  nowPlaying.Time = info->duration;
+  mFrameHeader = info->frame;
+  if (Features::queue) {
+    strcpy(playQueue.playing, info->path);
+  }
+  ID3flag = true;
+
+  // ビットレート帯に応じたバッファを用意する
+  bitrateClass = getBitrateClass(mFrameHeader.bitrate);
+  struct BufferSetting *setting = &bufferTable.setting[bitrateClass];
+  if (!fade.active && out->dmaCount != setting->dmaCount) {   // フェード中は出力を作り直せない
+    out->stop();
+    delete out;
+    out = newOutput(setting->dmaCount);
+    fade.rate = 0;
+  }
+
+  if (fade.enabled) {
+    if (!out->isRunning()) {
+      out->begin();
+    } else {
+      out->reset();                     // フェード中は出ていく曲の統計を写してある
+    }
+  } else {
+    fade.rate = 0;                      // デコーダがI2Sのレートを設定する
+  }
+  fade.skipped = false;
+
+  // タグは読込済みのため、デコーダには最初のフレームから渡す (大きな画像・歌詞を読まずに済む)
+  deckBegin(&deck[current], info->path, trackStart(info), setting->readahead, fade.enabled);
+  if (Features::albumArt) {
+    requestAlbumArt(info->path);
+  }
+  inputTrackBegin();
+  traceSpan(trace_track, 0, start);
+  trace(trace_heap, min(ESP.getMaxAllocHeap() / 1024, (uint32_t)255), ESP.getFreeHeap() / 1024, micros());
+}
+
+void mp3Begin(const String filename)
+{
+  uint32_t start = micros();
+  struct TrackInfo info;
+
+  strncpy(info.path, filename.c_str(), QUEUE_PATH_LEN - 1);
+  info.path[QUEUE_PATH_LEN - 1] = '\0';
+  readTrackInfo(&info);
+  mp3BeginTrack(&info, start);
 }
 
-void MDCallback(void *cbData, const char *type, bool isUnicode, const char *string)
+/** 次の曲を開始する (再生キューに曲があれば先読み済みの情報で開始する) */
+void beginNext(struct Dir *dir, struct Buffer *buffer)
 {
-  (void)cbData;
+  uint32_t start = micros();
+  struct TrackInfo info;
 
-  if (isUnicode) {
-    string += 2;
-  }
-  
-  while (*string) {
-    char letter = *(string++);
-    if (isUnicode) {
-      string++;
-    }
-    if (strcmp(type, "Album") == 0) {
-      nowPlaying.Album.concat(letter);
-    } else if (strcmp(type, "Title") == 0) {
-      nowPlaying.Title.concat(letter);
-    } else if (strcmp(type, "Performer") == 0) {
-      nowPlaying.Performer.concat(letter);
-    } else if (strcmp(type, "eof") == 0) {
-      ID3flag = true;
-    } else {
-      break;
-    }
+  if (Features::queue && queuePop(&info)) {
+    (dir + 1)->path = String(info.path);
+    mp3BeginTrack(&info, start);
+  } else {
+    (dir + 1)->path = getNextPath(dir, buffer);
+    mp3Begin((dir + 1)->path);
   }
 }
 
-void clearID3()
-{
-  nowPlaying.Album.clear();
-  nowPlaying.Title.clear();
-  nowPlaying.Performer.clear();
-  nowPlaying.Time = 0;
+/**
+ * 再生を止める
+ * @param finished 曲が最後まで再生されたか (スキップ・戻るでは false)
+ */
+void mp3Stop(bool finished) {
+  struct PlayStats stats;
+
+  if (fade.active) {
+    crossfadeEnd();
+  }
+  deckStop(&deck[current]);
+  playStats(&stats);
+  adaptBuffer(&stats, finished);
 }
 
-void makeIndex(struct Dir *dir)
+/** 残りがクロスフェード長になったか (先読み済みの分を含めた未デコードのバイト数で判定) */
+boolean crossfadeDue()
 {
-  uint8_t num = dir->totalFileCount;
-  subscript = new uint8_t[num];
+  struct Deck *d = &deck[current];
 
-  for (uint8_t i = 0; i < num; i++) {
-    subscript[i] = i;
+  if (!fade.enabled || fade.active || fade.skipped || !d->mixed || !deckRunning(d) || mFrameHeader.bitrate == 0) {
+    return false;
   }
-} 
+  uint32_t remain = d->source->getSize() - d->source->getPos() + d->readahead->getFillLevel();
+  return remain <= (uint32_t)mFrameHeader.bitrate * CROSSFADE_MS / 8;
+}
 
-void shuffleIndex(struct Dir *dir)
+/** 次の曲を2つ目の再生系統で開始してフェードに入る (ヒープが足りなければ曲間で切替える) */
+void crossfadeBegin(struct Dir *dir, struct Buffer *buffer)
 {
-  int8_t num = dir->totalFileCount;
-  randomSeed(199);
+  struct Deck *next = &deck[current ^ 1];
+  if ((next->mp3 == NULL && ESP.getMaxAllocHeap() < CROSSFADE_HEAP_MIN) || !deckReserve(next)) {
+    fade.skipped = true;
+    return;
+  }
 
-  for (int8_t i = num - 1; i >= 0; i--) {
-    uint8_t j = random(num);
-    if (i != j && i != dir->numSelectFile && j != dir->numSelectFile) {
-      swap(uint8_t, subscript[i], subscript[j]);
-    }
+  int rate = deck[current].pcm.getRate();
+  playStats(&fade.outgoing);            // 次の曲の開始で統計とビットレート帯が上書きされる
+  current ^= 1;
+  fade.active = true;
+  fade.pos = 0;
+  fade.gain = 0;
+  fade.length = max((uint32_t)rate * CROSSFADE_MS / 1000, (uint32_t)1);
+  fade.step = (32767u << 16) / fade.length;
+  if (status.mode == repeat) {
+    mp3Begin((dir + 1)->path);
+  } else {
+    beginNext(dir, buffer);
   }
 }
 
-void deleteIndex()
+void pause(bool *status)
 {
-  delete subscript;
+  if (*status) {
+    out->begin();
+    *status = false;
+  } else {
+    out->stop();
+    *status = true;
+  }
 }
 
-String getNextPath(struct Dir *dir, struct Buffer *buffer)
+/** 1回分デコードして出力する (SDを他のタスクに譲れるかも更新する) */
+boolean playbackStep()
 {
-  int8_t select = dir->numSelectFile;
-  String songPath;
-
-  do {
-    do {
-      if (select >= dir->totalFileCount - 1) {
-        select = 0;
-      } else {
-        select++;
-      }
-    } while ((buffer + subscript[select])->isDir);
-    
-    if (dir->path == "/") {
-      songPath = String("/" + buffer[subscript[select]].filename);
-    } else {
-      songPath = String(dir->path + "/");
-      songPath.concat(buffer[subscript[select]].filename);
-    }
-    
-    dir->numSelectFile = select;
-  } while (!isSupportedFormat(songPath));
+  uint32_t start = micros();
+  bool running = decodeStep();
+  uint32_t decode_us = micros() - start;
+  trace(trace_decode, 0, decode_us, start);
+  bool underrun = out->update(decode_us);
+  if (underrun) {
+    trace(trace_underrun, 0, decode_us, micros());
+  }
+  if (!status.pause) {
+    governorDecode(decode_us, underrun);
+  }
+  // 先読みバッファ・DMAキューが半分以上ある時だけライブラリ走査にSDを譲る
+  scanAllowed = status.pause || deck[current].readahead == NULL
+    || (deck[current].readahead->getFillLevel() >= bufferTable.setting[bitrateClass].readahead / 2 && out->getFill() >= out->capacity / 2);
+  if (running) {
+    inputAudioStarted();
+  }
 
-  delay(100);
-  return songPath;
+  // DMAキューが半分になるまで再生処理を休む (その間はアイドルタスクがCPUを止める)
+  int32_t spare = out->getFill() - out->capacity / 2;
+  if (running && !status.pause && out->getRate() > 0 && spare > out->capacity / 4) {
+    vTaskDelay(pdMS_TO_TICKS(min((uint32_t)spare * 1000 / out->getRate(), (uint32_t)GOV_YIELD_MAX_MS)));
+  }
+  return running;
 }
 
-String getPrevPath(struct Dir *dir, struct Buffer *buffer)
+/**
+ * 一覧表示中の再生タスク (曲が終われば再生キューの曲を続け、キューが空になるか止められれば終わる)
+ * 一覧の読込・整列・索引作成でループが止まっても音が途切れないよう、ループより高い優先度でデコードする
+ * (DMAキューに余裕があればplaybackStep()の中で休み、その間にループが進む)
+ */
+void playerTask(void *param)
 {
-  int8_t select = dir->numSelectFile;
-  String songPath;
+  (void)param;
 
-  do {
-    do {
-      if (select < 0) {
-        select = dir->totalFileCount - 1;
-      } else {
-        select--;
+  while (playQueue.background) {
+    if (deck[current].loaded) {
+      if (playbackStep()) {
+        continue;
       }
-    } while ((buffer + subscript[select])->isDir);
-
-    if (dir->path == "/") {
-      songPath = String("/" + buffer[subscript[select]].filename);
-    } else {
-      songPath = String(dir->path + "/");
-      songPath.concat(buffer[subscript[select]].filename);
+      mp3Stop(true);
     }
 
-    dir->numSelectFile = select;
-  } while (!isSupportedFormat(songPath));
-
-  delay(100);
-  return songPath;
+    struct TrackInfo info;
+    uint32_t start = micros();
+    if (!queuePop(&info)) {
+      break;
+    }
+    mp3BeginTrack(&info, start);
+  }
+  playQueue.background = false;
+  scanAllowed = true;
+  xSemaphoreGive(playQueue.playerDone);
+  vTaskDelete(NULL);
 }
 
-void mp3Begin(const String filename)
+/** 再生を続けたまま一覧に戻る (以後のデコードは再生タスクが行う) */
+void startPlayer()
 {
-  clearID3();
-  source = new AudioFileSourceSD(filename.c_str());
-  id3 = new AudioFileSourceID3(source);
-  id3->RegisterMetadataCB(MDCallback, (void*)"ID3TAG");
-  mp3 = new AudioGeneratorMP3();
-  mp3->begin(id3, out);
-  nowPlaying.Time = getmp3TotalTime(filename);
-}
-
-void mp3Stop() {
-  mp3->stop();
-  id3->close();
-
-  delete mp3;
-  delete id3;
-  delete source;
+  playQueue.background = true;
+  xTaskCreatePinnedToCore(playerTask, "player", PLAYER_STACK, NULL, tskIDLE_PRIORITY + 2, &playQueue.player, PLAYER_CORE);
 }
 
-void pause(bool *status)
+/**
+ * 再生タスクを止めて終わるまで待つ (曲は開いたまま残す)
+ * @return 再生タスクがあったか
+ */
+boolean stopPlayer()
 {
-  if (*status) {
-    out->begin();
-    *status = false;
-  } else {
-    out->stop();
-    *status = true;
+  if (playQueue.player == NULL) {
+    return false;
   }
+  playQueue.background = false;
+  xSemaphoreTake(playQueue.playerDone, portMAX_DELAY);
+  playQueue.player = NULL;
+  return true;
 }
 
 void mp3Playback(struct Dir *dir, struct Buffer *buffer)
 {
-  status.pause = false;
-  
-  mp3Begin((dir + 1)->path);
+  // 一覧で再生中の曲を選んだ場合は続きから再生画面に戻る
+  bool background = Features::queue && stopPlayer();
+  bool resume = background && deck[current].loaded && (dir + 1)->path == playQueue.playing;
+  uint32_t fontSeen = uiFontUpdates(&tagFont);
+
+  if (!deckReserve(&deck[current])) {   // 起動時に確保できず、今も足りない
+    canvas.clear(TFT_BLACK);
+    drawCachedTextCenter(&canvas, &uiFont10, UI_TEXT("メモリが足りません"), 64, 32, TFT_WHITE);
+    flushCanvas();
+    delay(1000);
+    return;
+  }
+
+  if (resume) {
+    ID3flag = true;
+  } else {
+    if (deck[current].loaded) {
+      mp3Stop(false);
+    }
+    status.pause = false;
+    mp3Begin((dir + 1)->path);
+  }
 
   while (1) {
-    if (mp3->isRunning()) {
-      if (!mp3->loop()) {
-        mp3Stop();
+    if (deck[current].loaded) {
+      bool running = playbackStep();
+      if (!running) {
+        mp3Stop(true);
+      } else if (Features::crossfade && crossfadeDue()) {
+        crossfadeBegin(dir, buffer);
+      } else if (bootProfile.end[boot_first_audio] == 0) {
+        bootMark(boot_first_audio);
+        Serial.printf("[boot] first_audio  at %8lu us\n", (unsigned long)bootProfile.end[boot_first_audio]);
       }
     } else {
       switch (status.mode) {
         case normal:
         case shuffle:
-          (dir + 1)->path = getNextPath(dir, buffer);
-          mp3Begin((dir + 1)->path);
+          beginNext(dir, buffer);
           break;
         case repeat:
           mp3Begin((dir + 1)->path);
@@ -1137,21 +6171,31 @@ void mp3Playback(struct Dir *dir, struct Buffer *buffer)
       }
     }
 
-    if (ID3flag == true) {
+    if (ID3flag == true || (Features::albumArt && receiveAlbumArt()) || uiFontUpdates(&tagFont) != fontSeen) {
+      fontSeen = uiFontUpdates(&tagFont);
       screenPlayback(dir);
       ID3flag = false;
     }
 
+    traceService();
+
+    if (playlist.active && !playlist.complete) {
+      playlistIndexStep(&playlist);
+    }
+
     uint8_t back_state = pushButton(BACK, &back_status, &startTime_back, true, 10, 500);
     if (back_state == momentPress_determined) {
-      mp3Stop();
+      mp3Stop(false);
+      scanAllowed = true;
       break;
     }
     if (back_state == continuous_press) {
       switch (status.mode) {
         case normal:
-          status.mode = shuffle;
+          status.mode = (subscript != NULL || playlist.active) ? shuffle : repeat;  // 索引がなければシャッフルを飛ばす
           shuffleIndex(dir);
+          memFree(playlist.order);      // プレイリストは次の曲で再生中の曲から順を作り直す
+          playlist.order = NULL;
           break;
         case shuffle:
           status.mode = repeat;
@@ -1172,6 +6216,18 @@ void mp3Playback(struct Dir *dir, struct Buffer *buffer)
       pause(&status.pause);
       screenPlayback(dir);
     }
+    if (Features::visualizer && play_state == longPress_determined) {
+      cycleVisualizer();
+      screenPlayback(dir);
+    }
+
+    if (Features::visualizer) {
+      serviceVisualizer();
+    }
+
+    if (status.pause) {
+      powerIdle(GOV_SLEEP_MS);
+    }
 
     uint8_t volup_state = pushButton(VOL_UP, &volup_status, &startTime_volup, true, 10, 500);
     if (volup_state == momentPress_determined || volup_state == continuous_press) {
@@ -1185,26 +6241,444 @@ void mp3Playback(struct Dir *dir, struct Buffer *buffer)
     
     uint8_t next_state = pushButton(NEXT, &next_status, &startTime_next, false, 10, 2000);
     if (next_state == momentPress_determined) {
-      mp3Stop();
-      (dir + 1)->path = getNextPath(dir, buffer);
-      mp3Begin((dir + 1)->path);
+      mp3Stop(false);
+      delay(100);
+      beginNext(dir, buffer);
       status.pause = false;
     }
+    if (Features::crossfade && next_state == longPress_determined) {
+      fade.enabled = !fade.enabled;     // 次の曲から有効
+      prefs.putBool("crossfade", fade.enabled);
+      screenPlayback(dir);
+    }
 
     uint8_t prev_state = pushButton(PREV, &prev_status, &startTime_prev, false, 10, 2000);
     if (prev_state == momentPress_determined) {
-      mp3Stop();
+      mp3Stop(false);
       (dir + 1)->path = getPrevPath(dir, buffer);
+      delay(100);
       mp3Begin((dir + 1)->path);
       status.pause = false;
     }
+    if (Features::queue && prev_state == longPress_determined) {
+      startPlayer();                    // 再生を続けたまま一覧に戻る (キューへの追加用)
+      break;
+    }
+  }
+}
+
+#if BENCHMARK
+/** デコード結果を破棄する出力 (デコード速度計測用) */
+class AudioOutputNull : public AudioOutput {
+  public:
+    uint32_t samples = 0;
+
+    bool begin() override { samples = 0; return true; }
+    bool ConsumeSample(int16_t sample[2]) override { (void)sample; samples++; return true; }
+    bool stop() override { return true; }
+    int getRate() { return hertz; }
+};
+
+/** 曲の音声データの開始位置 (ID3v2タグの直後) */
+uint32_t benchAudioStart(const String &path)
+{
+  String text[ID3_TEXT_NUM];
+  File file = SD.open(path);
+  uint32_t audioStart = readID3Text(&file, text);
+  file.close();
+  return audioStart;
+}
+
+/** ベンチマーク結果を1行のJSONで出力する */
+void benchResult(const char *bench, const char *item, uint32_t iteration, uint32_t elapsed_us)
+{
+  Serial.printf(BENCH_JSON "\"bench\":\"%s\",\"case\":\"%s\",\"iter\":%lu,\"total_us\":%lu,\"us_per_iter\":%.1f}\n",
+                bench, item, (unsigned long)iteration, (unsigned long)elapsed_us,
+                (double)elapsed_us / iteration);
+}
+
+/** タグ解析・再生時間算出 (/bench/mp3 内の全ファイル) */
+void benchTagData()
+{
+  File dir = SD.open(BENCH_DIR "/mp3");
+  if (!dir) {
+    Serial.println("No corpus in " BENCH_DIR "/mp3");
+    return;
+  }
+
+  while (true) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    String path = String(entry.path());
+    String name = String(entry.name());
+    entry.close();
+    if (!isSupportedFormat(name)) {
+      continue;
+    }
+
+    uint32_t start = micros();
+    for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+      File file = SD.open(path);
+      getTagData(file, &mFrameHeader);
+      file.close();
+    }
+    benchResult("getTagData", name.c_str(), BENCH_ITERATION, micros() - start);
+
+    start = micros();
+    for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+      getmp3TotalTime(path);
+    }
+    benchResult("getmp3TotalTime", name.c_str(), BENCH_ITERATION, micros() - start);
+  }
+  dir.close();
+}
+
+/**
+ * ディレクトリ一覧読込 (10～10000エントリ)
+ * カードには書かない。tools/benchdirs.py で作った /bench/dir<件数> がなければその件数は飛ばす
+ */
+void benchDirBuffer(struct Buffer *buf)
+{
+  const uint16_t sizes[] = {10, 100, 1000, 10000};
+  struct Dir dir;
+
+  for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char path[32];
+    sprintf(path, BENCH_DIR "/dir%u", sizes[i]);
+    char item[8];
+    sprintf(item, "%u", sizes[i]);
+    File root = SD.open(path);
+    if (!root) {
+      Serial.printf(BENCH_JSON "\"bench\":\"initDirBuffer\",\"case\":\"%s\",\"error\":\"no %s\"}\n", item, path);
+      continue;
+    }
+
+    uint32_t start = micros();
+    for (uint16_t j = 0; j < BENCH_ITERATION / 4; j++) {
+      initDirBuffer(root, &dir, buf);
+    }
+    benchResult("initDirBuffer", item, BENCH_ITERATION / 4, micros() - start);
+    root.close();
+  }
+}
+
+/** フレームヘッダの表引き (同期ワードに続くバージョン～プライベートビットの13ビットの組合せ8192通りを解釈する) */
+void benchFrameHeader()
+{
+  struct MPEGFrameHeader frame;
+  uint32_t valid = 0;
+
+  uint32_t start = micros();
+  for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+    valid = 0;
+    for (uint32_t bits = 0; bits < (1 << 13); bits++) {
+      valid += decodeFrameHeader(0xFFE00000 | (bits << 8), &frame);
+    }
+  }
+  benchResult("decodeFrameHeader", "all_headers", BENCH_ITERATION * (1 << 13), micros() - start);
+  Serial.printf(BENCH_JSON "\"bench\":\"decodeFrameHeader_valid\",\"headers\":%u,\"valid\":%lu}\n", 1 << 13, (unsigned long)valid);
+}
+
+/** 一覧画面の合成・転送とファイル名スクロール1フレーム */
+void benchRender(struct Buffer *buf)
+{
+  struct Dir dir;
+  dir.totalFileCount = N_BUF;
+
+  uint32_t start = micros();
+  for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+    canvas.clear(TFT_BLACK);
+    printDirectory(&dir, buf, 0);
+  }
+  benchResult("printDirectory", "compose", BENCH_ITERATION, micros() - start);
+
+  start = micros();
+  for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+    flushCanvas();
+  }
+  benchResult("flushCanvas", "enqueue", BENCH_ITERATION, micros() - start);
+
+  buf[0].filename = String("A very long file name that needs the marquee to scroll.mp3");
+  menu_name.createSprite(1000, SEL_LINE_HEIGHT);
+  int32_t text_size = printFile(&menu_name, TFT_BLACK, &buf[0], 0);
+  menu_name.setScrollRect(0, 0, text_size * 2 + 20, SEL_LINE_HEIGHT, TFT_WHITE);
+  int scrollPixel = 0;
+
+  start = micros();
+  for (uint16_t i = 0; i < BENCH_ITERATION; i++) {
+    scrollStep(&buf[0], text_size, &scrollPixel);
+    menu_name.pushSprite(&canvas, ICON_WIDTH - 1, 0);
+    flushCanvas();
+  }
+  benchResult("filenameScroll", "frame", BENCH_ITERATION, micros() - start);
+  menu_name.deleteSprite();
+}
+
+/** MP3デコード速度 (実時間に対する倍率を併せて出力) */
+void benchDecode()
+{
+  File dir = SD.open(BENCH_DIR "/mp3");
+  AudioOutputNull nullOut;
+
+  while (dir) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    String path = String(entry.path());
+    String name = String(entry.name());
+    entry.close();
+    if (!isSupportedFormat(name)) {
+      continue;
+    }
+
+    AudioFileSourceSD *src = new AudioFileSourceSD(path.c_str());
+    AudioGeneratorMP3 *gen = new AudioGeneratorMP3();
+    uint32_t loops = 0;
+    uint32_t start = micros();
+    gen->begin(src, &nullOut);
+    while (gen->isRunning() && gen->loop()) {
+      loops++;
+    }
+    uint32_t elapsed = micros() - start;
+    gen->stop();
+    delete gen;
+    delete src;
+
+    benchResult("decode", name.c_str(), loops, elapsed);
+    if (nullOut.getRate() > 0 && elapsed > 0) {
+      Serial.printf(BENCH_JSON "\"bench\":\"decode_realtime\",\"case\":\"%s\",\"samples\":%lu,\"x_realtime\":%.2f}\n",
+                    name.c_str(), (unsigned long)nullOut.samples,
+                    ((double)nullOut.samples / nullOut.getRate()) / (elapsed / 1000000.0));
+    }
+  }
+  dir.close();
+}
+
+/**
+ * クロスフェード時の負荷 (同じ曲を2つの再生系統で同時にデコードし等量で混合)
+ * コーパス中で最もビットレートの高い曲を使い、ヒープ使用量と実時間に対する倍率を出力する
+ */
+void benchCrossfade()
+{
+  File dir = SD.open(BENCH_DIR "/mp3");
+  struct MPEGFrameHeader frame;
+  uint16_t bitrate = 0;
+  String path;
+
+  while (dir) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    if (isSupportedFormat(entry) && getTagData(entry, &frame) > 0 && frame.bitrate > bitrate) {
+      bitrate = frame.bitrate;
+      path = String(entry.path());
+    }
+    entry.close();
+  }
+  dir.close();
+  if (path.isEmpty()) {
+    return;
+  }
+
+  AudioOutputNull nullOut;
+  uint32_t heap = ESP.getFreeHeap();
+  if (!deckReserve(&deck[1])) {
+    Serial.println(BENCH_JSON "\"bench\":\"crossfade\",\"error\":\"no heap\"}");
+    return;
+  }
+  current = 0;
+  uint32_t audioStart = benchAudioStart(path);
+  deckBegin(&deck[0], path, audioStart, READAHEAD_INIT, true);
+  deckBegin(&deck[1], path, audioStart, READAHEAD_INIT, true);
+  uint32_t used = heap - ESP.getFreeHeap();
+  uint32_t maxAlloc = ESP.getMaxAllocHeap();
+
+  fade.active = true;
+  fade.length = UINT32_MAX;
+  fade.pos = 0;
+  fade.gain = 16384u << 16;
+  fade.step = 0;
+  nullOut.begin();
+
+  uint32_t loops = 0;
+  uint32_t start = micros();
+  while (deckRunning(&deck[0]) && deckRunning(&deck[1])) {
+    deck[0].mp3->loop();
+    deck[1].mp3->loop();
+    mixBlocks(&nullOut);
+    loops++;
+  }
+  uint32_t elapsed = micros() - start;
+
+  deckStop(&deck[0]);
+  deckStop(&deck[1]);
+  fade = Crossfade();
+  fade.enabled = prefs.getBool("crossfade", false);
+
+  benchResult("crossfade", path.c_str(), loops, elapsed);
+  if (nullOut.getRate() > 0 && elapsed > 0) {
+    double realtime = ((double)nullOut.samples / nullOut.getRate()) / (elapsed / 1000000.0);
+    Serial.printf(BENCH_JSON "\"bench\":\"crossfade_budget\",\"kbps\":%u,\"heap_used\":%lu,\"max_alloc_after\":%lu,\"x_realtime\":%.2f,\"cpu_percent\":%.1f}\n",
+                  bitrate, (unsigned long)used, (unsigned long)maxAlloc, realtime, 100.0 / realtime);
+  }
+}
+
+/**
+ * 曲の切替え1回分 (タグ・再生時間の読込・デコーダ開始・最初のデコード) の所要時間とSD I/Oを種別毎に出力する
+ * 埋め込み画像の大きな曲でも所要時間が変わらないことを確かめる
+ */
+void benchTrackIo()
+{
+  File dir = SD.open(BENCH_DIR "/mp3");
+
+  while (dir) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    if (!isSupportedFormat(entry)) {
+      entry.close();
+      continue;
+    }
+    String path = String(entry.path());
+    String name = String(entry.name());
+    entry.close();
+
+    current = 0;
+    ioResetStats();
+    uint32_t start = micros();
+    struct TrackInfo info;
+    strncpy(info.path, path.c_str(), QUEUE_PATH_LEN - 1);
+    info.path[QUEUE_PATH_LEN - 1] = '\0';
+    readTrackInfo(&info);
+    deckBegin(&deck[0], path, trackStart(&info), READAHEAD_INIT, true);
+    deck[0].mp3->loop();
+    uint32_t elapsed = micros() - start;
+    deckStop(&deck[0]);
+    benchResult("track_change", name.c_str(), 1, elapsed);
+    ioReport(name.c_str());
+
+    // 再生キューの曲は情報を先読み済みのため、デコーダの開始だけが曲間にかかる
+    start = micros();
+    deckBegin(&deck[0], path, trackStart(&info), READAHEAD_INIT, true);
+    deck[0].mp3->loop();
+    elapsed = micros() - start;
+    deckStop(&deck[0]);
+    benchResult("track_change_queued", name.c_str(), 1, elapsed);
+  }
+  dir.close();
+}
+
+/**
+ * ヒープ耐久試験 (コーパスの曲をBENCH_SOAK_TRACKS回切替え、空きヒープと最大確保可能サイズを記録する)
+ * 曲ごとの確保・解放が残っていれば最大確保可能サイズが徐々に小さくなる
+ */
+void benchSoak()
+{
+  File dir = SD.open(BENCH_DIR "/mp3");
+  String paths[BENCH_ITERATION];
+  uint16_t count = 0;
+
+  while (dir && count < BENCH_ITERATION) {
+    File entry = dir.openNextFile();
+    if (!entry) {
+      break;
+    }
+    if (isSupportedFormat(entry)) {
+      paths[count++] = String(entry.path());
+    }
+    entry.close();
+  }
+  dir.close();
+  if (count == 0) {
+    return;
+  }
+
+  AudioOutputNull nullOut;
+  nullOut.begin();
+  if (!deckReserve(&deck[0])) {
+    Serial.println(BENCH_JSON "\"bench\":\"soak\",\"error\":\"no heap\"}");
+    return;
+  }
+  current = 0;
+  uint32_t startHeap = ESP.getFreeHeap();
+  uint32_t startMaxAlloc = ESP.getMaxAllocHeap();
+  uint32_t start = micros();
+  uint32_t audioStart[BENCH_ITERATION];
+  for (uint16_t i = 0; i < count; i++) {
+    audioStart[i] = benchAudioStart(paths[i]);
+  }
+
+  for (uint16_t i = 0; i < BENCH_SOAK_TRACKS; i++) {
+    deckBegin(&deck[0], paths[i % count], audioStart[i % count], READAHEAD_INIT, true);
+    for (uint16_t j = 0; j < BENCH_SOAK_LOOPS && deckRunning(&deck[0]); j++) {
+      deck[0].mp3->loop();
+      mixBlocks(&nullOut);
+    }
+    deckStop(&deck[0]);
+
+    if ((i + 1) % 100 == 0) {
+      Serial.printf(BENCH_JSON "\"bench\":\"soak\",\"tracks\":%u,\"free_heap\":%lu,\"max_alloc\":%lu,\"min_free_heap\":%lu}\n",
+                    i + 1, (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMaxAllocHeap(), (unsigned long)ESP.getMinFreeHeap());
+    }
+  }
+  benchResult("soak", "track_change", BENCH_SOAK_TRACKS, micros() - start);
+  Serial.printf(BENCH_JSON "\"bench\":\"soak_drift\",\"free_heap\":%ld,\"max_alloc\":%ld}\n",
+                (long)ESP.getFreeHeap() - (long)startHeap, (long)ESP.getMaxAllocHeap() - (long)startMaxAlloc);
+}
+
+void benchmark()
+{
+  struct Buffer buffer[N_BUF];
+
+  benchTagData();
+  benchFrameHeader();
+  benchDirBuffer(buffer);
+  benchRender(buffer);
+  benchDecode();
+  benchCrossfade();
+  benchTrackIo();
+  benchSoak();
+  Serial.println(BENCH_JSON "\"bench\":\"done\"}");
+}
+#endif
+
+/** SDマウントタスク (I2S・ディスプレイ初期化と並行して実行) */
+void sdMountTask(void *param)
+{
+  (void)param;
+
+  bootBegin(boot_sd_mount);
+  while (!SD.begin(SS, SPI, 4000000, "/sd", SD_MAX_FILES)) {
+    vTaskDelay(pdMS_TO_TICKS(SD_RETRY_INTERVAL));
   }
+  initBlockDevice();
+  bootEnd(boot_sd_mount);
+
+  xSemaphoreGive(sdMounted);
+  vTaskDelete(NULL);
 }
 
 void setup()
 {
   // put your setup code here, to run once:
+  bootBegin(boot_serial);
   Serial.begin(115200);
+  bootEnd(boot_serial);
+
+  memPsram = psramFound();
+  LGFX_Sprite *sprites[] = {&canvas, &canvas2, &menu_icon, &menu_name, &playback_title};
+  for (uint8_t i = 0; i < sizeof(sprites) / sizeof(sprites[0]); i++) {
+    memSprite(sprites[i]);
+  }
+
+  // SDのマウントは時間がかかる (カード未挿入時は完了しない) ため別コアで先に開始する
+  sdMounted = xSemaphoreCreateBinary();
+  xTaskCreatePinnedToCore(sdMountTask, "sdMount", SD_MOUNT_STACK, NULL, 1, NULL, SD_MOUNT_CORE);
 
   pinMode(PREV, INPUT_PULLUP);
   pinMode(PLAY, INPUT_PULLUP);
@@ -1212,34 +6686,66 @@ void setup()
   pinMode(BACK, INPUT_PULLUP);
   pinMode(VOL_UP, INPUT_PULLUP);
   pinMode(VOL_DOWN, INPUT_PULLUP);
+  if (Features::powerSave) {
+    initGovernor();
+  }
 
+  bootBegin(boot_i2s);
   audioLogger = &Serial;
-  out = new AudioOutputI2S(I2S_NUM_0, EXTERNAL_I2S);
-  out->SetPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
-  out->SetGain(status.volume);
+  out = newOutput(DMA_BUF_INIT);
   out->begin();
+  if (!deckReserve(&deck[0])) {         // 再生開始時にもう一度確保を試みる
+    Serial.printf("[boot] decoder: no memory (largest block %lu bytes)\n", (unsigned long)ESP.getMaxAllocHeap());
+  }
+  bootEnd(boot_i2s);
 
+  bootBegin(boot_display);
   display.init();
   canvas.setTextWrap(false);            // 右端到達時のカーソル折り返しを禁止
   canvas.createSprite(display.width(), display.height());
 
   canvas.fillScreen(TFT_BLACK);
   canvas.setTextColor(TFT_WHITE);
-  
-  if (!SD.begin()) {
+  initDisplayTask();
+  bootEnd(boot_display);
+
+  // 前回起動時のルートディレクトリ一覧を先に表示する
+  prefs.begin("player", false);
+  drawCachedListing();
+
+  if (xSemaphoreTake(sdMounted, pdMS_TO_TICKS(SD_MOUNT_WAIT)) != pdTRUE) {
     canvas.clear(TFT_BLACK);
-    canvas.setCursor(0, 0);
-    canvas.setFont(&b10_t_japanese2);
-    canvas.setTextDatum(middle_center);
-    canvas.drawString("カードを挿入してください", 64, 32);
-    canvas.pushSprite(0, 0);
-    
-    while (1) {
-      if (SD.begin()) {
-        break;
-      }
-    }
+    drawCachedTextCenter(&canvas, &uiFont10, UI_TEXT("カードを挿入してください"), 64, 32, TFT_WHITE);
+    flushCanvas();
+
+    xSemaphoreTake(sdMounted, portMAX_DELAY);
+  }
+  loadBufferTable();
+  fade.enabled = Features::crossfade && prefs.getBool("crossfade", false);
+
+  if (Features::visualizer) {
+    initVisualizer();
+  }
+  if (Features::library) {
+    initLibrary();
+  }
+  if (Features::queue) {
+    initQueue();
+  }
+  if (Features::durations) {
+    initDurations();
   }
+  if (Features::albumArt) {
+    artRequest = xQueueCreate(1, sizeof(struct ArtRequest));
+    artResult = xQueueCreate(1, sizeof(struct AlbumArt));
+    xTaskCreatePinnedToCore(albumArtTask, "albumArt", ART_STACK, NULL, tskIDLE_PRIORITY + 1, NULL, ART_CORE);
+  }
+
+  bootReport();
+
+#if BENCHMARK
+  benchmark();
+#endif
 }
 
 void loop()
@@ -1256,11 +6762,16 @@ void loop()
     level = select(file_instance, directory, buffer, level);
     file_instance.close();
 
+    deleteIndex();
     makeIndex(&directory[level]);
     if (directory[level + 1].path.endsWith(".mp3")) {
       mp3Playback(&directory[level], buffer);
+    } else if (isPlaylist(directory[level + 1].path) && openPlaylist(directory[level + 1].path)) {
+      directory[level + 1].path = playlistPath(0);
+      mp3Playback(&directory[level], buffer);
+      closePlaylist();
     }
 
-    file_instance = SD.open(directory[level].path);
+    openPath(&file_instance, directory[level].path);
   }
 }
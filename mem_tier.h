@@ -0,0 +1,96 @@
+/**
+ * 階層を指定した領域の確保 (bulk階層はPSRAMがあればPSRAMに置き、階層毎の使用量を数える)
+ * host/ のテストが内部RAMだけの配置とPSRAMのある配置を模擬する
+ */
+#ifndef MEM_TIER_H
+#define MEM_TIER_H
+
+#include <Arduino.h>
+
+/**
+ * 確保する領域の階層
+ * DMAバッファはI2Sドライバが内部RAMに確保するためここでは扱わない
+ */
+enum MemTier : uint8_t {
+  mem_fast,                     //!< デコーダの作業領域など遅延に敏感なもの (常に内部RAM)
+  mem_bulk,                     //!< 先読みバッファ・描画キャッシュ・索引 (PSRAMがあればPSRAM)
+  MEM_TIER_NUM
+};
+
+/** 階層毎の使用量 */
+struct MemStats {
+  uint32_t bytes = 0;           //!< 使用中[byte]
+  uint32_t peak = 0;            //!< 使用量の最大[byte]
+  uint32_t psramBytes = 0;      //!< 使用中のうちPSRAMにあるもの[byte]
+  uint32_t allocs = 0;          //!< 確保回数
+  uint32_t spilled = 0;         //!< PSRAMに確保できず内部RAMに置いた回数
+  uint32_t failures = 0;        //!< 確保できなかった回数
+};
+
+/** memAlloc()で確保した領域の前に置く情報 (8バイトで後ろの領域の整列を保つ) */
+struct MemHeader {
+  uint32_t size;
+  uint8_t tier;                 //!< MemTier
+  uint8_t psram;                //!< PSRAMに置いたか
+  uint8_t reserved[2];
+};
+
+extern struct MemStats memStats[MEM_TIER_NUM];
+extern bool memPsram;
+extern portMUX_TYPE memMux;
+
+/**
+ * 階層を指定して確保する (bulk階層はPSRAMが一杯なら内部RAMに置く)
+ * @return 確保できなければNULL
+ */
+inline void *memAlloc(size_t size, enum MemTier tier)
+{
+  bool wantPsram = (tier == mem_bulk && memPsram);
+  struct MemHeader *h = NULL;
+  if (wantPsram) {
+    h = (struct MemHeader *)heap_caps_malloc(sizeof(*h) + size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  bool psram = (h != NULL);
+  if (h == NULL) {
+    h = (struct MemHeader *)heap_caps_malloc(sizeof(*h) + size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+
+  struct MemStats *st = &memStats[tier];
+  portENTER_CRITICAL(&memMux);
+  if (h == NULL) {
+    st->failures++;
+  } else {
+    bool spilled = wantPsram && !psram;
+    st->bytes += size;
+    st->peak = max(st->peak, st->bytes);
+    st->psramBytes += psram ? size : 0;
+    st->allocs++;
+    st->spilled += spilled ? 1 : 0;
+  }
+  portEXIT_CRITICAL(&memMux);
+
+  if (h == NULL) {
+    return NULL;
+  }
+  h->size = size;
+  h->tier = tier;
+  h->psram = psram;
+  return h + 1;
+}
+
+/** memAlloc()で確保した領域を解放する */
+inline void memFree(void *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+  struct MemHeader *h = (struct MemHeader *)ptr - 1;
+  struct MemStats *st = &memStats[h->tier];
+  portENTER_CRITICAL(&memMux);
+  st->bytes -= h->size;
+  st->psramBytes -= h->psram ? h->size : 0;
+  portEXIT_CRITICAL(&memMux);
+  heap_caps_free(h);
+}
+
+#endif
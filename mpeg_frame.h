@@ -0,0 +1,95 @@
+/**
+ * MPEGオーディオのフレームヘッダの表引き (ISO/IEC 11172-3, 13818-3)
+ * host/ のテストと tools/framecheck.py が規格の式と突き合わせる
+ */
+#ifndef MPEG_FRAME_H
+#define MPEG_FRAME_H
+
+#include <Arduino.h>
+
+/** MPEGフレームヘッダ */
+struct MPEGFrameHeader {
+  uint16_t bitrate;             //!< ビットレート
+  uint16_t sampling_rate;       //!< サンプリングレート
+  uint8_t padding_bit;          //!< パディングビット
+  uint8_t channel;              //!< チャンネル
+  uint8_t version;              //!< バージョン番号 (0: MPEG-2.5, 2: MPEG-2, 3: MPEG-1)
+  uint8_t layer;                //!< レイヤ (1〜3)
+  uint8_t crc;                  //!< ヘッダの後にCRCがあるか
+  uint16_t samples;             //!< 1フレームのサンプル数
+  uint16_t frame_size;          //!< フレーム長[byte] (パディング込み)
+  uint32_t offset;              //!< 最初のフレームの位置[byte]
+  uint32_t frames;              //!< Xing/Infoヘッダのフレーム数 (0: 不明)
+};
+
+/** ビットレート[kbps] [MPEG-1, MPEG-2・2.5][レイヤI〜III][ビットレート番号] (0: フリーフォーマット・不正値) */
+constexpr uint16_t MPEG_BITRATE[2][3][16] = {
+  {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}
+  },
+  {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}
+  }
+};
+
+/** サンプリングレート[Hz] [バージョン番号][サンプリングレート番号] (0: 予約) */
+constexpr uint16_t MPEG_SAMPLING_RATE[4][4] = {
+  {11025, 12000, 8000, 0},      // MPEG-2.5
+  {0, 0, 0, 0},                 // 予約
+  {22050, 24000, 16000, 0},     // MPEG-2
+  {44100, 48000, 32000, 0}      // MPEG-1
+};
+
+/** 1フレームのサンプル数 [MPEG-1, MPEG-2・2.5][レイヤI〜III] */
+constexpr uint16_t MPEG_SAMPLES[2][3] = {
+  {384, 1152, 1152},
+  {384, 1152, 576}
+};
+
+/** Layer IIIのサイド情報のバイト数 [MPEG-1, MPEG-2・2.5][ステレオ, モノラル] (Xingヘッダの位置) */
+constexpr uint8_t MPEG_SIDE_INFO[2][2] = {
+  {32, 17},
+  {17, 9}
+};
+
+/**
+ * 4バイトのフレームヘッダを表引きで解釈する
+ * @return 同期ワードがあり予約値・フリーフォーマットでなければ true
+ */
+inline boolean decodeFrameHeader(uint32_t header, struct MPEGFrameHeader *frame)
+{
+  if ((header >> 21) != 0x7FF) {
+    return false;                       // 同期ワード (11ビット)
+  }
+  uint8_t version = (header >> 19) & 0x03;
+  uint8_t layerBits = (header >> 17) & 0x03;
+  uint8_t bitrateBit = (header >> 12) & 0x0F;
+  uint8_t samplingrateBit = (header >> 10) & 0x03;
+  if (version == 1 || layerBits == 0 || bitrateBit == 0 || bitrateBit == 15 || samplingrateBit == 3) {
+    return false;
+  }
+
+  uint8_t lsf = (version != 3);         // MPEG-2・2.5 (低サンプリング周波数)
+  frame->version = version;
+  frame->layer = 4 - layerBits;
+  frame->crc = ((header >> 16) & 0x01) == 0;
+  frame->bitrate = MPEG_BITRATE[lsf][frame->layer - 1][bitrateBit];
+  frame->sampling_rate = MPEG_SAMPLING_RATE[version][samplingrateBit];
+  frame->padding_bit = (header >> 9) & 0x01;
+  frame->channel = (header >> 6) & 0x03;
+  frame->samples = MPEG_SAMPLES[lsf][frame->layer - 1];
+
+  uint32_t bps = frame->bitrate * 1000;
+  if (frame->layer == 1) {
+    frame->frame_size = (12 * bps / frame->sampling_rate + frame->padding_bit) * 4;
+  } else {
+    frame->frame_size = frame->samples / 8 * bps / frame->sampling_rate + frame->padding_bit;
+  }
+  return true;
+}
+
+#endif
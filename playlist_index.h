@@ -0,0 +1,73 @@
+/** M3U/M3U8プレイリストの行位置索引の作成 (Fileだけを使う) */
+#ifndef PLAYLIST_INDEX_H
+#define PLAYLIST_INDEX_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define PLAYLIST_CHUNK 512              // 1ループ当たりに索引を作成するプレイリストのバイト数
+
+/** M3U/M3U8プレイリスト (曲毎の行位置をSD上の索引に持ち、パスはRAMに持たない) */
+struct Playlist {
+  bool active = false;          //!< プレイリスト再生中であるか
+  String baseDir;               //!< 相対パスの基準ディレクトリ
+  File file;                    //!< プレイリスト
+  File index;                   //!< 行位置索引 (ヘッダ + uint32_t * count)
+  uint32_t count = 0;           //!< 索引済みの曲数
+  uint32_t current = 0;         //!< 再生中の曲番号
+  uint32_t scanPos = 0;         //!< 索引作成済みのプレイリスト上の位置
+  bool complete = false;        //!< 索引作成完了
+  bool lineHead = true;         //!< scanPosが行頭であるか
+  uint32_t *order = NULL;       //!< シャッフル再生の順 (曲番号の並べ替え, 索引の完成後に作成)
+  uint32_t orderPos = 0;        //!< シャッフル順の再生中の位置
+};
+
+/** プレイリスト索引ファイルのヘッダ */
+struct PlaylistHeader {
+  uint32_t size;                //!< プレイリストのサイズ (変更検出用)
+  uint32_t count;               //!< 曲数 (作成途中は0)
+};
+
+/**
+ * プレイリストの索引を最大PLAYLIST_CHUNKバイト分作成する
+ * 空行と#で始まる行 (拡張情報) を除いた各行の先頭位置を索引に追記する
+ */
+inline void playlistIndexStep(struct Playlist *list)
+{
+  uint8_t chunk[PLAYLIST_CHUNK];
+  uint32_t offsets[PLAYLIST_CHUNK / 2];
+  uint16_t found = 0;
+
+  list->file.seek(list->scanPos);
+  int len = list->file.read(chunk, sizeof(chunk));
+
+  for (int i = 0; i < len; i++) {
+    if (list->lineHead) {
+      if (list->scanPos + i == 0 && len >= 3 && memcmp(chunk, "\xEF\xBB\xBF", 3) == 0) {
+        i += 2;                       // BOM
+        continue;
+      }
+      if (chunk[i] != '#' && chunk[i] != '\r' && chunk[i] != '\n') {
+        offsets[found++] = list->scanPos + i;
+      }
+    }
+    list->lineHead = (chunk[i] == '\n');
+  }
+
+  if (found > 0) {
+    list->index.seek(sizeof(struct PlaylistHeader) + list->count * sizeof(uint32_t));
+    list->index.write(reinterpret_cast<const uint8_t*>(offsets), found * sizeof(uint32_t));
+    list->count += found;
+  }
+  list->scanPos += max(len, 0);
+
+  if (len < (int)sizeof(chunk)) {
+    struct PlaylistHeader header = {(uint32_t)list->file.size(), list->count};
+    list->index.seek(0);
+    list->index.write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+    list->index.flush();
+    list->complete = true;
+  }
+}
+
+#endif
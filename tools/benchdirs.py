@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+"""Create the synthetic directories for the on-device initDirBuffer benchmark.
+
+The player never writes benchmark files itself. Run this once against the
+mounted card (or a directory copied onto it) before a BENCHMARK build:
+
+    python3 benchdirs.py /media/sdcard
+
+It creates /bench/dir10, /bench/dir100, /bench/dir1000 and /bench/dir10000
+holding that many empty trackNNNNN.mp3 files (11,110 files in total).
+Existing directories are left alone. Remove them with --remove.
+"""
+
+import os
+import shutil
+import sys
+
+SIZES = (10, 100, 1000, 10000)
+
+
+def main():
+    args = [a for a in sys.argv[1:] if a != "--remove"]
+    if len(args) != 1:
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
+    bench = os.path.join(args[0], "bench")
+    for size in SIZES:
+        path = os.path.join(bench, "dir%d" % size)
+        if "--remove" in sys.argv:
+            shutil.rmtree(path, ignore_errors=True)
+            continue
+        if os.path.isdir(path):
+            print("%s: exists" % path)
+            continue
+        os.makedirs(path)
+        for i in range(size):
+            open(os.path.join(path, "track%05d.mp3" % i), "wb").close()
+        print("%s: %d files" % (path, size))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+"""Build the player's fonts from u8g2 font sources.
+
+The player draws fixed UI strings from small subset fonts compiled into the
+firmware and tag text (titles, artists) from a font file on the SD card
+that it pages in glyph by glyph. Both use the same packed format: a glyph
+index sorted by code point (binary-searched) followed by 1bpp bitmaps.
+
+Fixed strings are the literals wrapped in UI_TEXT("...") in main.cpp.
+Every printable ASCII character is always included.
+
+    python3 fontsubset.py --source u8g2_fonts.c --sketch ../main.cpp \\
+        --ui b12_t_japanese2 --ui b10_t_japanese2 --header ../ui_font.h \\
+        --sd b16_t_japanese3 --sd-out tag16.fnt
+
+--source may be given several times. It is any C file that defines the
+u8g2 font arrays, e.g. csrc/u8g2_fonts.c of the U8g2 library.
+Copy the --sd-out file to /.font/tag16.fnt on the card. The firmware builds
+against the full fonts when ui_font.h does not exist.
+
+PlatformIO builds regenerate ui_font.h automatically through the pre-build
+hook tools/fontsubset_prebuild.py (extra_scripts = pre:tools/fontsubset_prebuild.py).
+
+--preview TEXT prints the glyphs of the first --ui font as text art.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+MAGIC = b"PFN1"
+PAGE_SHIFT = 6                          # glyphs per index page = 1 << PAGE_SHIFT (FONT_PAGE_GLYPHS)
+GLYPH_MAX = 16                          # largest glyph cell the firmware caches
+INDEX = struct.Struct("<HBBBbbBI")      # PackedGlyph: code, advance, width, height, x, y, reserved, offset
+HEADER = struct.Struct("<4sHBB")        # PackedFontHeader: magic, count, height, pageShift
+
+
+# ---------------------------------------------------------------- u8g2 source
+
+def c_string(literals):
+    """Concatenate and unescape adjacent C string literals."""
+    out = bytearray()
+    for body in re.findall(r'"((?:[^"\\]|\\.)*)"', literals, re.S):
+        i = 0
+        while i < len(body):
+            c = body[i]
+            if c != "\\":
+                out += c.encode("latin-1")
+                i += 1
+                continue
+            n = body[i + 1]
+            if n in "01234567":
+                m = re.match(r"[0-7]{1,3}", body[i + 1:])
+                out.append(int(m.group(0), 8) & 0xFF)
+                i += 1 + len(m.group(0))
+            elif n == "x":
+                m = re.match(r"[0-9a-fA-F]+", body[i + 2:])
+                out.append(int(m.group(0), 16) & 0xFF)
+                i += 2 + len(m.group(0))
+            else:
+                out += {"n": b"\n", "t": b"\t", "r": b"\r", "0": b"\0"}.get(n, n.encode("latin-1"))
+                i += 2
+    return bytes(out)
+
+
+def load_font(sources, name):
+    pattern = re.compile(r"(?:u8g2_font_)?%s\s*\[\s*\d*\s*\][^=]*=\s*((?:\"(?:[^\"\\]|\\.)*\"\s*)+);"
+                         % re.escape(name), re.S)
+    for path in sources:
+        with open(path, "r", encoding="latin-1") as f:
+            m = pattern.search(f.read())
+        if m:
+            return c_string(m.group(1))
+    sys.exit("font %s not found in %s" % (name, ", ".join(sources)))
+
+
+class Bits:
+    """u8g2 glyph bit stream (LSB first)."""
+
+    def __init__(self, data, pos):
+        self.data, self.pos, self.bit = data, pos, 0
+
+    def unsigned(self, cnt):
+        val = self.data[self.pos] >> self.bit
+        end = self.bit + cnt
+        if end >= 8:
+            self.pos += 1
+            if end > 8:
+                val |= self.data[self.pos] << (8 - self.bit)
+            end -= 8
+        self.bit = end
+        return val & ((1 << cnt) - 1)
+
+    def signed(self, cnt):
+        return self.unsigned(cnt) - (1 << (cnt - 1))
+
+
+def decode_glyph(font, pos):
+    """Decode one glyph body; returns (width, height, x, y, dx, rows of 0/1)."""
+    m0, m1, bw, bh, bx, by, bdx = font[2:9]
+    b = Bits(font, pos)
+    w, h = b.unsigned(bw), b.unsigned(bh)
+    x, y, dx = b.signed(bx), b.signed(by), b.signed(bdx)
+    pixels = []
+    if w and h:
+        while len(pixels) < w * h:
+            zeros, ones = b.unsigned(m0), b.unsigned(m1)
+            while True:
+                pixels += [0] * zeros + [1] * ones
+                if b.unsigned(1) == 0:
+                    break
+    pixels = pixels[:w * h]
+    return w, h, x, y, dx, [pixels[r * w:(r + 1) * w] for r in range(h)]
+
+
+def glyph_table(font):
+    """Map code point -> offset of the glyph body in a u8g2 font."""
+    table = {}
+    pos = 23
+    while font[pos + 1] != 0:           # 8-bit part: encoding, size
+        table[font[pos]] = pos + 2
+        pos += font[pos + 1]
+    pos = 23 + struct.unpack_from(">H", font, 21)[0]
+    pos += struct.unpack_from(">H", font, pos)[0]   # the first jump table entry skips the table
+    while True:                         # 16-bit part: encoding, size
+        code = struct.unpack_from(">H", font, pos)[0]
+        if code == 0:
+            break
+        table[code] = pos + 3
+        pos += font[pos + 2]
+    return table
+
+
+def pack(font, codes):
+    """Convert the given code points of a u8g2 font to (height, index entries, bitmap bytes)."""
+    max_h, y_off = font[10], struct.unpack("b", font[12:13])[0]
+    ascent = max_h + y_off              # baseline from the top of the line
+    table = glyph_table(font)
+    entries, bitmap = [], bytearray()
+    for code in sorted(c for c in codes if c in table and c <= 0xFFFF):
+        w, h, x, y, dx, rows = decode_glyph(font, table[code])
+        entries.append((code, max(dx, 0), w, h, x, ascent - (h + y), 0, len(bitmap)))
+        for row in rows:
+            for i in range(0, w, 8):
+                byte = 0
+                for j, bit in enumerate(row[i:i + 8]):
+                    byte |= bit << (7 - j)
+                bitmap.append(byte)
+    return max_h, entries, bytes(bitmap)
+
+
+# ---------------------------------------------------------------- output
+
+def ui_codes(sketch):
+    with open(sketch, "r", encoding="utf-8") as f:
+        source = f.read()
+    codes = set(range(0x20, 0x7F))
+    for literal in re.findall(r'UI_TEXT\(\s*((?:"(?:[^"\\]|\\.)*"\s*)+)\)', source):
+        codes |= {ord(c) for c in c_string(literal.encode("utf-8").decode("latin-1")).decode("utf-8")}
+    return codes
+
+
+def write_header(path, fonts):
+    lines = ["// Generated by tools/fontsubset.py. Do not edit.", ""]
+    for name, (height, entries, bitmap) in fonts:
+        lines.append("const struct PackedGlyph ui_%s_index[%d] = {" % (name, len(entries)))
+        lines += ["  {0x%04X, %d, %d, %d, %d, %d, %d, %d}," % e for e in entries]
+        lines.append("};")
+        lines.append("const uint8_t ui_%s_bitmap[%d] = {" % (name, max(len(bitmap), 1)))
+        for i in range(0, len(bitmap), 16):
+            lines.append("  " + " ".join("0x%02X," % b for b in bitmap[i:i + 16]))
+        lines.append("};")
+        lines.append("const struct PackedFont ui_%s = {%d, %d, ui_%s_index, ui_%s_bitmap};"
+                     % (name, len(entries), height, name, name))
+        lines.append("")
+    with open(path, "w", encoding="utf-8") as f:
+        f.write("\n".join(lines))
+
+
+def write_font_file(path, height, entries, bitmap):
+    pages = [entries[i][0] for i in range(0, len(entries), 1 << PAGE_SHIFT)]
+    with open(path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(entries), height, PAGE_SHIFT))
+        f.write(struct.pack("<%dH" % len(pages), *pages))
+        for e in entries:
+            f.write(INDEX.pack(*e))
+        f.write(bitmap)
+
+
+def preview(height, entries, bitmap, text):
+    index = {e[0]: e for e in entries}
+    for ch in text:
+        e = index.get(ord(ch))
+        if e is None:
+            print("U+%04X: missing" % ord(ch))
+            continue
+        code, advance, w, h, x, y, _, offset = e
+        stride = (w + 7) // 8
+        grid = [[" "] * max(advance, x + w, 1) for _ in range(height)]
+        for r in range(h):
+            for c in range(w):
+                if bitmap[offset + r * stride + c // 8] & (0x80 >> (c % 8)) and 0 <= y + r < height:
+                    grid[y + r][x + c] = "#"
+        print("U+%04X advance %d" % (code, advance))
+        print("\n".join("|" + "".join(row) + "|" for row in grid))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--source", action="append", required=True)
+    ap.add_argument("--sketch", default="main.cpp")
+    ap.add_argument("--ui", action="append", default=[], help="u8g2 font to subset for UI_TEXT strings")
+    ap.add_argument("--header", default="ui_font.h")
+    ap.add_argument("--sd", help="u8g2 font to convert whole into a font file for the SD card")
+    ap.add_argument("--sd-out", default="tag16.fnt")
+    ap.add_argument("--preview")
+    args = ap.parse_args()
+
+    codes = ui_codes(args.sketch)
+    fonts = []
+    for name in args.ui:
+        height, entries, bitmap = pack(load_font(args.source, name), codes)
+        too_big = [e[0] for e in entries if e[1] > GLYPH_MAX or height > GLYPH_MAX]
+        if too_big:
+            sys.exit("%s: glyphs wider or taller than %d: %s" % (name, GLYPH_MAX, too_big[:8]))
+        missing = sorted(codes - {e[0] for e in entries})
+        if missing:
+            print("%s: not in font: %s" % (name, "".join(chr(c) for c in missing)), file=sys.stderr)
+        fonts.append((name, (height, entries, bitmap)))
+        print("%s: %d glyphs, %d bytes" % (name, len(entries), len(entries) * INDEX.size + len(bitmap)))
+    if fonts:
+        write_header(args.header, fonts)
+        if args.preview:
+            preview(*fonts[0][1], args.preview)
+
+    if args.sd:
+        height, entries, bitmap = pack(load_font(args.source, args.sd), range(0x10000))
+        write_font_file(args.sd_out, height, entries, bitmap)
+        print("%s: %d glyphs -> %s" % (args.sd, len(entries), args.sd_out))
+
+
+if __name__ == "__main__":
+    main()
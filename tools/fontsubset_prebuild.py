@@ -0,0 +1,64 @@
+"""PlatformIO pre-build hook that regenerates ui_font.h with fontsubset.py.
+
+Add to the environment in platformio.ini:
+
+    extra_scripts = pre:tools/fontsubset_prebuild.py
+
+Before every build it subsets the UI fonts to the UI_TEXT("...") strings in
+main.cpp and writes ui_font.h next to it, but only when main.cpp or
+fontsubset.py is newer than the header. The u8g2 font arrays are looked up
+in the installed libraries (LovyanGFX ships them). If they cannot be found
+the header is left alone and the firmware links the full fonts as before.
+
+The SD card font (/.font/tag16.fnt) is not part of the firmware image; build
+it once with fontsubset.py --sd.
+"""
+
+import os
+import subprocess
+
+Import("env")  # noqa: F821  (provided by PlatformIO's SCons environment)
+
+UI_FONTS = ("b12_t_japanese2", "b10_t_japanese2")
+SOURCE_EXT = (".c", ".h", ".cpp", ".hpp")
+
+
+def font_sources(roots):
+    """Library files that define one of the UI fonts."""
+    found = []
+    for root in roots:
+        for folder, _dirs, files in os.walk(root):
+            for name in files:
+                if not name.endswith(SOURCE_EXT):
+                    continue
+                path = os.path.join(folder, name)
+                with open(path, "r", encoding="latin-1") as f:
+                    text = f.read()
+                if any(font + "[" in text or font + " [" in text for font in UI_FONTS):
+                    found.append(path)
+    return found
+
+
+def build_ui_font():
+    project = env.subst("$PROJECT_DIR")
+    sketch = os.path.join(env.subst("$PROJECT_SRC_DIR"), "main.cpp")
+    header = os.path.join(os.path.dirname(sketch), "ui_font.h")
+    tool = os.path.join(project, "tools", "fontsubset.py")
+
+    if os.path.exists(header) and os.path.getmtime(header) >= max(os.path.getmtime(sketch), os.path.getmtime(tool)):
+        return
+    roots = [env.subst("$PROJECT_LIBDEPS_DIR/$PIOENV"), env.subst("$PROJECT_DIR/lib")]
+    sources = font_sources([r for r in roots if os.path.isdir(r)])
+    if not sources:
+        print("fontsubset: u8g2 font sources not found, linking the full UI fonts")
+        return
+
+    cmd = [env.subst("$PYTHONEXE"), tool, "--sketch", sketch, "--header", header]
+    for path in sources:
+        cmd += ["--source", path]
+    for font in UI_FONTS:
+        cmd += ["--ui", font]
+    subprocess.check_call(cmd)
+
+
+build_ui_font()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Check the player's table-driven MPEG frame header decoder against the spec.
+
+Builds decodeFrameHeader() from mpeg_frame.h on the host with a small driver
+(against the Arduino stubs in host/stubs) and decodes a generated corpus of
+headers:
+
+  - every combination of the 13 bits from version to private bit, with each
+    channel mode and mode extension
+  - random 32-bit words (half of them with a frame sync)
+
+Each result is compared with a reference written from the formulas in
+ISO/IEC 11172-3 2.4.2.3 and ISO/IEC 13818-3 2.4.2.3 (frame length
+  Layer I:      (12 * bitrate / fs + padding) * 4
+  Layer II/III: 144 * bitrate / fs + padding  (72 * ... for MPEG-2/2.5 Layer III)
+). Free-format and reserved values must be rejected. The Layer II
+bitrate/mode restrictions are not checked by either side.
+
+    python3 framecheck.py [path/to/mpeg_frame.h] [random_count]
+
+Needs a host C++ compiler ($CXX, default c++). Exits with status 1 on any
+mismatch. The host build (host/CMakeLists.txt) runs it as the framecheck test.
+"""
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+# Bitrate index 1..14 [kbps], ISO/IEC 11172-3 Table 2.4.2.3 and 13818-3
+BITRATES = {
+    (1, 1): [32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448],
+    (1, 2): [32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384],
+    (1, 3): [32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320],
+    (2, 1): [32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256],
+    (2, 2): [8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160],
+    (2, 3): [8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160],
+}
+# Sampling frequency index 0..2 [Hz] for MPEG-1, MPEG-2 and MPEG-2.5
+SAMPLING = {3: [44100, 48000, 32000], 2: [22050, 24000, 16000], 0: [11025, 12000, 8000]}
+
+DRIVER = r"""
+#include <stdio.h>
+#include "mpeg_frame.h"
+int main()
+{
+  unsigned long h;
+  while (scanf("%lx", &h) == 1) {
+    struct MPEGFrameHeader f = {0};
+    if (decodeFrameHeader((uint32_t)h, &f)) {
+      printf("1 %u %u %u %u %u %u %u %u %u\n", f.version, f.layer, f.crc, f.bitrate,
+             f.sampling_rate, f.padding_bit, f.channel, f.samples, f.frame_size);
+    } else {
+      printf("0\n");
+    }
+  }
+  return 0;
+}
+"""
+
+
+def reference(h):
+    """Decode one header with the spec formulas (None if it must be rejected)."""
+    if h >> 21 != 0x7FF:
+        return None
+    version = (h >> 19) & 3
+    layer_bits = (h >> 17) & 3
+    index = (h >> 12) & 15
+    fs_index = (h >> 10) & 3
+    if version == 1 or layer_bits == 0 or index in (0, 15) or fs_index == 3:
+        return None
+    layer = 4 - layer_bits
+    family = 1 if version == 3 else 2
+    bitrate = BITRATES[(family, layer)][index - 1]
+    fs = SAMPLING[version][fs_index]
+    padding = (h >> 9) & 1
+    if layer == 1:
+        samples = 384
+        size = (12 * bitrate * 1000 // fs + padding) * 4
+    elif layer == 3 and family == 2:
+        samples = 576
+        size = 72 * bitrate * 1000 // fs + padding
+    else:
+        samples = 1152
+        size = 144 * bitrate * 1000 // fs + padding
+    crc = 1 if ((h >> 16) & 1) == 0 else 0
+    return (version, layer, crc, bitrate, fs, padding, (h >> 6) & 3, samples, size)
+
+
+def corpus(count):
+    headers = []
+    for bits in range(1 << 13):
+        for low in range(0, 256, 16):           # channel mode and mode extension
+            headers.append(0xFFE00000 | (bits << 8) | low)
+    rng = random.Random(42)
+    for i in range(count):
+        word = rng.getrandbits(32)
+        headers.append(word | 0xFFE00000 if i % 2 == 0 else word)
+    return headers
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    header = os.path.abspath(sys.argv[1]) if len(sys.argv) > 1 else os.path.join(here, "..", "mpeg_frame.h")
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 100000
+    includes = ["-I", os.path.dirname(header), "-I", os.path.join(here, "..", "host", "stubs")]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        cpp = os.path.join(tmp, "framecheck.cpp")
+        exe = os.path.join(tmp, "framecheck")
+        with open(cpp, "w", encoding="utf-8") as f:
+            f.write(DRIVER)
+        subprocess.run([os.environ.get("CXX", "c++"), "-std=gnu++11", "-O1"] + includes + ["-o", exe, cpp], check=True)
+        headers = corpus(count)
+        out = subprocess.run([exe], input="\n".join("%08x" % h for h in headers) + "\n",
+                             capture_output=True, text=True, check=True).stdout.split("\n")
+
+    mismatches = 0
+    valid = 0
+    for h, line in zip(headers, out):
+        fields = [int(v) for v in line.split()]
+        got = tuple(fields[1:]) if fields[0] else None
+        want = reference(h)
+        valid += want is not None
+        if got != want:
+            mismatches += 1
+            if mismatches <= 20:
+                print("%08x: decoder %s, spec %s" % (h, got, want))
+    print("%d headers, %d valid, %d mismatches" % (len(headers), valid, mismatches))
+    sys.exit(1 if mismatches or len(out) < len(headers) else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Compare two input replay logs from the player and report latency regressions.
+
+Record a button sequence by sending 'R' over the serial port, operate the
+player, and send 'R' again to save it to the card. Send 'P' from the same
+screen to replay it; the player prints one JSON line per action. Save the
+serial output of a baseline replay and of a new build and run:
+
+    python3 replaycmp.py baseline.log new.log [tolerance_percent]
+
+Exits with status 1 if any action got slower than the tolerance (default 20%)
+or lost a frame flush / audio start it had in the baseline.
+Lines that are not replay results are skipped.
+"""
+
+import json
+import sys
+
+SLACK_US = 2000                         # ignore differences below this
+
+
+def read_actions(path):
+    actions = []
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            try:
+                rec = json.loads(line)
+            except ValueError:
+                continue
+            if isinstance(rec.get("replay"), int):
+                actions.append(rec)
+    return actions
+
+
+def compare(base, new, tolerance):
+    failed = False
+    if len(base) != len(new):
+        print("action count differs: %d -> %d" % (len(base), len(new)))
+        failed = True
+    for b, n in zip(base, new):
+        for key in ("flush_us", "audio_us"):
+            was, now = b[key], n[key]
+            if was < 0:
+                continue
+            if now < 0:
+                print("#%d gpio %d: %s missing (was %d us)" % (b["replay"], b["gpio"], key, was))
+                failed = True
+            elif now > was * (1 + tolerance) and now - was > SLACK_US:
+                print("#%d gpio %d: %s %d -> %d us" % (b["replay"], b["gpio"], key, was, now))
+                failed = True
+    return failed
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
+    tolerance = float(sys.argv[3]) / 100 if len(sys.argv) == 4 else 0.2
+    failed = compare(read_actions(sys.argv[1]), read_actions(sys.argv[2]), tolerance)
+    print("FAIL" if failed else "OK")
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Report flash/IRAM/DRAM usage of player builds and the difference between them.
+
+Build the firmware once per configuration by adding the feature set to the
+compiler flags, for example
+
+    -DPLAYER_FEATURES=FEATURES_BASELINE     (folder playback only)
+    -DPLAYER_FEATURES=FEATURES_FULL         (default)
+
+keep the .elf of each build and run:
+
+    python3 sizereport.py baseline.elf full.elf [more.elf ...]
+
+Prints one JSON line per build and, for every build after the first, one
+JSON line with the difference from the first build.
+Only the ESP32 section layout (ESP-IDF linker script) is recognised.
+"""
+
+import json
+import os
+import struct
+import sys
+
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+
+# section name prefix -> category
+CATEGORIES = (
+    (".iram0", "iram"),
+    (".dram0.bss", "dram_bss"),
+    (".dram0", "dram_data"),
+    (".flash.text", "flash_code"),
+    (".flash.rodata", "flash_rodata"),
+    (".flash.appdesc", "flash_rodata"),
+    (".rtc", "rtc"),
+)
+KEYS = ("flash_code", "flash_rodata", "iram", "dram_data", "dram_bss", "rtc", "flash_image")
+
+
+def read_sections(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+        raise ValueError("%s: not a little-endian 32-bit ELF file" % path)
+    shoff, = struct.unpack_from("<I", data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x2E)
+
+    headers = [struct.unpack_from("<IIIIIIIIII", data, shoff + i * shentsize) for i in range(shnum)]
+    strtab = headers[shstrndx][4]
+    for name, kind, flags, _addr, _offset, size, *_ in headers:
+        end = data.index(b"\0", strtab + name)
+        yield data[strtab + name:end].decode(), kind, flags, size
+
+
+def measure(path):
+    usage = dict.fromkeys(KEYS, 0)
+    for name, kind, flags, size in read_sections(path):
+        if not flags & SHF_ALLOC:
+            continue
+        for prefix, key in CATEGORIES:
+            if name.startswith(prefix):
+                usage[key] += size
+                break
+        if kind != SHT_NOBITS:
+            usage["flash_image"] += size        # everything with contents is stored in flash
+    return usage
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
+    builds = [(os.path.basename(p), measure(p)) for p in sys.argv[1:]]
+    base_name, base = builds[0]
+    for name, usage in builds:
+        print(json.dumps(dict(build=name, **usage)))
+    for name, usage in builds[1:]:
+        print(json.dumps(dict(build=name, relative_to=base_name,
+                              **{k: usage[k] - base[k] for k in KEYS})))
+
+
+if __name__ == "__main__":
+    main()
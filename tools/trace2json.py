@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Convert a binary trace dump from the player into Chrome trace JSON.
+
+Send 'T' over the serial port to make the player dump its trace ring, save
+the raw bytes (e.g. with a serial terminal's log-to-file option) and run:
+
+    python3 trace2json.py capture.bin > trace.json
+
+Open trace.json in chrome://tracing or https://ui.perfetto.dev.
+Text printed to Serial between dumps is skipped.
+"""
+
+import json
+import struct
+import sys
+
+MAGIC = b"TRC1"
+EVENT = struct.Struct("<IBBH")          # time[us], type, arg, value
+
+# TraceType in main.cpp
+SPANS = {0: "decode", 1: "sd_read", 2: "flush", 4: "track_begin"}
+INSTANTS = {3: "button", 5: "volume", 6: "tag_error", 7: "underrun", 8: "buffer", 12: "no_memory",
+            13: "library_scan"}
+HEAP = 9
+CPU_FREQ = 10
+SLEEP = 11
+NO_MEMORY = 12
+LIBRARY_SCAN = 13
+LOST = 0xFF                             # slot was being written or overwritten while dumping
+
+BUTTONS = {14: "PREV", 26: "PLAY", 27: "NEXT", 13: "BACK", 16: "VOL_UP", 17: "VOL_DOWN"}
+BTN_STATUS = {2: "press", 3: "long_press", 4: "repeat"}
+TAG_ERRORS = {
+    1: "File could not open.",
+    2: "ID3v2 Header read failed.",
+    3: "MPEG Frame Header read failed.",
+    4: "MPEG frame sync not found.",
+    5: "Font file invalid.",
+}
+ALLOCATIONS = {
+    1: "Playlist shuffle order.",
+    2: "Library sort run.",
+    3: "Shuffle index.",
+}
+THREADS = {"decode": 1, "sd_read": 2, "flush": 3, "track_begin": 1}
+
+
+def read_events(data):
+    pos = 0
+    while True:
+        pos = data.find(MAGIC, pos)
+        if pos < 0 or pos + 8 > len(data):
+            return
+        count, lost = struct.unpack_from("<HH", data, pos + 4)
+        pos += 8
+        if lost:
+            print("warning: %d events were overwritten before the dump" % lost, file=sys.stderr)
+        skipped = 0
+        for _ in range(count):
+            if pos + EVENT.size > len(data):
+                return
+            event = EVENT.unpack_from(data, pos)
+            pos += EVENT.size
+            if event[1] == LOST:
+                skipped += 1
+                continue
+            yield event
+        if skipped:
+            print("warning: %d events were overwritten during the dump" % skipped, file=sys.stderr)
+
+
+def convert(data):
+    out = []
+    base = 0
+    last = None
+    for time, kind, arg, value in read_events(data):
+        # micros() wraps every ~71 minutes
+        if last is not None and time < last and last - time > 0x80000000:
+            base += 1 << 32
+        last = time
+        ts = base + time
+
+        if kind in SPANS:
+            name = SPANS[kind]
+            out.append({"name": name, "ph": "X", "ts": ts, "dur": value,
+                        "pid": 1, "tid": THREADS[name]})
+        elif kind == HEAP:
+            out.append({"name": "heap_kib", "ph": "C", "ts": ts, "pid": 1,
+                        "args": {"free": value, "max_alloc": arg}})
+        elif kind == CPU_FREQ:
+            out.append({"name": "cpu_mhz", "ph": "C", "ts": ts, "pid": 1,
+                        "args": {"mhz": value, "load_percent": arg}})
+        elif kind == SLEEP:
+            # recorded on wake-up; value is the sleep length in ms
+            out.append({"name": "light_sleep" + (" (button)" if arg else ""), "ph": "X",
+                        "ts": ts - value * 1000, "dur": value * 1000, "pid": 1, "tid": 5})
+        elif kind in INSTANTS:
+            name = INSTANTS[kind]
+            args = {}
+            if kind == 3:
+                name = "%s %s" % (BUTTONS.get(arg, arg), BTN_STATUS.get(value, value))
+            elif kind == 5:
+                args["volume"] = value / 100.0
+            elif kind == 6:
+                args["error"] = TAG_ERRORS.get(arg, arg)
+            elif kind == 7:
+                args["decode_us"] = value
+            elif kind == 8:
+                args["dma_buffers"] = arg
+                args["readahead_bytes"] = value
+            elif kind == NO_MEMORY:
+                args["allocation"] = ALLOCATIONS.get(arg, arg)
+                args["kib"] = value
+            elif kind == LIBRARY_SCAN:
+                args["changed_dirs"] = arg
+                args["sign_ms"] = value
+            out.append({"name": name, "ph": "i", "s": "p", "ts": ts,
+                        "pid": 1, "tid": 4, "args": args})
+    meta = [{"name": "thread_name", "ph": "M", "pid": 1, "tid": tid, "args": {"name": name}}
+            for tid, name in ((1, "audio"), (2, "sd"), (3, "display"), (4, "input"), (5, "power"))]
+    return {"traceEvents": meta + out, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__, file=sys.stderr)
+        sys.exit(1)
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    json.dump(convert(data), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()